@@ -4,7 +4,10 @@
 
 #include "Particle.h"        // Particle Library for Photon 2 use
 #include "MAX30105.h"        // SparkFun-MAX3010x
+#include "MAX30105Poller.h"  // services each probe in turn
+#include "MAX30105GainControl.h" // keeps LED drive and ADC range in the linear band
 #include "spo2_algorithm.h"  // Same library for sensor
+#include "heartRate.h"       // per beat detector, a rate before the SpO2 window is full
 
 SYSTEM_THREAD(ENABLED);      // keeps loop() responsive during cloud reconnects
 
@@ -12,7 +15,7 @@ SYSTEM_THREAD(ENABLED);      // keeps loop() responsive during cloud reconnects
 const unsigned long MEASUREMENT_INTERVAL_MS = 5UL * 60UL * 1000UL;  // default: 30 min
 const unsigned long PROMPT_WINDOW_MS        = 5UL * 60UL * 1000UL;  // prompt window: 5 min
 const unsigned long LED_BLINK_MS            = 500;                  // blink speed
-const unsigned long SAMPLE_INTERVAL_MS      = 40;                   // 25 Hz sampling on sensor
+const unsigned long WINDOW_MS               = 4000;                 // seconds of signal per SpO2/HR window
 const unsigned long ACK_TIMEOUT_MS          = 20UL * 1000UL;        // wait up to 20s for webhook response
 const unsigned long BACKLOG_FLUSH_DELAY_MS  = 20UL * 1000UL;        // stay idle 20s between backlog attempts
 const unsigned long FREQUENCY_REFRESH_MS    = 60UL * 60UL * 1000UL; // 1 hour
@@ -24,6 +27,15 @@ const uint8_t ALLOWED_END_HOUR   = 22;  // default: 10pm
 
 const uint32_t FINGER_IR_THRESHOLD = 20000; // tune the sensor for finger detection
 const uint8_t  STABLE_REQUIRED     = 6;     // consecutive valid algorithm outputs needed
+const bool     EARLY_ACCEPT        = true;  // finish sooner when the beat rate confirms the window
+const uint8_t  EARLY_STABLE_REQUIRED = 2;   // valid outputs needed when it does
+const uint8_t  BEAT_AGREE_BPM      = 5;     // beat rate and window HR count as agreeing within this
+const uint8_t  POOR_SIGNAL_LIMIT   = 10;    // windows in a row failing the quality check before re-prompting
+
+const uint8_t  PROX_PILOT_AMPLITUDE = 0x04; // 0.8mA IR pilot while waiting for a finger
+// Finger-removed level scaled from the 0x0A start drive to the pilot, top 8 of 18 bits
+const uint8_t  PROX_THRESHOLD       = ((FINGER_IR_THRESHOLD / 2) * PROX_PILOT_AMPLITUDE / 0x0A) >> 10;
+const unsigned long PROX_POLL_MS    = 1000; // read PROX_INT even if INT is not wired
 
 // Particle webhook event name 
 const char* MEAS_EVENT = "Photon2_SendEvent";
@@ -35,29 +47,61 @@ unsigned long measurementIntervalMs = MEASUREMENT_INTERVAL_MS; // updated via se
 
 // |~~~~~~~~~~~~~~| Sensor Vars |~~~~~~~~~~~~~~|
 MAX30105 particleSensor;
+MAX30105Poller sensorPoller;   // one slot per probe, each on its own I2C bus
+int8_t primaryProbe = -1;      // poller slot of particleSensor
+MAX30105GainControl sensorGain; // LED current / ADC range loop for particleSensor
+
+const int     SENSOR_INT_PIN       = D2;   // MAX30102 INT (open drain, active low)
+const uint8_t FIFO_SAMPLES_PER_IRQ = 20;   // one burst drain per 20 samples
+
+static const int BUFFER_LENGTH = BUFFER_SIZE; // room for WINDOW_MS at up to 25 Hz
+const int SPO2_HOP_SAMPLES = FIFO_SAMPLES_PER_IRQ; // a fresh result per FIFO drain
+
+// Sliding window over the last windowLength samples, with sample times from
+// the driver. Kept up to date per sample, analysed every SPO2_HOP_SAMPLES.
+maxim_spo2_stream spo2Stream;
+bool spo2ResultDue = false;
+uint8_t poorSignalCount = 0;   // results in a row whose window failed spo2Stream.sqi
 
-static const int BUFFER_LENGTH = 100; // 4 seconds at 25 Hz
-uint32_t irBuffer[BUFFER_LENGTH];
-uint32_t redBuffer[BUFFER_LENGTH];
+// Every sample also goes through the PBA beat detector. Its beat to beat rate is there
+// a few beats after the finger goes on, long before the first full window.
+BeatDetector<> beatDetector;
+BeatRate beatRate;
+uint8_t beatBpm = 0;           // provisional heart rate, 0 until BeatRate has one
+bool beatBpmAnnounced = false; // provisional rate printed for this window
+BeatVariability beatVariability; // RR intervals and HRV over the whole acquisition
+
+// Per-device SpO2 curve from the server config, the flash default until one arrives
+maxim_spo2_cal_table spo2Calibration(SPO2_CAL_A, SPO2_CAL_B, SPO2_CAL_C);
 
 int32_t spo2 = 0;
 int8_t  validSPO2 = 0;
 int32_t heartRate = 0;
 int8_t  validHeartRate = 0;
 
-unsigned long lastSampleTime = 0;
-int  bufferIndex   = 0;
-bool bufferFilled  = false;
+uint32_t samplePeriodUs = 1000000UL / FreqS; // what the sensor actually delivers, read back in setup()
+int  windowLength  = BUFFER_LENGTH;          // samples in WINDOW_MS at that rate
 
 uint32_t lastIR  = 0;
 uint32_t lastRed = 0;
 
+uint32_t droppedSamples  = 0;  // samples the sensor discarded because the FIFO overflowed
+uint32_t sampleGapEvents = 0;  // times the sample stream went discontinuous
+
+float sensorTempC = 0;         // die temperature, refreshed once per acquisition
+
+unsigned long lastProxCheckMs = 0; // last look at PROX_INT during a prompt
+
 // |~~~~~~~~~~~~~~| Offline Queue in EEPROM |~~~~~~~~~~~~~~|
 // Stores up to ~24h worth at custom interval (Max 64 - should give enough head room)
 struct MeasurementRecord {
   uint32_t timestamp;   // Unix seconds 
   int16_t  heartRate;
   int16_t  spo2;
+  uint16_t rmssd;       // ms, HRV over the acquisition, 0 without enough beats
+  uint16_t sdnn;        // ms
+  uint8_t  pnn50;       // % of successive RR differences over 50 ms
+  uint8_t  rrCount;     // RR intervals behind sdnn, up to 255
   uint16_t reserved;    // for alignment
 };
 
@@ -67,7 +111,7 @@ struct QueueHeader {
   uint16_t count;       // number of valid records
 };
 
-const uint32_t QUEUE_MAGIC    = 0x51305130; // marker
+const uint32_t QUEUE_MAGIC    = 0x51305131; // marker, changes with the record layout
 const uint16_t QUEUE_CAPACITY = 64;
 const int EEPROM_ADDR_HEADER  = 0;
 const int EEPROM_ADDR_RECORDS = EEPROM_ADDR_HEADER + sizeof(QueueHeader);
@@ -284,6 +328,22 @@ int parseFrequencySeconds(const String &body) {
   return body.substring(start, idx).toInt();
 }
 
+// Signed integer config value, false when the key is missing
+bool parseConfigInt(const String &body, const char *key, int32_t *value) {
+  int idx = body.indexOf(key);
+  if (idx < 0) return false;
+  idx = body.indexOf(":", idx);
+  if (idx < 0) return false;
+  idx++;
+  while (idx < (int)body.length() && body[idx] != '-' && !isDigit(body[idx])) idx++;
+  int start = idx;
+  if (idx < (int)body.length() && body[idx] == '-') idx++;
+  while (idx < (int)body.length() && isDigit(body[idx])) idx++;
+  if (start >= (int)body.length()) return false;
+  *value = body.substring(start, idx).toInt();
+  return true;
+}
+
 // Get current server config
 void requestMeasurementFrequency() {
   // Publish the event, the server will receive it via the webhook
@@ -330,6 +390,15 @@ void onConfigResponse(const char *event, const char *data) {
         Serial.printlnf("Updated measurement interval: %d sec", frequencySec);
     }
   }
+
+  // SpO2 % = (a*R^2 + b*R + c) / 1000, R the plain red/IR ratio (see spo2_algorithm.h), all three or none
+  int32_t calA, calB, calC;
+  if (parseConfigInt(body, "spo2CalA", &calA) &&
+      parseConfigInt(body, "spo2CalB", &calB) &&
+      parseConfigInt(body, "spo2CalC", &calC)) {
+    spo2Calibration = maxim_spo2_cal_table(calA, calB, calC);
+    Serial.printlnf("Updated SpO2 calibration: %ld %ld %ld", (long)calA, (long)calB, (long)calC);
+  }
 }
 
 void onCloudConnect(const char* event, const char* data) {
@@ -348,50 +417,107 @@ void onCloudConnect(const char* event, const char* data) {
 
 // Reset the sensor value storage to help increase accuracy 
 void resetAcquisitionBuffers() {
-  bufferIndex  = 0;
-  bufferFilled = false;
-  stableCount  = 0;
-  lastSampleTime = 0;
+  restartAnalysisWindow();
   validSPO2 = 0;
   validHeartRate = 0;
+  beatVariability.reset();
 
   // Start clean
   particleSensor.clearFIFO();
+  sensorGain.reset();
+
+  // Collected by the next FIFO drain, no waiting here
+  particleSensor.startTemperature();
 }
 
-// Reads one sample
-void updateMax30102() {
-    unsigned long now = millis();
-    if (now - lastSampleTime < SAMPLE_INTERVAL_MS) return;
-    lastSampleTime = now;
+// Drop the partial window, the samples in it can't be analysed together
+void restartAnalysisWindow() {
+  maxim_spo2_stream_reset(&spo2Stream);
+  spo2ResultDue = false;
+  stableCount   = 0;
+  poorSignalCount = 0;
+  beatDetector.reset();        // DC estimate from the next sample on
+  beatRate.reset();            // no interval across the restart
+  beatVariability.restart();   // the statistics so far still stand
+  beatBpm = 0;
+  beatBpmAnnounced = false;
+}
 
-    if (!particleSensor.available()) {
-        particleSensor.check();
-        if (!particleSensor.available()) return;
-    }
+// Let the sensor watch for a finger by itself: IR pilot only, no FIFO
+// traffic, no algorithm. PROX_INT wakes the full pipeline. A MAX30102 has
+// no proximity mode, it keeps sampling and the prompt watches the IR level.
+void armFingerDetect() {
+  particleSensor.startProximityDetect(PROX_PILOT_AMPLITUDE, PROX_THRESHOLD);
+  lastProxCheckMs = millis();
+}
 
-    // updates lastIR/lastRed and runs algorithm when bufferFilled.
-    lastRed = particleSensor.getRed();
-    lastIR  = particleSensor.getIR();
+// Die temperature arrives alongside a FIFO drain
+void onSensorTemperature(void *context, float celsius) {
+  (void)context;
+  sensorTempC = celsius;
+}
 
-    redBuffer[bufferIndex] = lastRed;
-    irBuffer[bufferIndex]  = lastIR;
+// drainFIFO() sink: each FIFO record slides straight into the analysis window
+void onSensorSample(void *context, const MAX30105::FIFOSample &sample) {
+    (void)context;
 
-    particleSensor.nextSample();
+    sensorGain.addSample(sample.red, sample.IR);
 
-    bufferIndex++;
-    if (bufferIndex >= BUFFER_LENGTH) {
-        bufferIndex = 0;
-        bufferFilled = true;
+    // We fell behind and the sensor overwrote samples. Don't splice two
+    // stretches of signal into one window, start the window over instead.
+    if (sample.gap > 0) {
+        droppedSamples += sample.gap;
+        sampleGapEvents++;
+        restartAnalysisWindow();
     }
 
-    if (bufferFilled) {
-        maxim_heart_rate_and_oxygen_saturation(
-            irBuffer, BUFFER_LENGTH,
-            redBuffer,
-            &spo2, &validSPO2,
-            &heartRate, &validHeartRate
-        );
+    lastRed = sample.red;
+    lastIR  = sample.IR;
+
+    if (beatDetector.checkForBeat((int32_t)lastIR)) {
+        // Back to the zero crossing between this sample and the one before
+        uint32_t beatUs = sample.timestamp - ((uint32_t)beatDetector.getBeatLag() * samplePeriodUs >> 15);
+        if (beatRate.addBeat(beatUs)) beatBpm = beatRate.getBPM();
+        beatVariability.addBeat(beatUs);
+    }
+
+    if (maxim_spo2_stream_add(&spo2Stream, lastIR, lastRed, sample.timestamp)) {
+        spo2ResultDue = true;
+    }
+}
+
+// Sensor INT pin ISR, the drain itself happens in updateMax30102()
+void onSensorInterrupt() {
+    particleSensor.handleInterrupt();
+}
+
+// Drains every sample the sensor produced since the last interrupt.
+// True when this call ran the algorithm, at most once per SPO2_HOP_SAMPLES.
+bool updateMax30102() {
+    unsigned long now = millis();
+
+    // One burst drain per FIFO almost-full interrupt. The poller's slow
+    // fallback keeps samples flowing if INT is not wired or an edge was missed.
+    // updates lastIR/lastRed and runs the algorithm when a result is due.
+    static uint32_t primaryDrained = 0;
+    sensorPoller.poll();
+    uint32_t drained = sensorPoller.totalSamples(primaryProbe);
+    if (drained == primaryDrained) return false; // nothing new from this probe
+    primaryDrained = drained;
+
+    // A gain change steps the DC level mid-window, start the window over
+    if (sensorGain.adjust()) restartAnalysisWindow();
+
+    // Always the latest windowLength samples in time order, beat intervals
+    // from the real sample times rather than loop timing
+    bool newResult = spo2ResultDue;
+    if (spo2ResultDue) {
+        spo2ResultDue = false;
+        maxim_spo2_stream_result(&spo2Stream,
+                                 &spo2, &validSPO2,
+                                 &heartRate, &validHeartRate);
+        if (spo2Stream.sqi.ch_ok) poorSignalCount = 0;
+        else if (poorSignalCount < 255) poorSignalCount++;
     }
 
     // Debug printing 
@@ -402,15 +528,25 @@ void updateMax30102() {
         lastPrintMs = now;
 
         Serial.printf(
-            "[MAX30102] IR=%lu  RED=%lu  BPM=%d (v=%d)  SpO2=%.d%% (v=%d)  bufFilled=%d  state=%d\n",
+            "[MAX30102] IR=%lu  RED=%lu  BPM=%d (v=%d, beat %d)  SpO2=%.d%% (v=%d)  SQI=%d (PI=%d.%02d%%)  bufFilled=%d  state=%d  dropped=%lu (%lu gaps)  T=%.2fC  LED=%02X/%02X ADC=%u\n",
             (unsigned long)lastIR,
             (unsigned long)lastRed,
-            (int)heartRate, (int)validHeartRate,
+            (int)heartRate, (int)validHeartRate, (int)beatBpm,
             (int)spo2,      (int)validSPO2,
-            (int)bufferFilled,
-            (int)state
+            (int)spo2Stream.sqi.n_score,
+            (int)(spo2Stream.sqi.n_pi / 100), (int)(spo2Stream.sqi.n_pi % 100),
+            (int)maxim_spo2_stream_full(&spo2Stream),
+            (int)state,
+            (unsigned long)droppedSamples,
+            (unsigned long)sampleGapEvents,
+            (double)sensorTempC,
+            (unsigned)particleSensor.getPulseAmplitudeRed(),
+            (unsigned)particleSensor.getPulseAmplitudeIR(),
+            (unsigned)particleSensor.getADCFullScale()
         );
     }
+
+    return newResult;
 }
 
 // Send data to the server
@@ -421,11 +557,19 @@ bool publishMeasurement(const MeasurementRecord &rec) {
             "\"deviceId\":\"%s\","
             "\"heartRate\":%d,"
             "\"spo2\":%d,"
+            "\"rmssd\":%u,"
+            "\"sdnn\":%u,"
+            "\"pnn50\":%u,"
+            "\"rrCount\":%u,"
             "\"timestamp\":%lu"
         "}",
         deviceId.c_str(),
         (int)rec.heartRate,
         (int)rec.spo2,
+        (unsigned)rec.rmssd,
+        (unsigned)rec.sdnn,
+        (unsigned)rec.pnn50,
+        (unsigned)rec.rrCount,
         (unsigned long)rec.timestamp
     );
 
@@ -448,6 +592,7 @@ void enterState(AppState s) {
         Serial.println("\n[STATE] STATE_PROMPT_USER");
         setRgbMode(RGB_BLINK_BLUE);
         digitalWrite(LED_D7, LOW);
+        armFingerDetect();
         break;
 
     case STATE_ACQUIRE:
@@ -534,19 +679,42 @@ void setup() {
     }
 
     // Sensor config
-    byte ledBrightness = 60;
+    byte ledBrightness = 0x0A; // starting drive, sensorGain takes it from here
     byte sampleAverage = 4;
     byte ledMode       = 2;   // Red + IR
-    byte sampleRate    = 25;
+    int  sampleRate    = 100; // 100 Hz ADC / 4x averaging = 25 samples/s
     int  pulseWidth    = 411;
     int  adcRange      = 4096;
 
     particleSensor.setup(ledBrightness, sampleAverage, ledMode, sampleRate, pulseWidth, adcRange);
-    particleSensor.setPulseAmplitudeRed(0x0A);
-    particleSensor.setPulseAmplitudeIR(0x0A);
-    particleSensor.setPulseAmplitudeGreen(0);
-
-    Serial.println("MAX30102 initialized.");
+    particleSensor.setPulseAmplitudeGreen(0); // MAX30102 has no green LED
+
+    // Adapt LED current and ADC range to skin tone, finger pressure and
+    // ambient light once something is on the sensor
+    sensorGain.begin(particleSensor);
+    sensorGain.setMinimumSignal(FINGER_IR_THRESHOLD / 2);
+
+    // Interrupt driven acquisition: INT pulls low when the FIFO is almost full
+    pinMode(SENSOR_INT_PIN, INPUT_PULLUP);
+    attachInterrupt(SENSOR_INT_PIN, onSensorInterrupt, FALLING);
+    particleSensor.enableFIFOInterrupt(FIFO_SAMPLES_PER_IRQ);
+    particleSensor.setTemperatureCallback(onSensorTemperature, NULL);
+
+    // A second probe would go on Wire1 with its own INT pin and buffers
+    primaryProbe = sensorPoller.addSensor(particleSensor, onSensorSample, NULL);
+
+    // Run the sampler and the algorithm at the rate the sensor really produces
+    samplePeriodUs = particleSensor.getSamplePeriodUs();
+    windowLength = (int)(WINDOW_MS * 1000UL / samplePeriodUs);
+    if (windowLength > BUFFER_LENGTH) windowLength = BUFFER_LENGTH;
+    maxim_spo2_stream_init(&spo2Stream, windowLength, SPO2_HOP_SAMPLES, (int32_t)samplePeriodUs, 1);
+    maxim_spo2_stream_set_calibration(&spo2Stream, &spo2Calibration);
+    maxim_spo2_stream_set_sqi_gate(&spo2Stream, 1); // don't analyse windows that can't give a reading
+    // Somewhere between the IRQ period and the FIFO (32 samples) overflowing
+    sensorPoller.setFallbackPoll(primaryProbe, (FIFO_SAMPLES_PER_IRQ + 6) * samplePeriodUs / 1000UL);
+
+    Serial.printlnf("MAX30102 initialized: %.2f samples/s, %d sample window.",
+                    (double)particleSensor.getEffectiveSampleRate(), windowLength);
     
     nextPromptMs = millis() + 2000;
 
@@ -617,11 +785,24 @@ void loop() {
         break;
       }
 
-      // Sample sensor to detect finger presence
-      updateMax30102();
+      // No proximity mode on this part, sample sensor to detect finger presence
+      if (!particleSensor.hasProximityMode()) {
+        updateMax30102();
+        if (lastIR > FINGER_IR_THRESHOLD) {
+          resetAcquisitionBuffers();
+          enterState(STATE_ACQUIRE);
+        }
+        break;
+      }
 
-      // If finger present, start acquisition
-      if (lastIR > FINGER_IR_THRESHOLD) {
+      // The sensor is in proximity mode, nothing to do until PROX_INT
+      if (!particleSensor.interruptPending() && now - lastProxCheckMs < PROX_POLL_MS) break;
+      lastProxCheckMs = now;
+      particleSensor.serviceInterrupt(onSensorSample, NULL);
+
+      // Something is on the sensor, start acquisition. ACQUIRE confirms it is a finger.
+      if (particleSensor.proximityDetected()) {
+        particleSensor.disablePROXINT(); // stay in normal mode until the next prompt
         resetAcquisitionBuffers();
         enterState(STATE_ACQUIRE);
       }
@@ -637,26 +818,66 @@ void loop() {
       }
 
       // Sample 
-      updateMax30102();
+      bool newResult = updateMax30102();
+
+      // If finger removed, go back to prompt (once fresh samples say so)
+      if (spo2Stream.n_count > 0 && lastIR < (FINGER_IR_THRESHOLD / 2)) {
+        enterState(STATE_PROMPT_USER);
+        break;
+      }
 
-      // If finger removed, go back to prompt
-      if (lastIR < (FINGER_IR_THRESHOLD / 2)) {
+      // Motion, a loose finger or a clipped channel for several windows in a
+      // row won't settle by itself, prompt again instead of waiting it out
+      if (poorSignalCount >= POOR_SIGNAL_LIMIT) {
+        Serial.printlnf("Poor signal (SQI=%d, PI=%d, clip=%d%%, periodicity=%d%%), prompting again",
+                        (int)spo2Stream.sqi.n_score, (int)spo2Stream.sqi.n_pi,
+                        (int)spo2Stream.sqi.n_clip_pct, (int)spo2Stream.sqi.n_periodicity);
         enterState(STATE_PROMPT_USER);
         break;
       }
 
-      // Track stability once algorithm is running
-      if (bufferFilled && validHeartRate == 1 && validSPO2 == 1) {
-        stableCount++;
-      } 
-      else stableCount = 0;
+      // Track stability once algorithm is running, one step per result rather than per loop pass
+      if (newResult) {
+        if (maxim_spo2_stream_full(&spo2Stream) && validHeartRate == 1 && validSPO2 == 1) {
+          stableCount++;
+        } 
+        else stableCount = 0;
+      }
+
+      // A provisional rate as soon as the beat detector has one
+      if (beatBpm != 0 && !beatBpmAnnounced) {
+        beatBpmAnnounced = true;
+        Serial.printlnf("Provisional heart rate %d bpm (%d beats)", (int)beatBpm, (int)beatRate.getIntervalCount() + 1);
+      }
+
+      // Nothing to decide until the next window is in
+      if (!newResult) break;
+
+      // Two independent estimators giving the same rate is as good as a longer run
+      // of valid windows, finish without waiting for the rest of them. A beat rate
+      // with no beat in the last two slowest intervals is out of date.
+      bool beatAgrees = EARLY_ACCEPT && beatBpm != 0 && validHeartRate == 1 &&
+                        micros() - beatRate.getLastBeatUs() < 2UL * 60000000UL / BeatRate::MIN_BPM &&
+                        abs((int)heartRate - (int)beatBpm) <= BEAT_AGREE_BPM;
+
+      if (stableCount >= STABLE_REQUIRED || (beatAgrees && stableCount >= EARLY_STABLE_REQUIRED)) {
+        if (stableCount < STABLE_REQUIRED) {
+          Serial.printlnf("Beat rate %d bpm agrees with window HR %d bpm, finishing early",
+                          (int)beatBpm, (int)heartRate);
+        }
 
-      if (stableCount >= STABLE_REQUIRED) {
         // Latch a single measurement taken after data looks good
         pending.timestamp = bestEffortTimestamp();
         pending.heartRate = (int16_t)heartRate;
         pending.spo2      = (int16_t)spo2;
+        pending.rmssd     = beatVariability.getRMSSD();
+        pending.sdnn      = beatVariability.getSDNN();
+        pending.pnn50     = beatVariability.getPNN50();
+        pending.rrCount   = (uint8_t)min((int)beatVariability.getIntervalCount(), 255);
         pending.reserved  = 0;
+        Serial.printlnf("HRV: RMSSD=%u ms  SDNN=%u ms  pNN50=%u%%  (%u RR intervals)",
+                        (unsigned)pending.rmssd, (unsigned)pending.sdnn,
+                        (unsigned)pending.pnn50, (unsigned)beatVariability.getIntervalCount());
 
         pendingValid = true;
         enterState(STATE_MEASUREMENT_READY);
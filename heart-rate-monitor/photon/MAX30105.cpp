@@ -3,7 +3,8 @@
   It should also work with the MAX30102. However, the MAX30102 does not have a Green LED.
 
   These sensors use I2C to communicate, as well as a single (optional)
-  interrupt line that is not currently supported in this driver.
+  interrupt line. Route INT to a GPIO interrupt that calls handleInterrupt()
+  and drain with serviceInterrupt() (see enableFIFOInterrupt()).
 
   Written by Peter Jansen and Nathan Seidle (SparkFun)
   BSD license, all text above must be included in any redistribution.
@@ -137,6 +138,22 @@ static const uint8_t MAX_30105_EXPECTEDPARTID = 0x15;
 
 MAX30105::MAX30105() {
   // Constructor
+  _interruptPending = false;
+  _lastINT1 = 0;
+  _overflowCount = 0;
+  _pendingGap = 0;
+  _recordsBeforeGap = 0;
+  _lastTimestamp = 0;
+  _timestampValid = false;
+  _droppedSamples = 0;
+  _proximitySupported = false;
+  _temperaturePending = false;
+  _temperature = 0;
+  _temperatureCallback = NULL;
+  _temperatureContext = NULL;
+  memset(shadow, 0, sizeof(shadow)); //POR values
+  shadowDirty = 0;
+  deferWrites = false;
 }
 
 boolean MAX30105::begin(TwoWire &wirePort, uint32_t i2cSpeed, uint8_t i2caddr) {
@@ -158,6 +175,12 @@ boolean MAX30105::begin(TwoWire &wirePort, uint32_t i2cSpeed, uint8_t i2caddr) {
 
   // Populate revision ID
   readRevisionID();
+
+  // The MAX30102 answers with the same part ID, tell it apart by its missing proximity block
+  probeProximity();
+
+  // Pick up whatever configuration the part is running with
+  loadShadow();
   
   return true;
 }
@@ -212,7 +235,8 @@ void MAX30105::disableDIETEMPRDY(void) {
 //End Interrupt configuration
 
 void MAX30105::softReset(void) {
-  bitMask(MAX30105_MODECONFIG, MAX30105_RESET_MASK, MAX30105_RESET);
+  //Every other bit of MODECONFIG is reset along with the rest, so no need to preserve them
+  writeRegister8(_i2caddr, MAX30105_MODECONFIG, MAX30105_RESET);
 
   // Poll for bit to clear, reset is then complete
   // Timeout after 100ms
@@ -223,6 +247,10 @@ void MAX30105::softReset(void) {
     if ((response & MAX30105_RESET) == 0) break; //We're done!
     delay(1); //Let's not over burden the I2C bus
   }
+
+  //Configuration is back at POR values, anything still pending is moot
+  memset(shadow, 0, sizeof(shadow));
+  shadowDirty = 0;
 }
 
 void MAX30105::shutDown(void) {
@@ -248,6 +276,19 @@ void MAX30105::setADCRange(uint8_t adcRange) {
   bitMask(MAX30105_PARTICLECONFIG, MAX30105_ADCRANGE_MASK, adcRange);
 }
 
+//Full scale photodiode current in nA, rounded down to the nearest range
+void MAX30105::setADCFullScale(uint16_t nanoAmps) {
+  if(nanoAmps < 4096) setADCRange(MAX30105_ADCRANGE_2048); //7.81pA per LSB
+  else if(nanoAmps < 8192) setADCRange(MAX30105_ADCRANGE_4096); //15.63pA per LSB
+  else if(nanoAmps < 16384) setADCRange(MAX30105_ADCRANGE_8192); //31.25pA per LSB
+  else if(nanoAmps == 16384) setADCRange(MAX30105_ADCRANGE_16384); //62.5pA per LSB
+  else setADCRange(MAX30105_ADCRANGE_2048);
+}
+
+uint16_t MAX30105::getADCFullScale(void) {
+  return (2048 << ((shadow[shadowIndex(MAX30105_PARTICLECONFIG)] & ~MAX30105_ADCRANGE_MASK) >> 5));
+}
+
 void MAX30105::setSampleRate(uint8_t sampleRate) {
   // sampleRate: one of MAX30105_SAMPLERATE_50, _100, _200, _400, _800, _1000, _1600, _3200
   bitMask(MAX30105_PARTICLECONFIG, MAX30105_SAMPLERATE_MASK, sampleRate);
@@ -261,19 +302,27 @@ void MAX30105::setPulseWidth(uint8_t pulseWidth) {
 // NOTE: Amplitude values: 0x00 = 0mA, 0x7F = 25.4mA, 0xFF = 50mA (typical)
 // See datasheet, page 21
 void MAX30105::setPulseAmplitudeRed(uint8_t amplitude) {
-  writeRegister8(_i2caddr, MAX30105_LED1_PULSEAMP, amplitude);
+  setShadow(MAX30105_LED1_PULSEAMP, amplitude);
 }
 
 void MAX30105::setPulseAmplitudeIR(uint8_t amplitude) {
-  writeRegister8(_i2caddr, MAX30105_LED2_PULSEAMP, amplitude);
+  setShadow(MAX30105_LED2_PULSEAMP, amplitude);
 }
 
 void MAX30105::setPulseAmplitudeGreen(uint8_t amplitude) {
-  writeRegister8(_i2caddr, MAX30105_LED3_PULSEAMP, amplitude);
+  setShadow(MAX30105_LED3_PULSEAMP, amplitude);
 }
 
 void MAX30105::setPulseAmplitudeProximity(uint8_t amplitude) {
-  writeRegister8(_i2caddr, MAX30105_LED_PROX_AMP, amplitude);
+  setShadow(MAX30105_LED_PROX_AMP, amplitude);
+}
+
+uint8_t MAX30105::getPulseAmplitudeRed(void) {
+  return (shadow[shadowIndex(MAX30105_LED1_PULSEAMP)]);
+}
+
+uint8_t MAX30105::getPulseAmplitudeIR(void) {
+  return (shadow[shadowIndex(MAX30105_LED2_PULSEAMP)]);
 }
 
 void MAX30105::setProximityThreshold(uint8_t threshMSB) {
@@ -312,8 +361,8 @@ void MAX30105::enableSlot(uint8_t slotNumber, uint8_t device) {
 
 //Clears all slot assignments
 void MAX30105::disableSlots(void) {
-  writeRegister8(_i2caddr, MAX30105_MULTILEDCONFIG1, 0);
-  writeRegister8(_i2caddr, MAX30105_MULTILEDCONFIG2, 0);
+  setShadow(MAX30105_MULTILEDCONFIG1, 0);
+  setShadow(MAX30105_MULTILEDCONFIG2, 0);
 }
 
 //
@@ -350,6 +399,28 @@ void MAX30105::setFIFOAlmostFull(uint8_t numberOfSamples) {
   bitMask(MAX30105_FIFOCONFIG, MAX30105_A_FULL_MASK, numberOfSamples);
 }
 
+//ADC conversions per FIFO record, indexed by SMP_AVE (Table 3, Page 18)
+static const uint8_t sampleAverages[8] = {1, 2, 4, 8, 16, 32, 32, 32};
+
+//ADC samples per second, indexed by SPO2_SR (Table 6, Page 19)
+static const uint16_t sampleRates[8] = {50, 100, 200, 400, 800, 1000, 1600, 3200};
+
+//Time between FIFO records as currently programmed
+uint32_t MAX30105::getSamplePeriodUs(void) {
+  uint8_t averages = sampleAverages[(shadow[shadowIndex(MAX30105_FIFOCONFIG)] & ~MAX30105_SAMPLEAVG_MASK) >> 5];
+  uint16_t rate = sampleRates[(shadow[shadowIndex(MAX30105_PARTICLECONFIG)] & ~MAX30105_SAMPLERATE_MASK) >> 2];
+
+  return ((1000000UL * averages) / rate);
+}
+
+//FIFO records per second as currently programmed
+float MAX30105::getEffectiveSampleRate(void) {
+  uint8_t averages = sampleAverages[(shadow[shadowIndex(MAX30105_FIFOCONFIG)] & ~MAX30105_SAMPLEAVG_MASK) >> 5];
+  uint16_t rate = sampleRates[(shadow[shadowIndex(MAX30105_PARTICLECONFIG)] & ~MAX30105_SAMPLERATE_MASK) >> 2];
+
+  return ((float)rate / averages);
+}
+
 //Read the FIFO Write Pointer
 uint8_t MAX30105::getWritePointer(void) {
   return (readRegister8(_i2caddr, MAX30105_FIFOWRITEPTR));
@@ -363,36 +434,72 @@ uint8_t MAX30105::getReadPointer(void) {
 
 // Die Temperature
 // Returns temp in C
+// Blocks for the ~30ms conversion, see startTemperature() for the non-blocking way
 float MAX30105::readTemperature() {
 	
-  //DIE_TEMP_RDY interrupt must be enabled
-  //See issue 19: https://github.com/sparkfun/SparkFun_MAX3010x_Sensor_Library/issues/19
-  
   // Step 1: Config die temperature register to take 1 temperature sample
-  writeRegister8(_i2caddr, MAX30105_DIETEMPCONFIG, 0x01);
+  startTemperature();
 
-  // Poll for bit to clear, reading is then complete
+  // Poll for DIE_TEMP_RDY, reading is then complete
   // Timeout after 100ms
   unsigned long startTime = millis();
   while (millis() - startTime < 100)
   {
-    //uint8_t response = readRegister8(_i2caddr, MAX30105_DIETEMPCONFIG); //Original way
-    //if ((response & 0x01) == 0) break; //We're done!
-    
-	//Check to see if DIE_TEMP_RDY interrupt is set
-	uint8_t response = readRegister8(_i2caddr, MAX30105_INTSTAT2);
-    if ((response & MAX30105_INT_DIE_TEMP_RDY_ENABLE) > 0) break; //We're done!
+    if (checkTemperature()) break; //We're done!
     delay(1); //Let's not over burden the I2C bus
   }
   //TODO How do we want to fail? With what type of error?
   //? if(millis() - startTime >= 100) return(-999.0);
 
-  // Step 2: Read die temperature register (integer)
-  int8_t tempInt = readRegister8(_i2caddr, MAX30105_DIETEMPINT);
-  uint8_t tempFrac = readRegister8(_i2caddr, MAX30105_DIETEMPFRAC); //Causes the clearing of the DIE_TEMP_RDY interrupt
+  // Step 2: Read die temperature registers
+  if (_temperaturePending) fetchTemperature();
 
-  // Step 3: Calculate temperature (datasheet pg. 23)
-  return (float)tempInt + ((float)tempFrac * 0.0625);
+  return (_temperature);
+}
+
+//Start a single die temperature conversion and return right away
+void MAX30105::startTemperature(void) {
+  setShadow(MAX30105_DIETEMPCONFIG, 0x01); //TEMP_EN, clears itself when the conversion ends
+  _temperaturePending = true;
+}
+
+//Check whether the pending conversion finished, and read it out if so
+//One register read while pending, nothing otherwise
+bool MAX30105::checkTemperature(void) {
+  if (!_temperaturePending) return (false);
+
+  //Check to see if DIE_TEMP_RDY interrupt is set
+  //See issue 19: https://github.com/sparkfun/SparkFun_MAX3010x_Sensor_Library/issues/19
+  uint8_t response = readRegister8(_i2caddr, MAX30105_INTSTAT2);
+  if ((response & MAX30105_INT_DIE_TEMP_RDY_ENABLE) == 0) return (false);
+
+  fetchTemperature();
+  return (true);
+}
+
+bool MAX30105::temperaturePending(void) {
+  return (_temperaturePending);
+}
+
+float MAX30105::getTemperature(void) {
+  return (_temperature);
+}
+
+void MAX30105::setTemperatureCallback(TemperatureCallback callback, void *context) {
+  _temperatureCallback = callback;
+  _temperatureContext = context;
+}
+
+//Read the integer and fraction registers in one burst
+void MAX30105::fetchTemperature(void) {
+  uint8_t raw[2];
+  readRegisterBurst(_i2caddr, MAX30105_DIETEMPINT, raw, 2); //Reading DIETEMPFRAC clears DIE_TEMP_RDY
+
+  // Calculate temperature (datasheet pg. 23)
+  _temperature = (float)(int8_t)raw[0] + ((float)(raw[1] & 0x0F) * 0.0625);
+  _temperaturePending = false;
+
+  if (_temperatureCallback != NULL) _temperatureCallback(_temperatureContext, _temperature);
 }
 
 // Returns die temp in F
@@ -409,6 +516,35 @@ void MAX30105::setPROXINTTHRESH(uint8_t val) {
   writeRegister8(_i2caddr, MAX30105_PROXINTTHRESH, val);
 }
 
+//Parks the part in proximity mode. Writing PROX_INT_EN is what (re)enters it,
+//so this also re-arms after a previous detection.
+void MAX30105::startProximityDetect(uint8_t pilotAmplitude, uint8_t threshMSB) {
+  if (!_proximitySupported) return; //PROX_INT_EN is reserved on the MAX30102
+
+  setPulseAmplitudeProximity(pilotAmplitude);
+  setPROXINTTHRESH(threshMSB);
+
+  getINT1(); //Drop a stale PROX_INT so it can't wake us straight away
+  _lastINT1 = 0;
+  enablePROXINT();
+}
+
+bool MAX30105::proximityDetected(void) {
+  return ((_lastINT1 & MAX30105_INT_PROX_INT_ENABLE) != 0);
+}
+
+bool MAX30105::hasProximityMode(void) {
+  return (_proximitySupported);
+}
+
+//PROX_INT_THRESH only exists on the MAX30105. On the MAX30102 0x30 is reserved and
+//reads back 0 whatever was written, so a pattern that survives the round trip means proximity mode.
+void MAX30105::probeProximity() {
+  writeRegister8(_i2caddr, MAX30105_PROXINTTHRESH, 0xA5);
+  _proximitySupported = (readRegister8(_i2caddr, MAX30105_PROXINTTHRESH) == 0xA5);
+  writeRegister8(_i2caddr, MAX30105_PROXINTTHRESH, 0x00); //POR value
+}
+
 
 //
 // Device ID and Revision
@@ -436,6 +572,8 @@ uint8_t MAX30105::getRevisionID() {
 void MAX30105::setup(byte powerLevel, byte sampleAverage, byte ledMode, int sampleRate, int pulseWidth, int adcRange) {
   softReset(); //Reset all configuration, threshold, and data registers to POR values
 
+  beginConfig(); //Settings below only touch the shadow until commit()
+
   //FIFO Configuration
   //-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
   //The chip will average multiple samples of same type together if you wish
@@ -461,11 +599,7 @@ void MAX30105::setup(byte powerLevel, byte sampleAverage, byte ledMode, int samp
 
   //Particle Sensing Configuration
   //-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
-  if(adcRange < 4096) setADCRange(MAX30105_ADCRANGE_2048); //7.81pA per LSB
-  else if(adcRange < 8192) setADCRange(MAX30105_ADCRANGE_4096); //15.63pA per LSB
-  else if(adcRange < 16384) setADCRange(MAX30105_ADCRANGE_8192); //31.25pA per LSB
-  else if(adcRange == 16384) setADCRange(MAX30105_ADCRANGE_16384); //62.5pA per LSB
-  else setADCRange(MAX30105_ADCRANGE_2048);
+  setADCFullScale(adcRange);
 
   if (sampleRate < 100) setSampleRate(MAX30105_SAMPLERATE_50); //Take 50 samples per second
   else if (sampleRate < 200) setSampleRate(MAX30105_SAMPLERATE_100);
@@ -511,6 +645,8 @@ void MAX30105::setup(byte powerLevel, byte sampleAverage, byte ledMode, int samp
   //enableSlot(3, SLOT_GREEN_PILOT);
   //-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
 
+  commit(); //Three short bursts instead of a read-modify-write per setting
+
   clearFIFO(); //Reset the FIFO before we begin checking the sensor
 }
 
@@ -589,29 +725,93 @@ void MAX30105::nextSample(void)
 //Call regularly
 //If new data is available, it updates the head and tail in the main struct
 //Returns number of new samples obtained
+//Note: sense only holds STORAGE_SIZE records, older ones are overwritten. Use drainFIFO() to keep every sample.
 uint16_t MAX30105::check(void)
+{
+  return (drainFIFO(storeSense, this));
+}
+
+//check() sink, pushes a record onto the sense array
+void MAX30105::storeSense(void *context, const FIFOSample &sample)
+{
+  MAX30105 *sensor = (MAX30105 *)context;
+
+  sensor->sense.head++; //Advance the head of the storage struct
+  sensor->sense.head %= STORAGE_SIZE; //Wrap condition
+
+  sensor->sense.red[sensor->sense.head] = sample.red;
+  sensor->sense.IR[sensor->sense.head] = sample.IR;
+  sensor->sense.green[sensor->sense.head] = sample.green;
+}
+
+//Reads up to maxSamples records out of the FIFO and hands each one to sink, oldest first
+//Records left behind stay in the FIFO for the next call
+//Samples the part had to throw away are reported through FIFOSample::gap
+//Returns number of samples handed to sink
+uint16_t MAX30105::drainFIFO(SampleSink sink, void *context, uint16_t maxSamples)
 {
   //Read register FIDO_DATA in (3-byte * number of active LED) chunks
   //Until FIFO_RD_PTR = FIFO_WR_PTR
 
-  byte readPointer = getReadPointer();
-  byte writePointer = getWritePointer();
+  //FIFO_WR_PTR, OVF_COUNTER and FIFO_RD_PTR are neighbours, grab all three at once
+  byte pointers[3];
+  readRegisterBurst(_i2caddr, MAX30105_FIFOWRITEPTR, pointers, 3);
+  uint32_t drainMicros = micros(); //The newest record in the FIFO was taken at most one period before this
 
-  int numberOfSamples = 0;
+  byte writePointer = pointers[0] & 0x1F;
+  _overflowCount = pointers[1] & 0x1F; //Saturates at 31, so this is a lower bound
+  byte readPointer = pointers[2] & 0x1F;
 
-  //Do we have new data?
-  if (readPointer != writePointer)
+  //Do we have new data? Equal pointers with an overflow mean the FIFO is full, not empty
+  int numberOfSamples = 0;
+  if (readPointer != writePointer || _overflowCount > 0)
   {
-    //Calculate the number of readings we need to get from sensor
     numberOfSamples = writePointer - readPointer;
-    if (numberOfSamples < 0) numberOfSamples += 32; //Wrap condition
+    if (numberOfSamples <= 0) numberOfSamples += 32; //Wrap condition
+  }
+
+  //With rollover the oldest records were overwritten, so the hole is in front of what we read now.
+  //Without it new records were refused, so the hole follows every record in the FIFO right now
+  //and stays there until those have all been handed out, however many drains that takes.
+  //A second overflow before the first hole is reached is merged into it.
+  uint8_t gap = 0;
+  if (_overflowCount > 0)
+  {
+    _droppedSamples += _overflowCount;
+    if (shadow[shadowIndex(MAX30105_FIFOCONFIG)] & MAX30105_ROLLOVER_ENABLE) gap = _overflowCount;
+    else
+    {
+      if (_pendingGap == 0) _recordsBeforeGap = numberOfSamples;
+      _pendingGap = (_pendingGap + _overflowCount > 255) ? 255 : _pendingGap + _overflowCount;
+    }
+  }
+
+  if (numberOfSamples > 0)
+  {
+    //Records enter the FIFO at the data rate, so count back from the newest one to date the oldest.
+    //The newest was taken somewhere in the last period, call it half a period ago.
+    uint32_t samplePeriod = getSamplePeriodUs();
+    uint32_t timestamp = drainMicros - samplePeriod / 2 - (numberOfSamples - 1) * samplePeriod;
+
+    //Past a pending hole that count holds, records ahead of it are older by the refused samples.
+    //The overflow counter saturates, so they are dated on from the last record handed out when there is one.
+    uint32_t afterGapTimestamp = timestamp + _recordsBeforeGap * samplePeriod;
+    if (_pendingGap > 0 && _recordsBeforeGap > 0)
+      timestamp = _timestampValid ? _lastTimestamp + samplePeriod : timestamp - _pendingGap * samplePeriod;
+
+    //Loop jitter moves the drain time around, a contiguous batch starts no sooner than one period after the previous one ended
+    bool holeInFront = (_pendingGap > 0 && _recordsBeforeGap == 0);
+    if (_timestampValid && gap == 0 && !holeInFront && (int32_t)(timestamp - _lastTimestamp) < (int32_t)samplePeriod)
+      timestamp = _lastTimestamp + samplePeriod;
+
+    if (numberOfSamples > maxSamples) numberOfSamples = maxSamples;
 
     //We now have the number of readings, now calc bytes to read
     //For this example we are just doing Red and IR (3 bytes each)
     int bytesLeftToRead = numberOfSamples * activeLEDs * 3;
 
     //Get ready to read a burst of data from the FIFO register
-    _i2cPort->beginTransmission(MAX30105_ADDRESS);
+    _i2cPort->beginTransmission(_i2caddr);
     _i2cPort->write(MAX30105_FIFODATA);
     _i2cPort->endTransmission();
 
@@ -633,60 +833,33 @@ uint16_t MAX30105::check(void)
       bytesLeftToRead -= toGet;
 
       //Request toGet number of bytes from sensor
-      _i2cPort->requestFrom(MAX30105_ADDRESS, toGet);
+      _i2cPort->requestFrom((uint8_t)_i2caddr, (uint8_t)toGet);
       
       while (toGet > 0)
       {
-        sense.head++; //Advance the head of the storage struct
-        sense.head %= STORAGE_SIZE; //Wrap condition
+        FIFOSample sample;
 
-        byte temp[sizeof(uint32_t)]; //Array of 4 bytes that we will convert into long
-        uint32_t tempLong;
-
-        //Burst read three bytes - RED
-        temp[3] = 0;
-        temp[2] = _i2cPort->read();
-        temp[1] = _i2cPort->read();
-        temp[0] = _i2cPort->read();
-
-        //Convert array to long
-        memcpy(&tempLong, temp, sizeof(tempLong));
-		
-		tempLong &= 0x3FFFF; //Zero out all but 18 bits
-
-        sense.red[sense.head] = tempLong; //Store this reading into the sense array
-
-        if (activeLEDs > 1)
+        //Refused samples go in front of the first record taken after them
+        if (_pendingGap > 0 && _recordsBeforeGap == 0)
         {
-          //Burst read three more bytes - IR
-          temp[3] = 0;
-          temp[2] = _i2cPort->read();
-          temp[1] = _i2cPort->read();
-          temp[0] = _i2cPort->read();
-
-          //Convert array to long
-          memcpy(&tempLong, temp, sizeof(tempLong));
-
-		  tempLong &= 0x3FFFF; //Zero out all but 18 bits
-          
-		  sense.IR[sense.head] = tempLong;
+          gap = (gap + _pendingGap > 255) ? 255 : gap + _pendingGap;
+          if ((int32_t)(afterGapTimestamp - timestamp) > 0) timestamp = afterGapTimestamp;
+          _pendingGap = 0;
         }
+        if (_recordsBeforeGap > 0) _recordsBeforeGap--;
 
-        if (activeLEDs > 2)
-        {
-          //Burst read three more bytes - Green
-          temp[3] = 0;
-          temp[2] = _i2cPort->read();
-          temp[1] = _i2cPort->read();
-          temp[0] = _i2cPort->read();
+        sample.red = readFIFOChannel(); //Burst read three bytes - RED
+        sample.IR = (activeLEDs > 1) ? readFIFOChannel() : 0; //Burst read three more bytes - IR
+        sample.green = (activeLEDs > 2) ? readFIFOChannel() : 0; //Burst read three more bytes - Green
+        sample.gap = gap;
+        gap = 0; //Only the record after a hole carries it
+        sample.timestamp = timestamp;
 
-          //Convert array to long
-          memcpy(&tempLong, temp, sizeof(tempLong));
+        _lastTimestamp = timestamp;
+        _timestampValid = true;
+        timestamp += samplePeriod;
 
-		  tempLong &= 0x3FFFF; //Zero out all but 18 bits
-
-          sense.green[sense.head] = tempLong;
-        }
+        sink(context, sample);
 
         toGet -= activeLEDs * 3;
       }
@@ -698,6 +871,124 @@ uint16_t MAX30105::check(void)
   return (numberOfSamples); //Let the world know how much new data we found
 }
 
+//
+// Interrupt driven FIFO reading
+//
+
+//Have the sensor pull INT low once samplesPerInterrupt records are waiting in the FIFO
+//One burst drain per interrupt replaces polling the FIFO pointers every loop
+//The A_FULL field can only express 17 to 32 samples, requests outside that are clamped
+void MAX30105::enableFIFOInterrupt(uint8_t samplesPerInterrupt) {
+  if (samplesPerInterrupt < 17) samplesPerInterrupt = 17;
+  if (samplesPerInterrupt > 32) samplesPerInterrupt = 32;
+
+  setFIFOAlmostFull(32 - samplesPerInterrupt); //Register counts the free slots left
+  enableAFULL();
+
+  getINT1(); //Release INT in case a stale status (PWR_RDY, A_FULL) is holding it low
+  _interruptPending = false;
+}
+
+void MAX30105::disableFIFOInterrupt(void) {
+  disableAFULL();
+  _interruptPending = false;
+}
+
+//ISR entry point, INT is active low so attach it on FALLING
+//No I2C here, the bus is not safe to use from interrupt context
+void MAX30105::handleInterrupt(void) {
+  _interruptPending = true;
+}
+
+bool MAX30105::interruptPending(void) {
+  return (_interruptPending);
+}
+
+//Reading INTSTAT1 acknowledges A_FULL and releases INT so the next edge can fire
+//Safe to call without a pending interrupt, e.g. as a slow fallback poll
+//Returns number of samples handed to sink
+//A pending die temperature conversion rides along in the same status burst
+uint16_t MAX30105::serviceInterrupt(SampleSink sink, void *context) {
+  _interruptPending = false; //Clear first so an edge during the drain is not lost
+
+  if (_temperaturePending)
+  {
+    uint8_t status[2];
+    readRegisterBurst(_i2caddr, MAX30105_INTSTAT1, status, 2); //INTSTAT1 and INTSTAT2
+    _lastINT1 = status[0];
+    if (status[1] & MAX30105_INT_DIE_TEMP_RDY_ENABLE) fetchTemperature();
+  }
+  else
+  {
+    _lastINT1 = getINT1();
+  }
+
+  return (drainFIFO(sink, context));
+}
+
+uint8_t MAX30105::getLastINT1(void) {
+  return (_lastINT1);
+}
+
+//FIFO_OVF_COUNTER as read by the last drain
+uint8_t MAX30105::getOverflowCount(void)
+{
+  return (_overflowCount);
+}
+
+//Running total of samples the part discarded because the FIFO was full
+uint32_t MAX30105::getDroppedSamples(void)
+{
+  return (_droppedSamples);
+}
+
+//Context for the array flavour of drainFIFO()
+typedef struct
+{
+  uint32_t *red;
+  uint32_t *IR;
+  uint32_t *time;
+  uint16_t count;
+} array_sink;
+
+static void storeArray(void *context, const MAX30105::FIFOSample &sample)
+{
+  array_sink *dest = (array_sink *)context;
+
+  if (dest->red != NULL) dest->red[dest->count] = sample.red;
+  if (dest->IR != NULL) dest->IR[dest->count] = sample.IR;
+  if (dest->time != NULL) dest->time[dest->count] = sample.timestamp;
+  dest->count++;
+}
+
+//Drains up to maxSamples records into caller owned arrays, index 0 is the oldest
+//Returns number of samples written
+uint16_t MAX30105::drainFIFO(uint32_t *redBuffer, uint32_t *irBuffer, uint16_t maxSamples, uint32_t *timeBuffer)
+{
+  array_sink dest = {redBuffer, irBuffer, timeBuffer, 0};
+
+  return (drainFIFO(storeArray, &dest, maxSamples));
+}
+
+//Reads one 3-byte channel of the current FIFO record
+uint32_t MAX30105::readFIFOChannel(void)
+{
+  byte temp[sizeof(uint32_t)]; //Array of 4 bytes that we will convert into long
+  uint32_t tempLong;
+
+  temp[3] = 0;
+  temp[2] = _i2cPort->read();
+  temp[1] = _i2cPort->read();
+  temp[0] = _i2cPort->read();
+
+  //Convert array to long
+  memcpy(&tempLong, temp, sizeof(tempLong));
+
+  tempLong &= 0x3FFFF; //Zero out all but 18 bits
+
+  return (tempLong);
+}
+
 //Check for new data but give up after a certain amount of time
 //Returns true if new data was found
 //Returns false if new data was not found
@@ -717,8 +1008,16 @@ bool MAX30105::safeCheck(uint8_t maxTimeToCheck)
 }
 
 //Given a register, read it, mask it, and then set the thing
+//Shadowed registers are masked in RAM, no read back from the part
 void MAX30105::bitMask(uint8_t reg, uint8_t mask, uint8_t thing)
 {
+  int8_t index = shadowIndex(reg);
+  if (index >= 0)
+  {
+    setShadow(reg, (shadow[index] & mask) | thing);
+    return;
+  }
+
   // Grab current register context
   uint8_t originalContents = readRegister8(_i2caddr, reg);
 
@@ -729,6 +1028,83 @@ void MAX30105::bitMask(uint8_t reg, uint8_t mask, uint8_t thing)
   writeRegister8(_i2caddr, reg, originalContents | thing);
 }
 
+//
+// Register shadow
+//
+
+//Map a register to its shadow entry
+int8_t MAX30105::shadowIndex(uint8_t reg)
+{
+  if (reg >= MAX30105_FIFOCONFIG && reg <= MAX30105_MULTILEDCONFIG2) return (reg - MAX30105_FIFOCONFIG);
+  if (reg == MAX30105_DIETEMPCONFIG) return (SHADOW_SIZE - 1);
+  return (-1);
+}
+
+//Update the shadow and, unless a batch is open, write it through
+void MAX30105::setShadow(uint8_t reg, uint8_t value)
+{
+  int8_t index = shadowIndex(reg);
+  if (index < 0)
+  {
+    writeRegister8(_i2caddr, reg, value);
+    return;
+  }
+
+  shadow[index] = value;
+  shadowDirty |= (1 << index);
+
+  if (deferWrites == false) flushShadow();
+}
+
+//Read the whole configuration block in one burst
+void MAX30105::loadShadow(void)
+{
+  readRegisterBurst(_i2caddr, MAX30105_FIFOCONFIG, shadow, MAX30105_MULTILEDCONFIG2 - MAX30105_FIFOCONFIG + 1);
+  shadow[SHADOW_SIZE - 1] = readRegister8(_i2caddr, MAX30105_DIETEMPCONFIG) & ~0x01; //TEMP_EN self clears
+  shadowDirty = 0;
+}
+
+//Send every dirty entry, one auto-increment burst per run of neighbouring registers
+//Reserved registers (0x0B, 0x0F) are never dirty so runs split around them
+void MAX30105::flushShadow(void)
+{
+  uint8_t index = 0;
+  while (shadowDirty != 0 && index < SHADOW_SIZE)
+  {
+    if ((shadowDirty & (1 << index)) == 0)
+    {
+      index++;
+      continue;
+    }
+
+    uint8_t runLength = 1;
+    while (index + runLength < SHADOW_SIZE - 1 && (shadowDirty & (1 << (index + runLength)))) runLength++;
+
+    uint8_t reg = (index == SHADOW_SIZE - 1) ? MAX30105_DIETEMPCONFIG : MAX30105_FIFOCONFIG + index;
+    writeRegisterBurst(_i2caddr, reg, &shadow[index], runLength);
+
+    for (uint8_t x = 0 ; x < runLength ; x++) shadowDirty &= ~(1 << (index + x));
+    index += runLength;
+  }
+
+  //Self clearing trigger bits are not part of the steady state configuration
+  shadow[MAX30105_MODECONFIG - MAX30105_FIFOCONFIG] &= ~MAX30105_RESET;
+  shadow[SHADOW_SIZE - 1] &= ~0x01;
+}
+
+//Hold setter writes in the shadow until commit()
+void MAX30105::beginConfig(void)
+{
+  deferWrites = true;
+}
+
+//Send everything changed since beginConfig()
+void MAX30105::commit(void)
+{
+  deferWrites = false;
+  flushShadow();
+}
+
 //
 // Low-level I2C Communication
 //
@@ -752,4 +1128,28 @@ void MAX30105::writeRegister8(uint8_t address, uint8_t reg, uint8_t value) {
   _i2cPort->write(reg);
   _i2cPort->write(value);
   _i2cPort->endTransmission();
+
+  //Keep the shadow honest when callers poke configuration registers directly
+  int8_t index = shadowIndex(reg);
+  if (address == _i2caddr && index >= 0) shadow[index] = value;
+}
+
+//Read count neighbouring registers starting at reg in one transaction
+void MAX30105::readRegisterBurst(uint8_t address, uint8_t reg, uint8_t *values, uint8_t count) {
+  _i2cPort->beginTransmission(address);
+  _i2cPort->write(reg);
+  _i2cPort->endTransmission(false);
+
+  _i2cPort->requestFrom((uint8_t)address, (uint8_t)count);
+  for (uint8_t x = 0 ; x < count ; x++)
+    values[x] = (_i2cPort->available()) ? _i2cPort->read() : 0;
+}
+
+//Write count neighbouring registers starting at reg in one transaction
+void MAX30105::writeRegisterBurst(uint8_t address, uint8_t reg, const uint8_t *values, uint8_t count) {
+  _i2cPort->beginTransmission(address);
+  _i2cPort->write(reg);
+  for (uint8_t x = 0 ; x < count ; x++)
+    _i2cPort->write(values[x]);
+  _i2cPort->endTransmission();
 }
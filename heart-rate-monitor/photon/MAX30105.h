@@ -3,7 +3,8 @@
  It should also work with the MAX30102. However, the MAX30102 does not have a Green LED.
 
  These sensors use I2C to communicate, as well as a single (optional)
- interrupt line that is not currently supported in this driver.
+ interrupt line. Route INT to a GPIO interrupt that calls handleInterrupt()
+ and drain with serviceInterrupt() (see enableFIFOInterrupt()).
  
  Written by Peter Jansen and Nathan Seidle (SparkFun)
  BSD license, all text above must be included in any redistribution.
@@ -62,6 +63,8 @@ class MAX30105 {
   void setLEDMode(uint8_t mode);
 
   void setADCRange(uint8_t adcRange);
+  void setADCFullScale(uint16_t nanoAmps); //2048, 4096, 8192 or 16384, same rounding as setup()
+  uint16_t getADCFullScale(void); //As programmed, in nA
   void setSampleRate(uint8_t sampleRate);
   void setPulseWidth(uint8_t pulseWidth);
 
@@ -69,6 +72,8 @@ class MAX30105 {
   void setPulseAmplitudeIR(uint8_t value);
   void setPulseAmplitudeGreen(uint8_t value);
   void setPulseAmplitudeProximity(uint8_t value);
+  uint8_t getPulseAmplitudeRed(void); //As programmed, no I2C traffic
+  uint8_t getPulseAmplitudeIR(void);
 
   void setProximityThreshold(uint8_t threshMSB);
 
@@ -97,6 +102,11 @@ class MAX30105 {
   void enableFIFORollover();
   void disableFIFORollover();
   void setFIFOAlmostFull(uint8_t samples);
+
+  //Effective output data rate: ADC sample rate divided by FIFO averaging, from the register shadow (no I2C)
+  //e.g. setup(..., sampleAverage = 4, ..., sampleRate = 100) gives 25 records per second
+  uint32_t getSamplePeriodUs(void); //Time between FIFO records
+  float getEffectiveSampleRate(void); //FIFO records per second
   
   //FIFO Reading
   uint16_t check(void); //Checks for new data and fills FIFO
@@ -110,23 +120,80 @@ class MAX30105 {
   uint8_t getReadPointer(void);
   void clearFIFO(void); //Sets the read/write pointers to zero
 
+  //Batch FIFO Reading
+  //Drains the hardware FIFO straight into the caller's storage, bypassing the
+  //STORAGE_SIZE deep sense array that check() fills
+  typedef struct FIFOSample
+  {
+    uint32_t red;
+    uint32_t IR;
+    uint32_t green;
+    uint8_t gap; //Samples lost to FIFO overflow right before this one, 0 if contiguous
+    uint32_t timestamp; //micros() when the sensor took this sample, rebuilt from the drain time and data rate
+  } fifo_sample;
+
+  //Called once per FIFO record, oldest first
+  typedef void (*SampleSink)(void *context, const FIFOSample &sample);
+
+  uint16_t drainFIFO(SampleSink sink, void *context, uint16_t maxSamples = 32); //Returns number of samples handed to sink
+  uint16_t drainFIFO(uint32_t *redBuffer, uint32_t *irBuffer, uint16_t maxSamples, uint32_t *timeBuffer = NULL); //Any buffer may be NULL
+  uint8_t getOverflowCount(void); //FIFO_OVF_COUNTER seen by the last drain
+  uint32_t getDroppedSamples(void); //Samples lost to overflow since begin()
+
+  //Interrupt driven FIFO reading
+  //The A_FULL interrupt pulls INT low once samplesPerInterrupt records are waiting (17 to 32)
+  void enableFIFOInterrupt(uint8_t samplesPerInterrupt = 24);
+  void disableFIFOInterrupt(void);
+  void handleInterrupt(void); //Call from the INT pin ISR. Only latches a flag, no I2C.
+  bool interruptPending(void); //True if the ISR fired since the last serviceInterrupt()
+  uint16_t serviceInterrupt(SampleSink sink, void *context); //Acknowledges INT and drains the FIFO
+  uint8_t getLastINT1(void); //Interrupt status read by the last serviceInterrupt()
+
   //Proximity Mode Interrupt Threshold
   void setPROXINTTHRESH(uint8_t val);
 
+  //Low power presence detection
+  //Only the IR pilot pulses and nothing enters the FIFO until the IR count's top 8 bits
+  //exceed threshMSB. Then PROX_INT fires and normal sampling starts on its own.
+  //The MAX30102 has no proximity mode, there startProximityDetect() does nothing and callers
+  //watch the IR samples themselves. begin() finds out which part it is talking to.
+  void startProximityDetect(uint8_t pilotAmplitude, uint8_t threshMSB);
+  bool proximityDetected(void); //PROX_INT seen by the last serviceInterrupt()
+  bool hasProximityMode(void);
+
   // Die Temperature
   float readTemperature();
   float readTemperatureF();
 
+  //Non-blocking die temperature
+  //startTemperature() kicks off a ~30ms conversion. The result is collected by checkTemperature(),
+  //or for free by serviceInterrupt() which reads INTSTAT2 in the same burst as INTSTAT1.
+  typedef void (*TemperatureCallback)(void *context, float celsius);
+  void startTemperature(void);
+  bool checkTemperature(void); //True once the pending conversion has been read out
+  bool temperaturePending(void);
+  float getTemperature(void); //Last completed reading in C
+  void setTemperatureCallback(TemperatureCallback callback, void *context); //Fired on every completed reading
+
   // Detecting ID/Revision
   uint8_t getRevisionID();
   uint8_t readPartID();  
 
+  // Configuration batching
+  //Registers 0x08-0x12 and 0x21 are shadowed in RAM, so setters never read them back.
+  //Between beginConfig() and commit() setters only touch the shadow, commit() then sends
+  //every change as a few auto-increment bursts.
+  void beginConfig(void);
+  void commit(void);
+
   // Setup the IC with user selectable settings
   void setup(byte powerLevel = 0x1F, byte sampleAverage = 4, byte ledMode = 3, int sampleRate = 400, int pulseWidth = 411, int adcRange = 4096);
 
   // Low-level I2C communication
   uint8_t readRegister8(uint8_t address, uint8_t reg);
   void writeRegister8(uint8_t address, uint8_t reg, uint8_t value);
+  void readRegisterBurst(uint8_t address, uint8_t reg, uint8_t *values, uint8_t count); //Auto-increment read
+  void writeRegisterBurst(uint8_t address, uint8_t reg, const uint8_t *values, uint8_t count); //Auto-increment write
 
  private:
   TwoWire *_i2cPort; //The generic connection to user's chosen I2C hardware
@@ -136,10 +203,44 @@ class MAX30105 {
   byte activeLEDs; //Gets set during setup. Allows check() to calculate how many bytes to read from FIFO
   
   uint8_t revisionID; 
+  bool _proximitySupported; //MAX30105 yes, MAX30102 no
+
+  volatile bool _interruptPending; //Set from ISR context
+  uint8_t _lastINT1;
+
+  uint8_t _overflowCount;
+  uint8_t _pendingGap; //Loss without rollover lands after the records still in the FIFO
+  uint8_t _recordsBeforeGap; //Records still to hand out before _pendingGap applies
+  uint32_t _droppedSamples;
+
+  uint32_t _lastTimestamp; //Timestamp of the newest sample handed out, keeps batches in order
+  bool _timestampValid;
+
+  bool _temperaturePending;
+  float _temperature;
+  TemperatureCallback _temperatureCallback;
+  void *_temperatureContext;
+
+  void fetchTemperature(void);
 
   void readRevisionID();
+  void probeProximity();
 
   void bitMask(uint8_t reg, uint8_t mask, uint8_t thing);
+
+  //Write-through shadow of the configuration registers
+  #define SHADOW_SIZE 12 //0x08 to 0x12, then 0x21
+  uint8_t shadow[SHADOW_SIZE];
+  uint16_t shadowDirty; //One bit per shadow entry
+  bool deferWrites; //Set between beginConfig() and commit()
+
+  int8_t shadowIndex(uint8_t reg); //-1 if reg is not shadowed
+  void setShadow(uint8_t reg, uint8_t value);
+  void loadShadow(void);
+  void flushShadow(void);
+
+  uint32_t readFIFOChannel(void); //Pulls one 3-byte channel off the bus
+  static void storeSense(void *context, const FIFOSample &sample); //check() sink
  
    #define STORAGE_SIZE 4 //Each long is 4 bytes so limit this to fit on your micro
   typedef struct Record
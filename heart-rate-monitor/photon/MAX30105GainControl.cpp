@@ -0,0 +1,158 @@
+/***************************************************
+ Closed loop LED amplitude and ADC range control for a MAX3010x
+
+ See MAX30105GainControl.h
+ *****************************************************/
+
+#include "MAX30105GainControl.h"
+
+static const uint32_t GAIN_CLIP_LEVEL = 0x3E000; //About 97% of the 18-bit full scale
+static const uint8_t GAIN_MIN_AMPLITUDE = 0x02; //Below this the LED output is not linear
+static const uint8_t GAIN_DISCARD_SAMPLES = 2; //Records that may predate the last change
+static const uint16_t GAIN_MIN_RANGE = 2048;
+static const uint16_t GAIN_MAX_RANGE = 16384;
+
+MAX30105GainControl::MAX30105GainControl(void) {
+  _sensor = NULL;
+  _targetLow = 0x10000;
+  _targetHigh = 0x30000;
+  _minimumSignal = 0;
+  _maximumAmplitude = 0xFF;
+  _settleSamples = 8;
+  _adjustments = 0;
+  reset();
+}
+
+void MAX30105GainControl::begin(MAX30105 &sensor) {
+  _sensor = &sensor;
+  reset();
+}
+
+void MAX30105GainControl::setTarget(uint32_t low, uint32_t high) {
+  _targetLow = low;
+  _targetHigh = high;
+}
+
+void MAX30105GainControl::setMinimumSignal(uint32_t counts) {
+  _minimumSignal = counts;
+}
+
+void MAX30105GainControl::setMaximumAmplitude(uint8_t amplitude) {
+  _maximumAmplitude = amplitude;
+}
+
+void MAX30105GainControl::setSettleSamples(uint16_t samples) {
+  _settleSamples = samples;
+}
+
+void MAX30105GainControl::reset(void) {
+  _dcRed = 0;
+  _dcIR = 0;
+  _peakRed = 0;
+  _peakIR = 0;
+  _samples = 0;
+}
+
+//Follows the DC level with a 1/8 exponential average
+void MAX30105GainControl::addSample(uint32_t red, uint32_t ir) {
+  if (_samples < 0xFFFF) _samples++;
+  if (_samples <= GAIN_DISCARD_SAMPLES) return;
+
+  if (_samples == GAIN_DISCARD_SAMPLES + 1)
+  {
+    _dcRed = (int32_t)red << 4;
+    _dcIR = (int32_t)ir << 4;
+  }
+  else
+  {
+    _dcRed += (((int32_t)red << 4) - _dcRed) >> 3;
+    _dcIR += (((int32_t)ir << 4) - _dcIR) >> 3;
+  }
+
+  if (red > _peakRed) _peakRed = red;
+  if (ir > _peakIR) _peakIR = ir;
+}
+
+//Drive that would put dc in the middle of the target band at the current ADC range
+//A clipped channel has no trustworthy DC, halve it and look again after settling
+uint32_t MAX30105GainControl::wantedAmplitude(uint8_t amplitude, uint32_t dc, bool clipped) {
+  if (clipped) return (amplitude / 2);
+  if (dc == 0) return (_maximumAmplitude);
+  return ((uint32_t)amplitude * ((_targetLow + _targetHigh) / 2) / dc);
+}
+
+uint8_t MAX30105GainControl::clampAmplitude(uint32_t amplitude) {
+  if (amplitude < GAIN_MIN_AMPLITUDE) return (GAIN_MIN_AMPLITUDE);
+  if (amplitude > _maximumAmplitude) return (_maximumAmplitude);
+  return ((uint8_t)amplitude);
+}
+
+bool MAX30105GainControl::adjust(void) {
+  if (_sensor == NULL || _samples < GAIN_DISCARD_SAMPLES + _settleSamples) return (false);
+
+  uint32_t dcRed = getDCRed();
+  uint32_t dcIR = getDCIR();
+  if (dcIR < _minimumSignal) return (false); //Nothing on the sensor, don't chase ambient light
+
+  bool redClipped = _peakRed >= GAIN_CLIP_LEVEL;
+  bool irClipped = _peakIR >= GAIN_CLIP_LEVEL;
+  bool redOk = !redClipped && dcRed >= _targetLow && dcRed <= _targetHigh;
+  bool irOk = !irClipped && dcIR >= _targetLow && dcIR <= _targetHigh;
+  if (redOk && irOk) return (false);
+
+  uint8_t ampRed = _sensor->getPulseAmplitudeRed();
+  uint8_t ampIR = _sensor->getPulseAmplitudeIR();
+  uint16_t range = _sensor->getADCFullScale();
+
+  //Channels already in the band keep their drive
+  uint32_t wantRed = redOk ? ampRed : wantedAmplitude(ampRed, dcRed, redClipped);
+  uint32_t wantIR = irOk ? ampIR : wantedAmplitude(ampIR, dcIR, irClipped);
+
+  //The range is shared, move it only when an LED can't get there on its own
+  //Halving the range doubles the counts, so the LEDs need half the drive
+  uint16_t newRange = range;
+  while ((wantRed > _maximumAmplitude || wantIR > _maximumAmplitude) && newRange > GAIN_MIN_RANGE)
+  {
+    newRange >>= 1;
+    wantRed = (wantRed + 1) / 2;
+    wantIR = (wantIR + 1) / 2;
+  }
+  while ((wantRed < GAIN_MIN_AMPLITUDE || wantIR < GAIN_MIN_AMPLITUDE) && newRange < GAIN_MAX_RANGE)
+  {
+    newRange <<= 1;
+    wantRed *= 2;
+    wantIR *= 2;
+  }
+
+  uint8_t newRed = clampAmplitude(wantRed);
+  uint8_t newIR = clampAmplitude(wantIR);
+
+  if (newRed == ampRed && newIR == ampIR && newRange == range)
+  {
+    reset(); //Pinned at a limit, keep watching but don't hammer the bus
+    return (false);
+  }
+
+  //One burst for all of it
+  _sensor->beginConfig();
+  if (newRed != ampRed) _sensor->setPulseAmplitudeRed(newRed);
+  if (newIR != ampIR) _sensor->setPulseAmplitudeIR(newIR);
+  if (newRange != range) _sensor->setADCFullScale(newRange);
+  _sensor->commit();
+
+  _adjustments++;
+  reset();
+  return (true);
+}
+
+uint32_t MAX30105GainControl::getDCRed(void) {
+  return ((uint32_t)(_dcRed >> 4));
+}
+
+uint32_t MAX30105GainControl::getDCIR(void) {
+  return ((uint32_t)(_dcIR >> 4));
+}
+
+uint32_t MAX30105GainControl::getAdjustments(void) {
+  return (_adjustments);
+}
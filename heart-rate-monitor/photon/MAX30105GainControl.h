@@ -0,0 +1,59 @@
+/***************************************************
+ Closed loop LED amplitude and ADC range control for a MAX3010x
+
+ Tracks the DC level of the red and IR channels and steers each LED's drive
+ current so the DC sits inside a target band, well clear of the 18-bit ceiling
+ and far enough above the noise floor for a usable AC component. When an LED
+ runs out of drive (0xFF, or the configured maximum) the shared ADC range is
+ stepped down; when the LEDs are already at the bottom and the signal is still
+ too hot it is stepped up.
+
+ Feed every FIFO record with addSample(), then call adjust() outside the drain.
+ A change puts a step into the signal, so adjust() returning true means the
+ current analysis window is no longer usable.
+ *****************************************************/
+
+#pragma once
+
+#include "MAX30105.h"
+
+class MAX30105GainControl {
+ public:
+  MAX30105GainControl(void);
+
+  void begin(MAX30105 &sensor); //Starts from the sensor's current amplitude and range
+
+  void setTarget(uint32_t low, uint32_t high); //DC band in ADC counts, default 64k to 192k
+  void setMinimumSignal(uint32_t counts); //IR DC below this means no finger, hold the settings
+  void setMaximumAmplitude(uint8_t amplitude); //Caps LED current, 0xFF = 50mA
+  void setSettleSamples(uint16_t samples); //Records to collect after a change before judging again
+
+  void addSample(uint32_t red, uint32_t ir);
+  bool adjust(void); //Reprograms the sensor if needed, true when it did
+
+  void reset(void); //Forget the DC estimate, e.g. after clearFIFO()
+
+  uint32_t getDCRed(void);
+  uint32_t getDCIR(void);
+  uint32_t getAdjustments(void); //Number of times adjust() changed the settings
+
+ private:
+  uint32_t wantedAmplitude(uint8_t amplitude, uint32_t dc, bool clipped);
+  uint8_t clampAmplitude(uint32_t amplitude);
+
+  MAX30105 *_sensor;
+
+  uint32_t _targetLow;
+  uint32_t _targetHigh;
+  uint32_t _minimumSignal;
+  uint8_t _maximumAmplitude;
+  uint16_t _settleSamples;
+
+  int32_t _dcRed; //Exponential average, 4 fractional bits
+  int32_t _dcIR;
+  uint32_t _peakRed; //Largest raw value since the last change
+  uint32_t _peakIR;
+  uint16_t _samples;
+
+  uint32_t _adjustments;
+};
@@ -0,0 +1,77 @@
+/***************************************************
+ Round-robin service loop for several MAX3010x sensors
+
+ See MAX30105Poller.h
+ *****************************************************/
+
+#include "MAX30105Poller.h"
+
+MAX30105Poller::MAX30105Poller(void) {
+  memset(_slots, 0, sizeof(_slots));
+  _count = 0;
+  _next = 0;
+}
+
+int8_t MAX30105Poller::addSensor(MAX30105 &sensor, MAX30105::SampleSink sink, void *context, unsigned long fallbackPollMs) {
+  if (_count >= MAX30105_POLLER_MAX_SENSORS) return (-1);
+
+  sensor_slot &slot = _slots[_count];
+  slot.sensor = &sensor;
+  slot.sink = sink;
+  slot.context = context;
+  slot.fallbackPollMs = fallbackPollMs;
+  slot.lastDrainMs = millis();
+  slot.lastSamples = 0;
+  slot.totalSamples = 0;
+
+  return ((int8_t)_count++);
+}
+
+void MAX30105Poller::setFallbackPoll(uint8_t slot, unsigned long fallbackPollMs) {
+  if (slot >= _count) return;
+  _slots[slot].fallbackPollMs = fallbackPollMs;
+}
+
+//Walks every slot once, beginning where the last poll() left off
+//A sensor is due when its INT fired or it has been quiet for its fallback interval
+uint16_t MAX30105Poller::poll(uint8_t maxSensors) {
+  uint16_t samples = 0;
+  uint8_t serviced = 0;
+  unsigned long now = millis();
+
+  for (uint8_t x = 0 ; x < _count && serviced < maxSensors ; x++)
+  {
+    uint8_t index = (_next + x) % _count;
+    sensor_slot &slot = _slots[index];
+
+    if (!slot.sensor->interruptPending() && now - slot.lastDrainMs < slot.fallbackPollMs) continue;
+
+    slot.lastDrainMs = now;
+    slot.lastSamples = slot.sensor->serviceInterrupt(slot.sink, slot.context);
+    slot.totalSamples += slot.lastSamples;
+    samples += slot.lastSamples;
+    serviced++;
+
+    _next = (index + 1) % _count; //Whoever follows the last serviced sensor goes first next time
+  }
+
+  return (samples);
+}
+
+uint8_t MAX30105Poller::sensorCount(void) {
+  return (_count);
+}
+
+MAX30105 &MAX30105Poller::sensor(uint8_t slot) {
+  return (*_slots[slot].sensor);
+}
+
+uint16_t MAX30105Poller::lastSamples(uint8_t slot) {
+  if (slot >= _count) return (0);
+  return (_slots[slot].lastSamples);
+}
+
+uint32_t MAX30105Poller::totalSamples(uint8_t slot) {
+  if (slot >= _count) return (0);
+  return (_slots[slot].totalSamples);
+}
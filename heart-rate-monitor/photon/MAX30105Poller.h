@@ -0,0 +1,51 @@
+/***************************************************
+ Round-robin service loop for several MAX3010x sensors
+
+ The MAX3010x answers on a fixed address (0x57), so each sensor sits on its own
+ bus (Wire, Wire1, ...). Every sensor is registered with the sink its samples go
+ to, usually one set of analysis buffers per sensor. poll() drains the sensors
+ whose FIFO interrupt fired, or whose fallback poll interval ran out, starting
+ one past the sensor it serviced last so a busy probe can't starve the others.
+
+ Interrupts stay with the caller: route each sensor's INT to its own pin and
+ call that sensor's handleInterrupt() from the ISR.
+ *****************************************************/
+
+#pragma once
+
+#include "MAX30105.h"
+
+#define MAX30105_POLLER_MAX_SENSORS 4
+
+class MAX30105Poller {
+ public:
+  MAX30105Poller(void);
+
+  //Returns the sensor's slot, or -1 when all slots are taken
+  int8_t addSensor(MAX30105 &sensor, MAX30105::SampleSink sink, void *context, unsigned long fallbackPollMs = 1000);
+  void setFallbackPoll(uint8_t slot, unsigned long fallbackPollMs); //Drain even without an interrupt after this long
+
+  //Drains up to maxSensors sensors that are due, returns the number of samples handed to sinks
+  uint16_t poll(uint8_t maxSensors = MAX30105_POLLER_MAX_SENSORS);
+
+  uint8_t sensorCount(void);
+  MAX30105 &sensor(uint8_t slot);
+  uint16_t lastSamples(uint8_t slot); //Samples the slot's last drain produced
+  uint32_t totalSamples(uint8_t slot); //Samples drained from the slot since addSensor()
+
+ private:
+  typedef struct
+  {
+    MAX30105 *sensor;
+    MAX30105::SampleSink sink;
+    void *context;
+    unsigned long fallbackPollMs;
+    unsigned long lastDrainMs;
+    uint16_t lastSamples;
+    uint32_t totalSamples;
+  } sensor_slot;
+
+  sensor_slot _slots[MAX30105_POLLER_MAX_SENSORS];
+  uint8_t _count;
+  uint8_t _next; //Slot the next poll() looks at first
+};
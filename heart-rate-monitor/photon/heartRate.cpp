@@ -55,113 +55,196 @@
 * 
 */
 
+#include <math.h>
 #include "heartRate.h"
 
-int16_t IR_AC_Max = 20;
-int16_t IR_AC_Min = -20;
+const uint16_t PBAFilterCoeffs::coeffs[PBAFilterCoeffs::HALF_TAPS] = {172, 321, 579, 927, 1360, 1858, 2390, 2916, 3391, 3768, 4012, 4096};
 
-int16_t IR_AC_Signal_Current = 0;
-int16_t IR_AC_Signal_Previous;
-int16_t IR_AC_Signal_min = 0;
-int16_t IR_AC_Signal_max = 0;
-int16_t IR_Average_Estimated;
+static BeatDetector<> beatDetector;
 
-int16_t positiveEdge = 0;
-int16_t negativeEdge = 0;
-int32_t ir_avg_reg = 0;
+bool checkForBeat(int32_t sample)
+{
+  return(beatDetector.checkForBeat(sample));
+}
 
-int16_t cbuf[32];
-uint8_t offset = 0;
+int16_t lowPassFIRFilter(int16_t din)
+{
+  return(beatDetector.lowPassFIRFilter(din));
+}
 
-static const uint16_t FIRCoeffs[12] = {172, 321, 579, 927, 1360, 1858, 2390, 2916, 3391, 3768, 4012, 4096};
+void lowPassFIRFilter(const int16_t *din, int16_t *dout, uint16_t count)
+{
+  beatDetector.lowPassFIRFilter(din, dout, count);
+}
 
-//  Heart Rate Monitor functions takes a sample value and the sample number
-//  Returns true if a beat is detected
-//  A running average of four samples is recommended for display on the screen.
-bool checkForBeat(int32_t sample)
+void resetBeatDetector(void)
 {
-  bool beatDetected = false;
+  beatDetector.reset();
+}
 
-  //  Save current state
-  IR_AC_Signal_Previous = IR_AC_Signal_Current;
-  
-  //This is good to view for debugging
-  //Serial.print("Signal_Current: ");
-  //Serial.println(IR_AC_Signal_Current);
+void BeatRate::reset(void)
+{
+  for (uint8_t i = 0 ; i < INTERVAL_COUNT ; i++) _intervals[i] = 0;
+  _lastBeatUs = 0;
+  _count = 0;
+  _spot = 0;
+  _haveBeat = false;
+}
 
-  //  Process next data sample
-  IR_Average_Estimated = averageDCEstimator(&ir_avg_reg, sample);
-  IR_AC_Signal_Current = lowPassFIRFilter(sample - IR_Average_Estimated);
+bool BeatRate::addBeat(uint32_t timeUs)
+{
+  uint32_t interval = timeUs - _lastBeatUs; //Wraps correctly with micros()
 
-  //  Detect positive zero crossing (rising edge)
-  if ((IR_AC_Signal_Previous < 0) & (IR_AC_Signal_Current >= 0))
-  {
-  
-    IR_AC_Max = IR_AC_Signal_max; //Adjust our AC max and min
-    IR_AC_Min = IR_AC_Signal_min;
+  //  Too short is an extra beat: it is dropped without becoming the reference, so the next
+  //  interval is still good
+  if (_haveBeat && (interval < 60000000UL / MAX_BPM)) return(false);
 
-    positiveEdge = 1;
-    negativeEdge = 0;
-    IR_AC_Signal_max = 0;
+  bool first = !_haveBeat;
+  _lastBeatUs = timeUs;
+  _haveBeat = true;
+  if (first) return(false);
 
-    //if ((IR_AC_Max - IR_AC_Min) > 100 & (IR_AC_Max - IR_AC_Min) < 1000)
-    if ((IR_AC_Max - IR_AC_Min) > 20 & (IR_AC_Max - IR_AC_Min) < 1000)
-    {
-      //Heart beat!!!
-      beatDetected = true;
-    }
-  }
+  //  Too long is a missed beat or lost contact, the next one starts from this beat
+  if (interval > 60000000UL / MIN_BPM) return(false);
 
-  //  Detect negative zero crossing (falling edge)
-  if ((IR_AC_Signal_Previous > 0) & (IR_AC_Signal_Current <= 0))
+  _intervals[_spot++] = interval;
+  _spot %= INTERVAL_COUNT;
+  if (_count < INTERVAL_COUNT) _count++;
+  return(true);
+}
+
+uint8_t BeatRate::getBPM(void) const
+{
+  if (_count < MIN_INTERVALS) return(0);
+
+  //  Insertion sort of at most INTERVAL_COUNT values, then the mean of all but the shortest
+  //  and the longest: as robust as the median against one bad interval, and at 25 samples/s
+  //  (40 ms steps) it doesn't round every rate to what a single interval can express
+  uint32_t sorted[INTERVAL_COUNT];
+  for (uint8_t i = 0 ; i < _count ; i++)
   {
-    positiveEdge = 0;
-    negativeEdge = 1;
-    IR_AC_Signal_min = 0;
+    uint32_t v = _intervals[i];
+    uint8_t j = i;
+    for (; (j > 0) && (sorted[j - 1] > v) ; j--) sorted[j] = sorted[j - 1];
+    sorted[j] = v;
   }
+  uint8_t first = (_count > 2) ? 1 : 0;
+  uint8_t last = (_count > 2) ? _count - 1 : _count;
+  uint32_t sum = 0;
+  for (uint8_t i = first ; i < last ; i++) sum += sorted[i];
+
+  //  60e6 * n / sum, rounded
+  uint32_t n = last - first;
+  return((uint8_t)(((uint64_t)60000000UL * n + sum / 2) / sum));
+}
+
+void BeatVariability::reset(void)
+{
+  for (uint8_t i = 0 ; i < RING_LENGTH ; i++) _ring[i] = 0;
+  _ringSum = 0;
+  _ringCount = 0;
+  _ringSpot = 0;
+  _rejectRun = 0;
+  _lastIntervalUs = 0;
+  _count = 0;
+  _mean = 0;
+  _m2 = 0;
+  _diffCount = 0;
+  _nn50Count = 0;
+  _sumSquaredDiff = 0;
+  restart();
+}
+
+void BeatVariability::restart(void)
+{
+  _lastBeatUs = 0;
+  _haveBeat = false;
+  _havePrevious = false;
+}
+
+bool BeatVariability::addBeat(uint32_t timeUs)
+{
+  uint32_t interval = timeUs - _lastBeatUs; //Wraps correctly with micros()
+
+  //  An extra beat is dropped like in BeatRate, the interval after it runs from the last real
+  //  beat and still follows the one before
+  if (_haveBeat && (interval < 60000000UL / BeatRate::MAX_BPM)) return(false);
+
+  bool first = !_haveBeat;
+  _lastBeatUs = timeUs;
+  _haveBeat = true;
+  if (first) return(false);
 
-  //  Find Maximum value in positive cycle
-  if (positiveEdge & (IR_AC_Signal_Current > IR_AC_Signal_Previous))
+  bool artifact = (interval > 60000000UL / BeatRate::MIN_BPM);
+  if (!artifact && (_ringCount >= MIN_RING))
   {
-    IR_AC_Signal_max = IR_AC_Signal_Current;
+    uint32_t mean = _ringSum / _ringCount;
+    uint32_t change = (interval > mean) ? interval - mean : mean - interval;
+    artifact = (change > mean / 100 * MAX_CHANGE_PCT);
   }
 
-  //  Find Minimum value in negative cycle
-  if (negativeEdge & (IR_AC_Signal_Current < IR_AC_Signal_Previous))
+  if (artifact)
   {
-    IR_AC_Signal_min = IR_AC_Signal_Current;
+    _havePrevious = false;
+
+    //  Half a ring of artifacts in a row is a new rhythm rather than bad beats, compare with
+    //  what comes next instead
+    if (++_rejectRun >= RING_LENGTH / 2)
+    {
+      _ringSum = 0;
+      _ringCount = 0;
+      _rejectRun = 0;
+    }
+    return(false);
   }
-  
-  return(beatDetected);
-}
+  _rejectRun = 0;
 
-//  Average DC Estimator
-int16_t averageDCEstimator(int32_t *p, uint16_t x)
-{
-  *p += ((((long) x << 15) - *p) >> 4);
-  return (*p >> 15);
-}
+  //  The ring of recent intervals, its sum kept as they come and go
+  if (_ringCount == RING_LENGTH) _ringSum -= _ring[_ringSpot];
+  else _ringCount++;
+  _ring[_ringSpot] = interval;
+  _ringSum += interval;
+  _ringSpot = (_ringSpot + 1) % RING_LENGTH;
 
-//  Low Pass FIR Filter
-int16_t lowPassFIRFilter(int16_t din)
-{  
-  cbuf[offset] = din;
+  //  Welford's update of the mean and the squared deviations
+  if (_count < 0xFFFF)
+  {
+    float x = interval * 0.001f;
+    float delta = x - _mean;
+    _count++;
+    _mean += delta / _count;
+    _m2 += delta * (x - _mean);
+  }
 
-  int32_t z = mul16(FIRCoeffs[11], cbuf[(offset - 11) & 0x1F]);
-  
-  for (uint8_t i = 0 ; i < 11 ; i++)
+  //  Successive differences, only between intervals that follow each other
+  if (_havePrevious && (_diffCount < 0xFFFF))
   {
-    z += mul16(FIRCoeffs[i], cbuf[(offset - i) & 0x1F] + cbuf[(offset - 22 + i) & 0x1F]);
+    int32_t diff = (int32_t)(interval - _lastIntervalUs);
+    uint32_t absDiff = (diff < 0) ? -diff : diff;
+    _sumSquaredDiff += (uint64_t)absDiff * absDiff;
+    if (absDiff > NN50_US) _nn50Count++;
+    _diffCount++;
   }
 
-  offset++;
-  offset %= 32; //Wrap condition
+  _lastIntervalUs = interval;
+  _havePrevious = true;
+  return(true);
+}
 
-  return(z >> 15);
+uint16_t BeatVariability::getSDNN(void) const
+{
+  if (_count < 2) return(0);
+  return((uint16_t)(sqrtf(_m2 / (_count - 1)) + 0.5f));
+}
+
+uint16_t BeatVariability::getRMSSD(void) const
+{
+  if (_diffCount == 0) return(0);
+  return((uint16_t)(sqrtf((float)(_sumSquaredDiff / _diffCount)) * 0.001f + 0.5f));
 }
 
-//  Integer multiplier
-int32_t mul16(int16_t x, int16_t y)
+uint8_t BeatVariability::getPNN50(void) const
 {
-  return((long)x * (long)y);
+  if (_diffCount == 0) return(0);
+  return((uint8_t)(((uint32_t)_nn50Count * 100 + _diffCount / 2) / _diffCount));
 }
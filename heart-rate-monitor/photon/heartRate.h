@@ -55,13 +55,396 @@
 * 
 */
 
+#pragma once
+
 #if (ARDUINO >= 100)
  #include "Arduino.h"
 #else
  #include "WProgram.h"
 #endif
+#include <string.h>
+#include "spo2_kernels.h"
+#if defined(SPO2_KERNELS_AVX2) || defined(SPO2_KERNELS_SSE2)
+ #include <emmintrin.h>
+#elif defined(SPO2_KERNELS_DSP)
+ #include <arm_acle.h>
+#endif
+
+//  Average DC Estimator
+inline int16_t averageDCEstimator(int32_t *p, uint16_t x)
+{
+  *p += ((((long) x << 15) - *p) >> 4);
+  return (*p >> 15);
+}
+
+//  The same estimator for the full 18 bit count of the MAX3010x. averageDCEstimator() takes
+//  16 bits and wraps at every multiple of 65536, here 13 fractional bits keep the register in 32.
+inline int32_t averageDCEstimatorWide(int32_t *p, uint32_t x)
+{
+  *p += ((((int32_t) x << 13) - *p) >> 4);
+  return (*p >> 13);
+}
+
+//  Integer multiplier
+inline int32_t mul16(int16_t x, int16_t y)
+{
+  return((long)x * (long)y);
+}
+
+//  Coefficient set of the low pass FIR: the first half of a symmetric filter, the centre tap
+//  last, 2 * HALF_TAPS - 1 taps in all, gain 2^15. Another set is a struct with the same two
+//  members, handed to BeatDetector as its template argument.
+struct PBAFilterCoeffs
+{
+  static const uint8_t HALF_TAPS = 12;
+  static const uint16_t coeffs[HALF_TAPS];
+};
+
+//  Beat detector with all of its state in the object, one per PPG stream. Objects are plain
+//  values: a copy carries on from the same point independently of the original, and objects
+//  on different streams or threads share nothing.
+template <typename FIR = PBAFilterCoeffs>
+class BeatDetector {
+ public:
+  BeatDetector(void) { reset(); }
+
+  void reset(void); //Back to the state of a new object, e.g. between sessions or after a gain change
+
+  bool checkForBeat(int32_t sample); //True when a beat is detected
+  int16_t lowPassFIRFilter(int16_t din); //The filter stage of checkForBeat() on its own
+  void lowPassFIRFilter(const int16_t *din, int16_t *dout, uint16_t count); //count samples at once, same output
+
+  int16_t getACSignal(void) const { return _acSignalCurrent; } //Filtered IR of the last sample
+  int32_t getDCEstimate(void) const { return _averageEstimated; } //IR DC estimate of the last sample
+  uint16_t getBeatLag(void) const { return _beatLag; } //Zero crossing of the last beat before its sample, Q15 of a sample period
+
+ private:
+  static const uint8_t HISTORY_LENGTH = 32; //FIR history, a power of 2
+  static const int32_t SAMPLE_MAX = 0x3FFFF; //18 bit ADC
+  static const uint8_t BLOCK_LENGTH = 32; //Samples the block filter takes per pass, one FIFO drain
+  static const uint8_t SPAN = 2 * (FIR::HALF_TAPS - 1); //Samples before the newest one an output reads
+  static_assert(SPAN < HISTORY_LENGTH, "FIR too long for the history buffer");
+
+  static void filterLinear(const int16_t *x, int16_t *y, uint8_t count);
+
+  int16_t _acMax;
+  int16_t _acMin;
+  int16_t _acSignalCurrent;
+  int16_t _acSignalPrevious;
+  int16_t _acSignalMin;
+  int16_t _acSignalMax;
+  int32_t _averageEstimated;
+  int16_t _positiveEdge;
+  int16_t _negativeEdge;
+  int32_t _avgReg;
+  bool _seeded; //_avgReg started from a sample rather than 0
+  uint16_t _beatLag;
+
+  int16_t _cbuf[HISTORY_LENGTH];
+  uint8_t _offset;
+};
+
+template <typename FIR>
+void BeatDetector<FIR>::reset(void)
+{
+  _acMax = 20;
+  _acMin = -20;
+  _acSignalCurrent = 0;
+  _acSignalPrevious = 0;
+  _acSignalMin = 0;
+  _acSignalMax = 0;
+  _averageEstimated = 0;
+  _positiveEdge = 0;
+  _negativeEdge = 0;
+  _avgReg = 0;
+  _seeded = false;
+  _beatLag = 0;
+  for (uint8_t i = 0 ; i < HISTORY_LENGTH ; i++) _cbuf[i] = 0;
+  _offset = 0;
+}
+
+//  Heart Rate Monitor functions takes a sample value and the sample number
+//  Returns true if a beat is detected
+//  A running average of four samples is recommended for display on the screen.
+template <typename FIR>
+bool BeatDetector<FIR>::checkForBeat(int32_t sample)
+{
+  bool beatDetected = false;
+
+  //  Save current state
+  _acSignalPrevious = _acSignalCurrent;
+
+  //  Full 18 bit counts: the IR DC sits around 0x20000 once the gain control has settled
+  if (sample < 0) sample = 0;
+  if (sample > SAMPLE_MAX) sample = SAMPLE_MAX;
+
+  //  The DC estimate starts at the first sample. Settling from 0 takes some 5 s at 25 Hz,
+  //  with no beats detected meanwhile.
+  if (!_seeded)
+  {
+    _avgReg = sample << 13;
+    _seeded = true;
+  }
+
+  //  Process next data sample, the AC part held to the 16 bits the filter takes
+  _averageEstimated = averageDCEstimatorWide(&_avgReg, (uint32_t)sample);
+  int32_t ac = sample - _averageEstimated;
+  if (ac > INT16_MAX) ac = INT16_MAX;
+  if (ac < INT16_MIN) ac = INT16_MIN;
+  _acSignalCurrent = lowPassFIRFilter((int16_t)ac);
+
+  //  Detect positive zero crossing (rising edge)
+  if ((_acSignalPrevious < 0) & (_acSignalCurrent >= 0))
+  {
+    _acMax = _acSignalMax; //Adjust our AC max and min
+    _acMin = _acSignalMin;
+
+    _positiveEdge = 1;
+    _negativeEdge = 0;
+    _acSignalMax = 0;
+
+    //  Where between the two samples the signal crossed zero, by linear interpolation. Beat
+    //  times then resolve a fraction of the sample period instead of whole samples.
+    _beatLag = ((int32_t)_acSignalCurrent << 15) / ((int32_t)_acSignalCurrent - _acSignalPrevious);
+
+    //if ((_acMax - _acMin) > 100 & (_acMax - _acMin) < 1000)
+    if (((_acMax - _acMin) > 20) & ((_acMax - _acMin) < 1000))
+    {
+      //Heart beat!!!
+      beatDetected = true;
+    }
+  }
+
+  //  Detect negative zero crossing (falling edge)
+  if ((_acSignalPrevious > 0) & (_acSignalCurrent <= 0))
+  {
+    _positiveEdge = 0;
+    _negativeEdge = 1;
+    _acSignalMin = 0;
+  }
+
+  //  Find Maximum value in positive cycle
+  if (_positiveEdge & (_acSignalCurrent > _acSignalPrevious))
+  {
+    _acSignalMax = _acSignalCurrent;
+  }
+
+  //  Find Minimum value in negative cycle
+  if (_negativeEdge & (_acSignalCurrent < _acSignalPrevious))
+  {
+    _acSignalMin = _acSignalCurrent;
+  }
+
+  return(beatDetected);
+}
+
+//  Low Pass FIR Filter
+template <typename FIR>
+int16_t BeatDetector<FIR>::lowPassFIRFilter(int16_t din)
+{
+  const uint8_t centre = FIR::HALF_TAPS - 1;
+
+  _cbuf[_offset] = din;
 
+  int32_t z = mul16(FIR::coeffs[centre], _cbuf[(_offset - centre) & (HISTORY_LENGTH - 1)]);
+
+  for (uint8_t i = 0 ; i < centre ; i++)
+  {
+    z += mul16(FIR::coeffs[i], _cbuf[(_offset - i) & (HISTORY_LENGTH - 1)] + _cbuf[(_offset - 2 * centre + i) & (HISTORY_LENGTH - 1)]);
+  }
+
+  _offset++;
+  _offset %= HISTORY_LENGTH; //Wrap condition
+
+  return(z >> 15);
+}
+
+//  Low Pass FIR Filter over a block
+//  Copies the history into a linear buffer ahead of the new samples, so the taps need no
+//  wrap masks, then filters it with filterLinear(). din and dout may be the same buffer.
+template <typename FIR>
+void BeatDetector<FIR>::lowPassFIRFilter(const int16_t *din, int16_t *dout, uint16_t count)
+{
+  int16_t x[SPAN + BLOCK_LENGTH];
+
+  while (count > 0)
+  {
+    uint8_t n = count < BLOCK_LENGTH ? count : BLOCK_LENGTH;
+
+    for (uint8_t i = 0 ; i < SPAN ; i++) x[i] = _cbuf[(_offset - SPAN + i) & (HISTORY_LENGTH - 1)];
+    for (uint8_t i = 0 ; i < n ; i++)
+    {
+      x[SPAN + i] = din[i];
+      _cbuf[_offset] = din[i]; //The ring stays current for the per sample filter
+      _offset = (_offset + 1) & (HISTORY_LENGTH - 1);
+    }
+    filterLinear(x, dout, n);
+
+    din += n;
+    dout += n;
+    count -= n;
+  }
+}
+
+//  y[n] from x[n] .. x[n + SPAN], x[n + SPAN] being the newest sample of output n.
+//  Bit exact with the per sample filter: like the int16_t argument of mul16(), the sum of a
+//  tap pair wraps to 16 bits, and every vector path keeps that wrap.
+template <typename FIR>
+void BeatDetector<FIR>::filterLinear(const int16_t *x, int16_t *y, uint8_t count)
+{
+  const uint8_t centre = FIR::HALF_TAPS - 1;
+  uint8_t n = 0;
+
+#if defined(SPO2_KERNELS_AVX2) || defined(SPO2_KERNELS_SSE2)
+  //  8 outputs per step: tap pairs summed as 16 bit lanes, then pmaddwd multiplies two
+  //  coefficients and adds both products into each 32 bit lane
+  for (; n + 8 <= count ; n += 8)
+  {
+    __m128i lo = _mm_setzero_si128();
+    __m128i hi = _mm_setzero_si128();
+    uint8_t i = 0;
+
+    for (; i + 1 < centre ; i += 2)
+    {
+      __m128i s0 = _mm_add_epi16(_mm_loadu_si128((const __m128i *)(x + n + SPAN - i)), _mm_loadu_si128((const __m128i *)(x + n + i)));
+      __m128i s1 = _mm_add_epi16(_mm_loadu_si128((const __m128i *)(x + n + SPAN - i - 1)), _mm_loadu_si128((const __m128i *)(x + n + i + 1)));
+      __m128i c = _mm_set1_epi32((uint16_t)FIR::coeffs[i] | ((uint32_t)(uint16_t)FIR::coeffs[i + 1] << 16));
+      lo = _mm_add_epi32(lo, _mm_madd_epi16(_mm_unpacklo_epi16(s0, s1), c));
+      hi = _mm_add_epi32(hi, _mm_madd_epi16(_mm_unpackhi_epi16(s0, s1), c));
+    }
+    //  The centre tap, with the last pair when there is one left over
+    __m128i s0 = _mm_setzero_si128();
+    uint16_t c0 = 0;
+    if (i < centre)
+    {
+      s0 = _mm_add_epi16(_mm_loadu_si128((const __m128i *)(x + n + SPAN - i)), _mm_loadu_si128((const __m128i *)(x + n + i)));
+      c0 = FIR::coeffs[i];
+    }
+    __m128i s1 = _mm_loadu_si128((const __m128i *)(x + n + centre));
+    __m128i c = _mm_set1_epi32(c0 | ((uint32_t)(uint16_t)FIR::coeffs[centre] << 16));
+    lo = _mm_add_epi32(lo, _mm_madd_epi16(_mm_unpacklo_epi16(s0, s1), c));
+    hi = _mm_add_epi32(hi, _mm_madd_epi16(_mm_unpackhi_epi16(s0, s1), c));
+
+    //  z >> 15 cut to 16 bits like the int16_t return, then packed without saturating
+    lo = _mm_srai_epi32(_mm_slli_epi32(_mm_srai_epi32(lo, 15), 16), 16);
+    hi = _mm_srai_epi32(_mm_slli_epi32(_mm_srai_epi32(hi, 15), 16), 16);
+    _mm_storeu_si128((__m128i *)(y + n), _mm_packs_epi32(lo, hi));
+  }
+#elif defined(SPO2_KERNELS_DSP)
+  //  One output per step, two taps per instruction: SADD16 sums two tap pairs in 16 bit
+  //  lanes, SMLAD multiplies them by two coefficients and accumulates
+  uint32_t coeffPairs[FIR::HALF_TAPS / 2];
+  for (uint8_t i = 0 ; i + 1 < centre ; i += 2)
+    coeffPairs[i / 2] = (uint16_t)FIR::coeffs[i] | ((uint32_t)(uint16_t)FIR::coeffs[i + 1] << 16);
+
+  for (; n < count ; n++)
+  {
+    int32_t z = 0;
+    uint8_t i = 0;
+
+    for (; i + 1 < centre ; i += 2)
+    {
+      uint32_t older, newer;
+      memcpy(&older, x + n + i, 4); //x[n+i], x[n+i+1]
+      memcpy(&newer, x + n + SPAN - i - 1, 4); //x[n+SPAN-i-1], x[n+SPAN-i], swapped below
+      z = __smlad(__sadd16(older, __ror(newer, 16)), coeffPairs[i / 2], z);
+    }
+    for (; i < centre ; i++) z += mul16(FIR::coeffs[i], x[n + SPAN - i] + x[n + i]);
+    z += mul16(FIR::coeffs[centre], x[n + centre]);
+    y[n] = z >> 15;
+  }
+#endif
+
+  for (; n < count ; n++)
+  {
+    int32_t z = mul16(FIR::coeffs[centre], x[n + centre]);
+
+    for (uint8_t i = 0 ; i < centre ; i++)
+    {
+      z += mul16(FIR::coeffs[i], x[n + SPAN - i] + x[n + i]);
+    }
+    y[n] = z >> 15;
+  }
+}
+
+//  The free functions share one BeatDetector<>, for sketches with a single sensor
 bool checkForBeat(int32_t sample);
-int16_t averageDCEstimator(int32_t *p, uint16_t x);
 int16_t lowPassFIRFilter(int16_t din);
-int32_t mul16(int16_t x, int16_t y);
+void lowPassFIRFilter(const int16_t *din, int16_t *dout, uint16_t count);
+void resetBeatDetector(void);
+
+//  Beat to beat heart rate from the last few intervals between the beats checkForBeat()
+//  reports, averaged without the shortest and the longest. Intervals outside MIN_BPM..MAX_BPM
+//  are dropped, and one missed or extra beat among the rest is trimmed off like an outlier
+//  around a median. Gives a rate after MIN_INTERVALS intervals rather than a whole window.
+class BeatRate {
+ public:
+  static const uint8_t INTERVAL_COUNT = 5; //Intervals the rate is taken over
+  static const uint8_t MIN_INTERVALS = 2; //Intervals needed before getBPM() reports a rate
+  static const uint8_t MIN_BPM = 40;
+  static const uint8_t MAX_BPM = 220;
+
+  BeatRate(void) { reset(); }
+
+  void reset(void); //Forget all beats, e.g. after a gap in the samples
+
+  bool addBeat(uint32_t timeUs); //A beat at timeUs (micros()), true when it gave a new interval
+  uint8_t getBPM(void) const; //Trimmed mean rate, 0 until MIN_INTERVALS intervals are in
+  uint8_t getIntervalCount(void) const { return _count; }
+  uint32_t getLastBeatUs(void) const { return _lastBeatUs; }
+
+ private:
+  uint32_t _intervals[INTERVAL_COUNT]; //Microseconds, oldest overwritten first
+  uint32_t _lastBeatUs;
+  uint8_t _count;
+  uint8_t _spot;
+  bool _haveBeat;
+};
+
+//  Heart rate variability over a measurement: the RR intervals between beats, with the beat
+//  times as precise as the caller gives them (see BeatDetector::getBeatLag()), kept as running
+//  statistics in constant memory. SDNN comes from a Welford mean and variance, RMSSD and pNN50
+//  from sums over successive differences. A beat closer than BeatRate::MAX_BPM allows to the
+//  last one is an extra beat and is ignored. An interval longer than BeatRate::MIN_BPM allows,
+//  or more than MAX_CHANGE_PCT off the mean of the last RING_LENGTH good ones, is an artifact
+//  (missed or ectopic beat) and stays out of the statistics, as do both differences it would
+//  have taken part in.
+class BeatVariability {
+ public:
+  static const uint8_t RING_LENGTH = 8; //Recent intervals the artifact check compares with
+  static const uint8_t MIN_RING = 3; //Intervals in the ring before the check applies
+  static const uint8_t MAX_CHANGE_PCT = 25;
+  static const uint32_t NN50_US = 50000;
+
+  BeatVariability(void) { reset(); }
+
+  void reset(void); //Clear the statistics, at the start of a measurement
+  void restart(void); //Forget the last beat but keep the statistics, e.g. after a gap in the samples
+
+  bool addBeat(uint32_t timeUs); //A beat at timeUs (micros()), true when it gave an interval that counts
+  uint16_t getIntervalCount(void) const { return _count; } //Intervals in SDNN
+  uint16_t getDifferenceCount(void) const { return _diffCount; } //Successive differences in RMSSD and pNN50
+  uint32_t getLastIntervalUs(void) const { return _lastIntervalUs; } //Last interval that counted
+  uint16_t getSDNN(void) const; //ms, 0 until 2 intervals are in
+  uint16_t getRMSSD(void) const; //ms, 0 until a difference is in
+  uint8_t getPNN50(void) const; //% of successive differences over 50 ms
+
+ private:
+  uint32_t _ring[RING_LENGTH];
+  uint32_t _ringSum;
+  uint8_t _ringCount;
+  uint8_t _ringSpot;
+  uint8_t _rejectRun; //Artifacts in a row, enough of them means the rhythm changed
+
+  uint32_t _lastBeatUs;
+  uint32_t _lastIntervalUs;
+  bool _haveBeat;
+  bool _havePrevious; //_lastIntervalUs is the interval just before the next one
+
+  uint16_t _count;
+  float _mean; //ms
+  float _m2; //ms^2, sum of squared deviations from _mean
+  uint16_t _diffCount;
+  uint16_t _nn50Count;
+  uint64_t _sumSquaredDiff; //us^2
+};
@@ -0,0 +1,88 @@
+/***************************************************
+ Host (Linux) stand-in for the Arduino/Particle core
+
+ Lets the photon sources (MAX30105, heartRate, spo2_algorithm) build and run on a
+ desktop machine. Time is virtual: millis()/micros() only move when delay() is
+ called or the host advances the clock, which is what drives the simulated
+ sensor in MAX3010xSim.h.
+
+ Never part of the device build.
+ *****************************************************/
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+#include <algorithm>
+
+#ifndef ARDUINO
+ #define ARDUINO 100
+#endif
+
+typedef bool boolean;
+typedef uint8_t byte;
+
+using std::min;
+using std::max;
+
+#define HIGH 1
+#define LOW 0
+
+#define INPUT 0
+#define OUTPUT 1
+#define INPUT_PULLUP 2
+
+#define RISING 1
+#define FALLING 2
+#define CHANGE 3
+
+//Particle pin names, numbered so they index straight into the host pin table
+#define D0 0
+#define D1 1
+#define D2 2
+#define D3 3
+#define D4 4
+#define D5 5
+#define D6 6
+#define D7 7
+
+#define HOST_NUM_PINS 32
+
+//Virtual time
+unsigned long millis(void);
+unsigned long micros(void);
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+
+//GPIO
+void pinMode(uint16_t pin, uint8_t mode);
+int32_t digitalRead(uint16_t pin);
+void digitalWrite(uint16_t pin, uint8_t value);
+bool attachInterrupt(uint16_t pin, void (*handler)(void), int mode);
+void detachInterrupt(uint16_t pin);
+
+inline bool isDigit(char c) { return (c >= '0' && c <= '9'); }
+
+namespace host {
+
+  //Anything that has to run as virtual time passes (simulated sensors)
+  typedef void (*TickHandler)(void *context, uint32_t nowMicros);
+
+  bool addTickHandler(TickHandler handler, void *context);
+  void removeTickHandler(TickHandler handler, void *context);
+
+  //Moves virtual time forward, running tick handlers along the way
+  void advanceMicros(uint32_t us);
+
+  //Rewinds virtual time to zero and detaches every pin and tick handler
+  void reset(void);
+
+  //Drives an input pin from outside, firing its attached interrupt on the matching edge.
+  //This is how a simulated device's INT line reaches the firmware.
+  void setPinLevel(uint16_t pin, uint8_t level);
+
+} // namespace host
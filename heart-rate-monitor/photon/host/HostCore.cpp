@@ -0,0 +1,237 @@
+/***************************************************
+ Host (Linux) stand-in for the Arduino/Particle core: virtual clock, GPIO, Wire
+
+ Never part of the device build.
+ *****************************************************/
+
+#ifndef PLATFORM_ID // Device builds use the real core
+
+#include "Arduino.h"
+#include "Wire.h"
+
+#define HOST_MAX_TICK_HANDLERS 8
+
+//Longest stretch of virtual time handed to tick handlers in one go
+//Keeps simulated devices from skipping past events they need to raise
+static const uint32_t HOST_TICK_STEP_US = 250;
+
+static uint32_t nowMicros = 0;
+
+typedef struct
+{
+  host::TickHandler handler;
+  void *context;
+} tick_slot;
+
+static tick_slot tickSlots[HOST_MAX_TICK_HANDLERS];
+static uint8_t tickCount = 0;
+
+typedef struct
+{
+  uint8_t mode;
+  uint8_t level;
+  void (*isr)(void);
+  int edge;
+} pin_state;
+
+static pin_state pins[HOST_NUM_PINS];
+
+//
+// Virtual time
+//
+unsigned long millis(void) {
+  return (nowMicros / 1000);
+}
+
+unsigned long micros(void) {
+  return (nowMicros);
+}
+
+void delay(unsigned long ms) {
+  host::advanceMicros(ms * 1000UL);
+}
+
+void delayMicroseconds(unsigned int us) {
+  host::advanceMicros(us);
+}
+
+bool host::addTickHandler(TickHandler handler, void *context) {
+  if (tickCount >= HOST_MAX_TICK_HANDLERS) return false;
+
+  tickSlots[tickCount].handler = handler;
+  tickSlots[tickCount].context = context;
+  tickCount++;
+  return true;
+}
+
+void host::removeTickHandler(TickHandler handler, void *context) {
+  for (uint8_t x = 0 ; x < tickCount ; x++)
+  {
+    if (tickSlots[x].handler == handler && tickSlots[x].context == context)
+    {
+      tickSlots[x] = tickSlots[tickCount - 1];
+      tickCount--;
+      return;
+    }
+  }
+}
+
+void host::advanceMicros(uint32_t us) {
+  while (us > 0)
+  {
+    uint32_t step = (us > HOST_TICK_STEP_US) ? HOST_TICK_STEP_US : us;
+    nowMicros += step;
+    us -= step;
+
+    for (uint8_t x = 0 ; x < tickCount ; x++)
+      tickSlots[x].handler(tickSlots[x].context, nowMicros);
+  }
+}
+
+void host::reset(void) {
+  nowMicros = 0;
+  tickCount = 0;
+  memset(pins, 0, sizeof(pins));
+  for (uint16_t x = 0 ; x < HOST_NUM_PINS ; x++) pins[x].level = HIGH; //Pulled up
+
+  Wire.detachAll();
+  Wire1.detachAll();
+}
+
+//
+// GPIO
+//
+void pinMode(uint16_t pin, uint8_t mode) {
+  if (pin >= HOST_NUM_PINS) return;
+  pins[pin].mode = mode;
+  if (mode == INPUT_PULLUP) pins[pin].level = HIGH;
+}
+
+int32_t digitalRead(uint16_t pin) {
+  if (pin >= HOST_NUM_PINS) return (LOW);
+  return (pins[pin].level);
+}
+
+void digitalWrite(uint16_t pin, uint8_t value) {
+  if (pin >= HOST_NUM_PINS) return;
+  pins[pin].level = value ? HIGH : LOW;
+}
+
+bool attachInterrupt(uint16_t pin, void (*handler)(void), int mode) {
+  if (pin >= HOST_NUM_PINS) return false;
+  pins[pin].isr = handler;
+  pins[pin].edge = mode;
+  return true;
+}
+
+void detachInterrupt(uint16_t pin) {
+  if (pin >= HOST_NUM_PINS) return;
+  pins[pin].isr = NULL;
+}
+
+void host::setPinLevel(uint16_t pin, uint8_t level) {
+  if (pin >= HOST_NUM_PINS) return;
+
+  uint8_t previous = pins[pin].level;
+  pins[pin].level = level ? HIGH : LOW;
+
+  if (pins[pin].isr == NULL || previous == pins[pin].level) return;
+
+  bool falling = (pins[pin].level == LOW);
+  if (pins[pin].edge == CHANGE || (pins[pin].edge == FALLING && falling) || (pins[pin].edge == RISING && !falling))
+    pins[pin].isr();
+}
+
+//
+// Wire
+//
+TwoWire Wire;
+TwoWire Wire1;
+
+TwoWire::TwoWire(void) {
+  _deviceCount = 0;
+  _txAddress = 0;
+  _txLength = 0;
+  _rxLength = 0;
+  _rxIndex = 0;
+  _transactions = 0;
+  _bytes = 0;
+}
+
+void TwoWire::begin(void) {
+}
+
+void TwoWire::setClock(uint32_t speed) {
+  (void)speed;
+}
+
+bool TwoWire::attach(uint8_t address, I2CDevice *device) {
+  if (_deviceCount >= HOST_WIRE_MAX_DEVICES) return false;
+
+  _addresses[_deviceCount] = address;
+  _devices[_deviceCount] = device;
+  _deviceCount++;
+  return true;
+}
+
+void TwoWire::detachAll(void) {
+  _deviceCount = 0;
+  resetCounters();
+}
+
+I2CDevice *TwoWire::findDevice(uint8_t address) {
+  for (uint8_t x = 0 ; x < _deviceCount ; x++)
+    if (_addresses[x] == address) return (_devices[x]);
+  return (NULL);
+}
+
+void TwoWire::beginTransmission(uint8_t address) {
+  _txAddress = address;
+  _txLength = 0;
+}
+
+size_t TwoWire::write(uint8_t data) {
+  if (_txLength >= HOST_WIRE_BUFFER_LENGTH) return (0);
+  _txBuffer[_txLength++] = data;
+  return (1);
+}
+
+uint8_t TwoWire::endTransmission(bool stop) {
+  (void)stop;
+  _transactions++;
+  _bytes += _txLength;
+
+  I2CDevice *device = findDevice(_txAddress);
+  if (device == NULL) return (2); //Address NACK
+
+  device->i2cWrite(_txBuffer, _txLength);
+  return (0);
+}
+
+size_t TwoWire::requestFrom(uint8_t address, size_t quantity, bool stop) {
+  (void)stop;
+  _transactions++;
+
+  _rxIndex = 0;
+  _rxLength = 0;
+
+  I2CDevice *device = findDevice(address);
+  if (device == NULL) return (0);
+
+  if (quantity > HOST_WIRE_BUFFER_LENGTH) quantity = HOST_WIRE_BUFFER_LENGTH;
+  device->i2cRead(_rxBuffer, quantity);
+  _rxLength = quantity;
+  _bytes += quantity;
+  return (quantity);
+}
+
+int TwoWire::available(void) {
+  return ((int)(_rxLength - _rxIndex));
+}
+
+int TwoWire::read(void) {
+  if (_rxIndex >= _rxLength) return (-1);
+  return (_rxBuffer[_rxIndex++]);
+}
+
+#endif // PLATFORM_ID
@@ -0,0 +1,453 @@
+/***************************************************
+ Register level model of a MAX30102/MAX30105 for host builds
+
+ Never part of the device build.
+ *****************************************************/
+
+#ifndef PLATFORM_ID // Device builds use the real sensor
+
+#include "MAX3010xSim.h"
+
+// Register map (datasheet pg. 10, 11)
+static const uint8_t REG_INTSTAT1 =     0x00;
+static const uint8_t REG_INTSTAT2 =     0x01;
+static const uint8_t REG_INTENABLE1 =   0x02;
+static const uint8_t REG_INTENABLE2 =   0x03;
+static const uint8_t REG_FIFOWRITEPTR = 0x04;
+static const uint8_t REG_FIFOOVERFLOW = 0x05;
+static const uint8_t REG_FIFOREADPTR =  0x06;
+static const uint8_t REG_FIFODATA =     0x07;
+static const uint8_t REG_FIFOCONFIG =   0x08;
+static const uint8_t REG_MODECONFIG =   0x09;
+static const uint8_t REG_SPO2CONFIG =   0x0A;
+static const uint8_t REG_LED1_PA =      0x0C;
+static const uint8_t REG_LED2_PA =      0x0D;
+static const uint8_t REG_LED3_PA =      0x0E;
+static const uint8_t REG_PILOT_PA =     0x10;
+static const uint8_t REG_MULTILED1 =    0x11;
+static const uint8_t REG_MULTILED2 =    0x12;
+static const uint8_t REG_TEMPINT =      0x1F;
+static const uint8_t REG_TEMPFRAC =     0x20;
+static const uint8_t REG_TEMPCONFIG =   0x21;
+static const uint8_t REG_PROXINTTHRESH = 0x30;
+static const uint8_t REG_REVISIONID =   0xFE;
+static const uint8_t REG_PARTID =       0xFF;
+
+static const uint8_t INT1_A_FULL =      0x80;
+static const uint8_t INT1_PPG_RDY =     0x40;
+static const uint8_t INT1_PROX_INT =    0x10;
+static const uint8_t INT1_PWR_RDY =     0x01;
+static const uint8_t INT2_DIE_TEMP_RDY = 0x02;
+
+static const uint8_t MODE_SHDN =        0x80;
+static const uint8_t MODE_RESET =       0x40;
+
+static const uint32_t TEMPERATURE_CONVERSION_US = 29000; //Datasheet tTEMP
+
+static const uint16_t sampleRates[8] = {50, 100, 200, 400, 800, 1000, 1600, 3200};
+static const uint16_t adcRanges[4] = {2048, 4096, 8192, 16384};
+static const uint16_t pulseWidths[4] = {69, 118, 215, 411};
+static const float LED_MA_PER_LSB = 0.2f;
+
+MAX3010xSim::MAX3010xSim(void) {
+  _wirePort = NULL;
+  _intConnected = false;
+  _intPin = 0;
+  _source = NULL;
+  _sourceContext = NULL;
+  _samplesProduced = 0;
+  _samplesLost = 0;
+  _noiseState = 0x13572468;
+  _ledCharge = 0;
+  _proximitySupported = true;
+
+  _signal.fingerPresent = true;
+  _signal.heartRateBpm = 72.0;
+  _signal.irDC = 60000.0;
+  _signal.redDC = 50000.0;
+  _signal.perfusion = 0.01;
+  _signal.ratio = 0.6; //About 97% SpO2 on the Maxim calibration curve
+  _signal.noise = 0.0;
+  _signal.ambient = 400.0;
+  _signal.temperatureC = 30.5;
+
+  powerOnReset();
+  _regs[REG_INTSTAT1] = INT1_PWR_RDY; //Only a real power up raises PWR_RDY
+}
+
+MAX3010xSim::~MAX3010xSim() {
+  disconnect();
+}
+
+bool MAX3010xSim::connect(TwoWire &wirePort, uint8_t i2caddr) {
+  if (!wirePort.attach(i2caddr, this)) return false;
+  _wirePort = &wirePort;
+  _nextSampleMicros = micros() + samplePeriodMicros();
+  return host::addTickHandler(onTick, this);
+}
+
+void MAX3010xSim::disconnect(void) {
+  if (_wirePort == NULL) return;
+  host::removeTickHandler(onTick, this);
+  _wirePort = NULL;
+}
+
+void MAX3010xSim::connectInterrupt(uint16_t pin) {
+  _intPin = pin;
+  _intConnected = true;
+  updateInterruptLine();
+}
+
+void MAX3010xSim::setSampleSource(SampleSource source, void *context) {
+  _source = source;
+  _sourceContext = context;
+}
+
+void MAX3010xSim::powerOnReset(void) {
+  memset(_regs, 0, sizeof(_regs));
+  _regs[REG_REVISIONID] = 0x03;
+  _regs[REG_PARTID] = 0x15;
+  _pointer = 0;
+  _fifoCount = 0;
+  _fifoByte = 0;
+  _temperaturePending = false;
+  _proximityMode = false;
+  _nextSampleMicros = micros();
+}
+
+//Output data rate: ADC rate divided by the on chip averaging
+uint32_t MAX3010xSim::samplePeriodMicros(void) {
+  uint8_t sr = (_regs[REG_SPO2CONFIG] >> 2) & 0x07;
+  uint8_t avgCode = (_regs[REG_FIFOCONFIG] >> 5) & 0x07;
+  uint32_t average = 1UL << (avgCode > 5 ? 5 : avgCode);
+
+  return ((1000000UL * average) / sampleRates[sr]);
+}
+
+bool MAX3010xSim::interruptAsserted(void) {
+  return ((_regs[REG_INTSTAT1] & (_regs[REG_INTENABLE1] | INT1_PWR_RDY)) != 0 ||
+          (_regs[REG_INTSTAT2] & _regs[REG_INTENABLE2]) != 0);
+}
+
+void MAX3010xSim::updateInterruptLine(void) {
+  if (_intConnected) host::setPinLevel(_intPin, interruptAsserted() ? LOW : HIGH);
+}
+
+//
+// Virtual clock
+//
+void MAX3010xSim::onTick(void *context, uint32_t nowMicros) {
+  ((MAX3010xSim *)context)->tick(nowMicros);
+}
+
+void MAX3010xSim::tick(uint32_t nowMicros) {
+  uint8_t mode = _regs[REG_MODECONFIG];
+  bool running = ((mode & MODE_SHDN) == 0) && ((mode & 0x07) >= 2);
+
+  if (!running)
+  {
+    _nextSampleMicros = nowMicros + samplePeriodMicros();
+  }
+  else
+  {
+    while ((int32_t)(nowMicros - _nextSampleMicros) >= 0)
+    {
+      produceSample(_nextSampleMicros);
+      _nextSampleMicros += samplePeriodMicros();
+    }
+  }
+
+  if (_temperaturePending && (int32_t)(nowMicros - _temperatureDoneMicros) >= 0)
+  {
+    float t = _signal.temperatureC;
+    int8_t whole = (int8_t)floorf(t);
+    _regs[REG_TEMPINT] = (uint8_t)whole;
+    _regs[REG_TEMPFRAC] = (uint8_t)((t - whole) * 16.0f) & 0x0F;
+    _regs[REG_TEMPCONFIG] &= ~0x01; //TEMP_EN self clears
+    _regs[REG_INTSTAT2] |= INT2_DIE_TEMP_RDY;
+    _temperaturePending = false;
+  }
+
+  updateInterruptLine();
+}
+
+//
+// Sample production
+//
+uint8_t MAX3010xSim::channelCount(void) {
+  uint8_t mode = _regs[REG_MODECONFIG] & 0x07;
+  if (mode == 2) return 1; //Red only
+  if (mode == 3) return 2; //Red + IR
+
+  uint8_t count = 0;
+  for (uint8_t slot = 0 ; slot < 4 ; slot++)
+    if (channelLED(slot) != 0) count++;
+  return (count > 3 ? 3 : count);
+}
+
+uint8_t MAX3010xSim::channelLED(uint8_t channel) {
+  uint8_t mode = _regs[REG_MODECONFIG] & 0x07;
+  if (mode != 7) return (channel + 1);
+
+  uint8_t reg = (channel < 2) ? _regs[REG_MULTILED1] : _regs[REG_MULTILED2];
+  uint8_t slot = (channel & 1) ? (reg >> 4) & 0x07 : reg & 0x07;
+  return (slot & 0x03);
+}
+
+uint32_t MAX3010xSim::scaleToADC(float counts, uint8_t ledAmplitude) {
+  float range = adcRanges[(_regs[REG_SPO2CONFIG] >> 5) & 0x03];
+  float value = counts * ((float)ledAmplitude / 32.0f);
+  if (!_signal.fingerPresent) value = _signal.ambient;
+  value = value * (4096.0f / range);
+
+  //Uniform noise from a small LCG so runs are repeatable
+  if (_signal.noise > 0)
+  {
+    _noiseState = _noiseState * 1103515245UL + 12345UL;
+    float unit = ((_noiseState >> 8) & 0xFFFF) / 32768.0f - 1.0f;
+    value += unit * _signal.noise;
+  }
+
+  if (value < 0) value = 0;
+  if (value > 262143.0f) value = 262143.0f; //18-bit full scale
+  return ((uint32_t)value);
+}
+
+//Photocurrent of both channels at the reference configuration
+void MAX3010xSim::signalCounts(uint32_t nowMicros, float *redCounts, float *irCounts) {
+  float seconds = nowMicros / 1000000.0f;
+  float phase = 2.0f * (float)M_PI * (_signal.heartRateBpm / 60.0f) * seconds;
+
+  //Sharp systolic upstroke plus a dicrotic bump, roughly -1..1
+  float wave = (sinf(phase) + 0.35f * sinf(2.0f * phase + 0.6f)) / 1.2f;
+
+  *irCounts = _signal.irDC * (1.0f - 0.5f * _signal.perfusion * wave);
+  *redCounts = _signal.redDC * (1.0f - 0.5f * _signal.ratio * _signal.perfusion * wave);
+}
+
+void MAX3010xSim::synthesize(uint32_t nowMicros, uint32_t *red, uint32_t *ir) {
+  float redCounts, irCounts;
+  signalCounts(nowMicros, &redCounts, &irCounts);
+
+  *red = scaleToADC(redCounts, _regs[REG_LED1_PA]);
+  *ir = scaleToADC(irCounts, _regs[REG_LED2_PA]);
+}
+
+//LED charge of one output sample: every averaged conversion fires each LED once
+void MAX3010xSim::chargeLEDs(uint16_t milliampLSBs) {
+  uint8_t avgCode = (_regs[REG_FIFOCONFIG] >> 5) & 0x07;
+  uint32_t average = 1UL << (avgCode > 5 ? 5 : avgCode);
+  uint16_t width = pulseWidths[_regs[REG_SPO2CONFIG] & 0x03];
+
+  _ledCharge += (double)average * width * milliampLSBs * LED_MA_PER_LSB; //mA * us = nC
+}
+
+//Proximity mode: IR pilot only, nothing stored. Crossing the threshold
+//raises PROX_INT and hands over to normal sampling.
+void MAX3010xSim::proximitySample(uint32_t nowMicros) {
+  uint32_t red, ir;
+
+  chargeLEDs(_regs[REG_PILOT_PA]);
+
+  if (_source != NULL && _source(_sourceContext, _samplesProduced, nowMicros, &red, &ir))
+  {
+    //Recorded at the normal IR drive, rescale to the pilot
+    ir = (_regs[REG_LED2_PA] == 0) ? 0 : ir * _regs[REG_PILOT_PA] / _regs[REG_LED2_PA];
+  }
+  else
+  {
+    float redCounts, irCounts;
+    signalCounts(nowMicros, &redCounts, &irCounts);
+    ir = scaleToADC(irCounts, _regs[REG_PILOT_PA]);
+  }
+
+  if ((ir >> 10) > _regs[REG_PROXINTTHRESH])
+  {
+    _regs[REG_INTSTAT1] |= INT1_PROX_INT;
+    _proximityMode = false;
+  }
+}
+
+void MAX3010xSim::produceSample(uint32_t nowMicros) {
+  uint32_t red, ir;
+
+  if (_proximityMode)
+  {
+    proximitySample(nowMicros);
+    return;
+  }
+
+  if (_source == NULL || !_source(_sourceContext, _samplesProduced, nowMicros, &red, &ir))
+    synthesize(nowMicros, &red, &ir);
+
+  _samplesProduced++;
+
+  uint16_t drive = 0;
+  for (uint8_t x = 0 ; x < channelCount() ; x++)
+  {
+    uint8_t led = channelLED(x);
+    if (led >= 1 && led <= 3) drive += _regs[REG_LED1_PA + led - 1];
+  }
+  chargeLEDs(drive);
+
+  bool rollover = (_regs[REG_FIFOCONFIG] & 0x10) != 0;
+  if (_fifoCount == MAX3010X_SIM_FIFO_DEPTH)
+  {
+    _samplesLost++;
+    if (_regs[REG_FIFOOVERFLOW] < 0x1F) _regs[REG_FIFOOVERFLOW]++; //Saturates
+
+    if (!rollover) return; //New samples are dropped until the FIFO is read
+
+    //Oldest record is overwritten
+    _regs[REG_FIFOREADPTR] = (_regs[REG_FIFOREADPTR] + 1) & 0x1F;
+    _fifoCount--;
+    _fifoByte = 0;
+  }
+
+  uint8_t slot = _regs[REG_FIFOWRITEPTR];
+  uint8_t channels = channelCount();
+  for (uint8_t x = 0 ; x < 3 ; x++)
+  {
+    uint8_t led = (x < channels) ? channelLED(x) : 0;
+    if (led == 1) _fifo[slot][x] = red;
+    else if (led == 2) _fifo[slot][x] = ir;
+    else if (led == 3) _fifo[slot][x] = scaleToADC(_signal.irDC, _regs[REG_LED3_PA]);
+    else _fifo[slot][x] = 0;
+  }
+
+  _regs[REG_FIFOWRITEPTR] = (slot + 1) & 0x1F;
+  _fifoCount++;
+
+  _regs[REG_INTSTAT1] |= INT1_PPG_RDY;
+
+  //FIFO_A_FULL is the number of empty slots left when the interrupt fires
+  uint8_t threshold = MAX3010X_SIM_FIFO_DEPTH - (_regs[REG_FIFOCONFIG] & 0x0F);
+  if (_fifoCount >= threshold) _regs[REG_INTSTAT1] |= INT1_A_FULL;
+}
+
+//
+// Register access
+//
+uint8_t MAX3010xSim::readFIFOByte(void) {
+  if (_fifoCount == 0) return (0);
+
+  uint8_t channels = channelCount();
+  if (channels == 0) return (0);
+
+  uint32_t value = _fifo[_regs[REG_FIFOREADPTR]][_fifoByte / 3];
+  uint8_t shift = 16 - 8 * (_fifoByte % 3);
+  uint8_t out = (value >> shift) & 0xFF;
+
+  _fifoByte++;
+  if (_fifoByte >= channels * 3)
+  {
+    //Record complete, pop it
+    _fifoByte = 0;
+    _regs[REG_FIFOREADPTR] = (_regs[REG_FIFOREADPTR] + 1) & 0x1F;
+    _regs[REG_FIFOOVERFLOW] = 0;
+    _fifoCount--;
+    _regs[REG_INTSTAT1] &= ~INT1_PPG_RDY;
+  }
+
+  return (out);
+}
+
+uint8_t MAX3010xSim::readRegister(uint8_t reg) {
+  uint8_t value;
+
+  switch (reg)
+  {
+    case REG_FIFODATA:
+      return (readFIFOByte());
+
+    case REG_INTSTAT1:
+    case REG_INTSTAT2:
+      value = _regs[reg];
+      _regs[reg] = 0; //Status clears on read
+      return (value);
+
+    case REG_TEMPFRAC:
+      _regs[REG_INTSTAT2] &= ~INT2_DIE_TEMP_RDY;
+      return (_regs[reg]);
+
+    default:
+      return (_regs[reg]);
+  }
+}
+
+void MAX3010xSim::writeRegister(uint8_t reg, uint8_t value) {
+  switch (reg)
+  {
+    case REG_INTSTAT1:
+    case REG_INTSTAT2:
+    case REG_FIFODATA:
+    case REG_REVISIONID:
+    case REG_PARTID:
+      return; //Read only
+
+    case REG_MODECONFIG:
+      if (value & MODE_RESET)
+      {
+        powerOnReset();
+        return;
+      }
+      _regs[reg] = value;
+      return;
+
+    case REG_FIFOWRITEPTR:
+    case REG_FIFOREADPTR:
+      _regs[reg] = value & 0x1F;
+      _fifoCount = (_regs[REG_FIFOWRITEPTR] - _regs[REG_FIFOREADPTR]) & 0x1F;
+      _fifoByte = 0;
+      return;
+
+    case REG_PILOT_PA:
+    case REG_PROXINTTHRESH:
+      if (_proximitySupported) _regs[reg] = value; //Reserved on the MAX30102
+      return;
+
+    case REG_INTENABLE1:
+      if (!_proximitySupported) value &= ~INT1_PROX_INT;
+      _regs[reg] = value;
+      _proximityMode = (value & INT1_PROX_INT) != 0; //Writing PROX_INT_EN (re)enters proximity mode
+      return;
+
+    case REG_TEMPCONFIG:
+      _regs[reg] = value & 0x01;
+      if (value & 0x01)
+      {
+        _temperaturePending = true;
+        _temperatureDoneMicros = micros() + TEMPERATURE_CONVERSION_US;
+      }
+      return;
+
+    default:
+      _regs[reg] = value;
+      return;
+  }
+}
+
+void MAX3010xSim::i2cWrite(const uint8_t *data, size_t length) {
+  if (length == 0) return;
+
+  _pointer = data[0];
+  for (size_t x = 1 ; x < length ; x++)
+  {
+    writeRegister(_pointer, data[x]);
+    if (_pointer != REG_FIFODATA) _pointer++; //Auto increment, except on the FIFO port
+  }
+
+  updateInterruptLine();
+}
+
+void MAX3010xSim::i2cRead(uint8_t *data, size_t length) {
+  for (size_t x = 0 ; x < length ; x++)
+  {
+    data[x] = readRegister(_pointer);
+    if (_pointer != REG_FIFODATA) _pointer++;
+  }
+
+  updateInterruptLine();
+}
+
+#endif // PLATFORM_ID
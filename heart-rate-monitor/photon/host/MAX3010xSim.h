@@ -0,0 +1,120 @@
+/***************************************************
+ Register level model of a MAX30102/MAX30105 for host builds
+
+ Sits on a host TwoWire bus and answers the same register map as the real part:
+ configuration registers, a 32 deep FIFO with read/write/overflow pointers,
+ interrupt status/enable, proximity mode and the die temperature block. Samples are produced
+ on the virtual clock at the programmed output data rate, and the active low
+ INT line is driven onto a host pin so an attached ISR fires exactly as it
+ would on the device.
+
+ The photocurrent comes from a synthetic PPG (see SimSignal) or from a
+ caller supplied SampleSource, e.g. a recorded trace.
+
+ Never part of the device build.
+ *****************************************************/
+
+#pragma once
+
+#include "Arduino.h"
+#include "Wire.h"
+
+#define MAX3010X_SIM_FIFO_DEPTH 32
+
+//Synthetic finger, expressed at the reference configuration
+//(LED amplitude 0x20, ADC range 4096 nA). The model scales it for the real settings.
+typedef struct
+{
+  bool fingerPresent;
+  float heartRateBpm;
+  float irDC;           //IR DC level in ADC counts
+  float redDC;          //Red DC level in ADC counts
+  float perfusion;      //IR AC amplitude as a fraction of DC, 0.01 = 1%
+  float ratio;          //R = (ACred/DCred) / (ACir/DCir), sets SpO2
+  float noise;          //Peak uniform noise in ADC counts
+  float ambient;        //Counts seen with no finger
+  float temperatureC;   //Die temperature
+} SimSignal;
+
+class MAX3010xSim : public I2CDevice {
+ public:
+  //Replaces the synthetic signal. Return false to fall back to it for this sample.
+  //Values are final 18-bit ADC counts, no scaling is applied.
+  typedef bool (*SampleSource)(void *context, uint32_t sampleIndex, uint32_t nowMicros, uint32_t *red, uint32_t *ir);
+
+  MAX3010xSim(void);
+  ~MAX3010xSim();
+
+  //Attaches to a bus and starts following the virtual clock
+  bool connect(TwoWire &wirePort, uint8_t i2caddr = 0x57);
+  void disconnect(void);
+
+  //Routes the open drain INT output to a host pin (pulled up when released)
+  void connectInterrupt(uint16_t pin);
+
+  //The MAX30105 by default. A MAX30102 reports the same part ID but has no proximity
+  //block: PILOT_PA and PROX_INT_THRESH read 0 and PROX_INT_EN does not stick.
+  void setProximitySupported(bool supported) { _proximitySupported = supported; }
+
+  SimSignal &signal(void) { return _signal; }
+  void setSampleSource(SampleSource source, void *context);
+
+  //Introspection for tools
+  uint8_t peekRegister(uint8_t reg) { return _regs[reg]; }
+  uint8_t fifoCount(void) { return _fifoCount; }
+  uint32_t samplesProduced(void) { return _samplesProduced; }
+  uint32_t samplesLost(void) { return _samplesLost; }
+  bool inProximityMode(void) { return _proximityMode; }
+  double ledChargeMicrocoulombs(void) { return _ledCharge / 1000.0; } //Charge pushed through the LEDs so far
+  uint32_t samplePeriodMicros(void);
+  bool interruptAsserted(void);
+
+  // I2CDevice
+  void i2cWrite(const uint8_t *data, size_t length);
+  void i2cRead(uint8_t *data, size_t length);
+
+ private:
+  static void onTick(void *context, uint32_t nowMicros);
+  void tick(uint32_t nowMicros);
+
+  void powerOnReset(void);
+  void writeRegister(uint8_t reg, uint8_t value);
+  uint8_t readRegister(uint8_t reg);
+  uint8_t readFIFOByte(void);
+
+  uint8_t channelCount(void);
+  uint8_t channelLED(uint8_t channel); //1 = red, 2 = IR, 3 = green
+  void produceSample(uint32_t nowMicros);
+  void signalCounts(uint32_t nowMicros, float *redCounts, float *irCounts);
+  void synthesize(uint32_t nowMicros, uint32_t *red, uint32_t *ir);
+  void proximitySample(uint32_t nowMicros);
+  void chargeLEDs(uint16_t milliampLSBs);
+  uint32_t scaleToADC(float counts, uint8_t ledAmplitude);
+  void updateInterruptLine(void);
+
+  TwoWire *_wirePort;
+  uint16_t _intPin;
+  bool _intConnected;
+
+  uint8_t _regs[256];
+  uint8_t _pointer;
+
+  uint32_t _fifo[MAX3010X_SIM_FIFO_DEPTH][3];
+  uint8_t _fifoCount;
+  uint8_t _fifoByte; //Byte offset into the record at the read pointer
+
+  uint32_t _nextSampleMicros;
+  uint32_t _temperatureDoneMicros;
+  bool _temperaturePending;
+  bool _proximityMode;
+  bool _proximitySupported;
+
+  uint32_t _samplesProduced;
+  uint32_t _samplesLost;
+  uint32_t _noiseState;
+  double _ledCharge; //nC
+
+  SimSignal _signal;
+  SampleSource _source;
+  void *_sourceContext;
+};
@@ -0,0 +1,4 @@
+//Pre-1.0 Arduino header name, the host core serves both
+#pragma once
+
+#include "Arduino.h"
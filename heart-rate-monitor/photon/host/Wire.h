@@ -0,0 +1,76 @@
+/***************************************************
+ Host (Linux) stand-in for the Arduino/Particle Wire library
+
+ Transactions are routed to in-process device models attached with
+ TwoWire::attach(). Every bus transaction is counted so tools can measure
+ how much I2C traffic a driver change saves.
+
+ Never part of the device build.
+ *****************************************************/
+
+#pragma once
+
+#include "Arduino.h"
+
+#define HOST_WIRE_BUFFER_LENGTH 32
+#define HOST_WIRE_MAX_DEVICES 4
+
+//A device model that sits on a host I2C bus
+class I2CDevice {
+ public:
+  virtual ~I2CDevice() {}
+
+  //Bytes of one write transaction (register address first)
+  virtual void i2cWrite(const uint8_t *data, size_t length) = 0;
+
+  //Fills data with length bytes continuing from the current register pointer
+  virtual void i2cRead(uint8_t *data, size_t length) = 0;
+};
+
+class TwoWire {
+ public:
+  TwoWire(void);
+
+  void begin(void);
+  void setClock(uint32_t speed);
+
+  void beginTransmission(uint8_t address);
+  void beginTransmission(int address) { beginTransmission((uint8_t)address); }
+  size_t write(uint8_t data);
+  uint8_t endTransmission(bool stop = true);
+
+  size_t requestFrom(uint8_t address, size_t quantity, bool stop = true);
+  size_t requestFrom(uint8_t address, uint8_t quantity) { return requestFrom(address, (size_t)quantity); }
+  size_t requestFrom(int address, int quantity) { return requestFrom((uint8_t)address, (size_t)quantity); }
+  int available(void);
+  int read(void);
+
+  // Host only
+  bool attach(uint8_t address, I2CDevice *device);
+  void detachAll(void);
+
+  uint32_t transactionCount(void) { return _transactions; } //Address phases seen on the bus
+  uint32_t byteCount(void) { return _bytes; }
+  void resetCounters(void) { _transactions = 0; _bytes = 0; }
+
+ private:
+  I2CDevice *findDevice(uint8_t address);
+
+  uint8_t _addresses[HOST_WIRE_MAX_DEVICES];
+  I2CDevice *_devices[HOST_WIRE_MAX_DEVICES];
+  uint8_t _deviceCount;
+
+  uint8_t _txAddress;
+  uint8_t _txBuffer[HOST_WIRE_BUFFER_LENGTH];
+  size_t _txLength;
+
+  uint8_t _rxBuffer[HOST_WIRE_BUFFER_LENGTH];
+  size_t _rxLength;
+  size_t _rxIndex;
+
+  uint32_t _transactions;
+  uint32_t _bytes;
+};
+
+extern TwoWire Wire;
+extern TwoWire Wire1;
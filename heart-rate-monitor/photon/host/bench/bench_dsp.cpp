@@ -0,0 +1,377 @@
+// DSP microbenchmark suite
+//
+// Times every signal processing routine the firmware runs per sample or per window,
+// on three kinds of input, and counts heap allocations made while they run:
+//
+//   clean        PPG at 75 bpm, no noise
+//   noisy        the same with sensor noise, baseline wander and motion spikes
+//   adversarial  full scale square wave at half the sample rate: every other sample
+//                is a peak, the filters see their largest steps
+//
+// Results go to stdout as JSON, one result per line so baselines diff cleanly. With
+// --baseline the run is compared against a stored result and the exit status is 1
+// when any routine got slower than the tolerance allows or allocates more than before.
+//
+//   g++ -std=gnu++17 -O2 -Ihost -I. host/bench/bench_dsp.cpp spo2_algorithm.cpp spo2_kernels.cpp heartRate.cpp -o bench_dsp
+//   ./bench_dsp --baseline host/bench/baseline.json
+//   ./bench_dsp --json host/bench/baseline.json      after an intended change, on the same machine
+//
+//   --json FILE       write the results to FILE instead of stdout
+//   --baseline FILE   compare against FILE
+//   --tolerance PCT   allowed slowdown against the baseline (default 25)
+//   --passes N        times the whole suite is run, each routine keeps its best (default 3)
+//
+// Timings are ns per input sample, the best of several runs spread over the passes so
+// a burst of load elsewhere on the machine hits one pass, not the result. They only
+// compare against a baseline taken on the same machine and compiler flags.
+
+#ifndef PLATFORM_ID
+
+#include <algorithm>
+#include <chrono>
+#include <new>
+#include <string>
+#include <vector>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "heartRate.h"
+#include "spo2_algorithm.h"
+#include "spo2_kernels.h"
+
+//
+// Allocation counting: every operator new, and malloc itself where glibc lets us wrap it
+//
+
+static long allocations = 0;
+
+void *operator new(size_t size) {
+#ifndef __GLIBC__
+  allocations++; // glibc counts it in malloc() below
+#endif
+  void *p = malloc(size ? size : 1);
+  if (p == NULL) throw std::bad_alloc();
+  return (p);
+}
+void *operator new[](size_t size) { return (operator new(size)); }
+void operator delete(void *p) noexcept { free(p); }
+void operator delete[](void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+void operator delete[](void *p, size_t) noexcept { free(p); }
+
+#ifdef __GLIBC__
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *malloc(size_t size) {
+  allocations++;
+  return (__libc_malloc(size));
+}
+#endif
+
+//
+// Inputs
+//
+
+static const int SIGNAL_LENGTH = 25 * 60; // one minute at 25 Hz
+static const uint32_t SIGNAL_PERIOD_US = 40000;
+static const uint32_t ADC_FULL_SCALE = 0x3FFFF;
+
+struct Signal {
+  const char *name;
+  uint32_t red[SIGNAL_LENGTH];
+  uint32_t ir[SIGNAL_LENGTH];
+  uint32_t time[SIGNAL_LENGTH];
+  int16_t ac[SIGNAL_LENGTH]; // IR without its DC, what lowPassFIRFilter() sees
+};
+
+static uint32_t nextRandom(uint32_t &state) {
+  state = state * 1664525UL + 1013904223UL;
+  return (state >> 8);
+}
+
+// Uniform in -1..1
+static float noise(uint32_t &state) {
+  return ((float)(nextRandom(state) & 0xFFFF) / 32768.0f - 1.0f);
+}
+
+static uint32_t clampADC(float x) {
+  if (x < 0) return (0);
+  if (x > ADC_FULL_SCALE) return (ADC_FULL_SCALE);
+  return ((uint32_t)x);
+}
+
+static void fillPPG(Signal &s, bool noisy) {
+  uint32_t seed = 2024;
+  const float dc = 120000.0f, pi = 0.01f, ratio = 0.6f;
+  for (int k = 0; k < SIGNAL_LENGTH; k++) {
+    float t = k * SIGNAL_PERIOD_US / 1e6f;
+    float ph = 2.0f * (float)M_PI * 75.0f / 60.0f * t;
+    float w = (sinf(ph) + 0.35f * sinf(2.0f * ph + 0.6f)) / 1.2f;
+    float ir = dc * (1.0f - 0.5f * pi * w);
+    float red = 0.8f * dc * (1.0f - 0.5f * ratio * pi * w);
+    if (noisy) {
+      float wander = 3000.0f * sinf(0.3f * t);
+      float spike = (nextRandom(seed) % 200 == 0) ? 20000.0f * noise(seed) : 0.0f;
+      ir += wander + spike + 300.0f * noise(seed);
+      red += wander + spike + 300.0f * noise(seed);
+    }
+    s.ir[k] = clampADC(ir);
+    s.red[k] = clampADC(red);
+  }
+}
+
+static void fillAdversarial(Signal &s) {
+  for (int k = 0; k < SIGNAL_LENGTH; k++) s.ir[k] = s.red[k] = (k & 1) ? ADC_FULL_SCALE : 0;
+}
+
+static void finishSignal(Signal &s) {
+  uint32_t sum = 0;
+  for (int k = 0; k < SIGNAL_LENGTH; k++) sum += s.ir[k];
+  int32_t mean = (int32_t)(sum / SIGNAL_LENGTH);
+  for (int k = 0; k < SIGNAL_LENGTH; k++) {
+    s.time[k] = k * SIGNAL_PERIOD_US;
+    int32_t ac = ((int32_t)s.ir[k] - mean) >> 2;
+    s.ac[k] = (int16_t)(ac > 32767 ? 32767 : ac < -32768 ? -32768 : ac);
+  }
+}
+
+//
+// Timing
+//
+
+struct Result {
+  std::string name;
+  std::string input;
+  double nsPerSample;
+  double allocsPerCall;
+};
+
+static volatile int32_t sink;
+
+// Best of several runs, each long enough to swamp the clock; body() handles samplesPerCall samples
+template <typename F>
+static Result measure(const char *name, const Signal &s, long samplesPerCall, F body) {
+  body(); // warm up, and the allocation count of one call
+  long before = allocations;
+  body();
+  double allocsPerCall = (double)(allocations - before);
+
+  long calls = 1;
+  for (;;) {
+    auto t0 = std::chrono::steady_clock::now();
+    for (long c = 0; c < calls; c++) body();
+    if (std::chrono::steady_clock::now() - t0 > std::chrono::milliseconds(20)) break;
+    calls *= 2;
+  }
+
+  double best = 1e300;
+  for (int run = 0; run < 5; run++) {
+    auto t0 = std::chrono::steady_clock::now();
+    for (long c = 0; c < calls; c++) body();
+    double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - t0).count();
+    if (ns < best) best = ns;
+  }
+
+  Result r;
+  r.name = name;
+  r.input = s.name;
+  r.nsPerSample = best / ((double)calls * samplesPerCall);
+  r.allocsPerCall = allocsPerCall;
+  return (r);
+}
+
+// checkForBeat() and lowPassFIRFilter() run on the BeatDetector behind the free functions;
+// its state carries over between calls, which is how a sketch drives them too
+
+static void benchSignal(const Signal &s, std::vector<Result> &results) {
+  results.push_back(measure("lowPassFIRFilter", s, SIGNAL_LENGTH, [&]() {
+    int32_t acc = 0;
+    for (int k = 0; k < SIGNAL_LENGTH; k++) acc += lowPassFIRFilter(s.ac[k]);
+    sink = acc;
+  }));
+
+  // The block form a FIFO drain at a time, same output as the loop above
+  results.push_back(measure("lowPassFIRFilter_block32", s, SIGNAL_LENGTH, [&]() {
+    static int16_t out[32];
+    int32_t acc = 0;
+    for (int k = 0; k < SIGNAL_LENGTH; k += 32) {
+      uint16_t n = SIGNAL_LENGTH - k < 32 ? SIGNAL_LENGTH - k : 32;
+      lowPassFIRFilter(s.ac + k, out, n);
+      for (uint16_t i = 0; i < n; i++) acc += out[i];
+    }
+    sink = acc;
+  }));
+
+  results.push_back(measure("averageDCEstimator", s, SIGNAL_LENGTH, [&]() {
+    int32_t reg = 0, acc = 0;
+    for (int k = 0; k < SIGNAL_LENGTH; k++) acc += averageDCEstimator(&reg, (uint16_t)(s.ir[k] >> 2));
+    sink = acc;
+  }));
+
+  results.push_back(measure("checkForBeat", s, SIGNAL_LENGTH, [&]() {
+    int32_t beats = 0;
+    for (int k = 0; k < SIGNAL_LENGTH; k++) beats += checkForBeat((int32_t)s.ir[k]);
+    sink = beats;
+  }));
+
+  // The valley search on what the algorithm hands it: inverted, DC free IR
+  static int32_t x[SIGNAL_LENGTH];
+  for (int k = 0; k < SIGNAL_LENGTH; k++) x[k] = -(s.ac[k]);
+  const int windows = SIGNAL_LENGTH / BUFFER_SIZE;
+  results.push_back(measure("maxim_find_peaks", s, (long)windows * BUFFER_SIZE, [&]() {
+    int32_t locs[MAX_NUM_PEAKS], npks = 0, found = 0;
+    for (int w = 0; w < windows; w++) {
+      maxim_find_peaks(locs, &npks, x + w * BUFFER_SIZE, BUFFER_SIZE, 30, 4, MAX_NUM_PEAKS);
+      found += npks;
+    }
+    sink = found;
+  }));
+
+  // One full window per call, ns/sample is the window cost spread over its samples
+  results.push_back(measure("maxim_heart_rate_and_oxygen_saturation", s, (long)windows * BUFFER_SIZE, [&]() {
+    int32_t spo2, hr, acc = 0;
+    int8_t spo2Valid, hrValid;
+    for (int w = 0; w < windows; w++) {
+      maxim_heart_rate_and_oxygen_saturation((uint32_t *)s.ir + w * BUFFER_SIZE, BUFFER_SIZE,
+                                             (uint32_t *)s.red + w * BUFFER_SIZE, &spo2, &spo2Valid, &hr, &hrValid,
+                                             SIGNAL_PERIOD_US, s.time + w * BUFFER_SIZE);
+      acc += spo2 + hr;
+    }
+    sink = acc;
+  }));
+
+  // The sliding window with a result every FIFO drain (20 samples), without and with the quality
+  // gate. The firmware runs it gated: windows that fail the check skip the analysis.
+  static maxim_spo2_stream stream;
+  for (int8_t gate = 0; gate <= 1; gate++)
+    results.push_back(measure(gate ? "maxim_spo2_stream_sqi_gate" : "maxim_spo2_stream", s, SIGNAL_LENGTH, [&]() {
+      int32_t spo2, hr, acc = 0;
+      int8_t spo2Valid, hrValid;
+      maxim_spo2_stream_init(&stream, BUFFER_SIZE, 20, SIGNAL_PERIOD_US, 1);
+      maxim_spo2_stream_set_sqi_gate(&stream, gate);
+      for (int k = 0; k < SIGNAL_LENGTH; k++) {
+        if (!maxim_spo2_stream_add(&stream, s.ir[k], s.red[k], s.time[k])) continue;
+        maxim_spo2_stream_result(&stream, &spo2, &spo2Valid, &hr, &hrValid);
+        acc += spo2 + hr;
+      }
+      sink = acc;
+    }));
+}
+
+//
+// JSON in and out
+//
+
+static void writeJSON(FILE *f, const std::vector<Result> &results) {
+  fprintf(f, "{\n  \"suite\": \"photon-dsp\",\n  \"kernels\": \"%s\",\n  \"buffer_size\": %d,\n  \"results\": [\n",
+          maxim_kernels_name(), BUFFER_SIZE);
+  for (size_t i = 0; i < results.size(); i++)
+    fprintf(f, "    {\"name\": \"%s\", \"input\": \"%s\", \"ns_per_sample\": %.3f, \"allocs_per_call\": %.0f}%s\n",
+            results[i].name.c_str(), results[i].input.c_str(), results[i].nsPerSample, results[i].allocsPerCall,
+            i + 1 < results.size() ? "," : "");
+  fprintf(f, "  ]\n}\n");
+}
+
+// Reads back what writeJSON() wrote, one result per line
+static bool readBaseline(const char *path, std::vector<Result> &baseline) {
+  FILE *f = fopen(path, "r");
+  if (f == NULL) return (false);
+  char line[512];
+  while (fgets(line, sizeof(line), f)) {
+    char name[128], input[64];
+    double ns, allocs;
+    const char *p = strstr(line, "{\"name\"");
+    if (p != NULL && sscanf(p, "{\"name\": \"%127[^\"]\", \"input\": \"%63[^\"]\", \"ns_per_sample\": %lf, \"allocs_per_call\": %lf",
+                            name, input, &ns, &allocs) == 4)
+      baseline.push_back(Result{name, input, ns, allocs});
+  }
+  fclose(f);
+  return (true);
+}
+
+// Differences under a nanosecond are clock noise, whatever the percentage
+static const double NOISE_FLOOR_NS = 1.0;
+
+static int compare(const std::vector<Result> &results, const std::vector<Result> &baseline, double tolerancePct) {
+  int regressions = 0;
+  fprintf(stderr, "%-40s %-12s %10s %10s %8s\n", "routine", "input", "baseline", "now", "change");
+  for (const Result &r : results) {
+    const Result *b = NULL;
+    for (const Result &c : baseline)
+      if (c.name == r.name && c.input == r.input) b = &c;
+    if (b == NULL) {
+      fprintf(stderr, "%-40s %-12s %10s %10.2f %8s\n", r.name.c_str(), r.input.c_str(), "-", r.nsPerSample, "new");
+      continue;
+    }
+    double change = b->nsPerSample > 0 ? 100.0 * (r.nsPerSample - b->nsPerSample) / b->nsPerSample : 0;
+    bool slower = change > tolerancePct && r.nsPerSample - b->nsPerSample > NOISE_FLOOR_NS;
+    bool allocates = r.allocsPerCall > b->allocsPerCall;
+    fprintf(stderr, "%-40s %-12s %10.2f %10.2f %+7.1f%%%s%s\n", r.name.c_str(), r.input.c_str(), b->nsPerSample,
+            r.nsPerSample, change, slower ? "  SLOWER" : "", allocates ? "  ALLOCATES" : "");
+    regressions += slower || allocates;
+  }
+  return (regressions);
+}
+
+int main(int argc, char **argv) {
+  const char *jsonPath = NULL;
+  const char *baselinePath = NULL;
+  double tolerancePct = 25;
+  int passes = 3;
+
+  for (int i = 1; i < argc; i++) {
+    bool hasValue = i + 1 < argc;
+    if (strcmp(argv[i], "--json") == 0 && hasValue) jsonPath = argv[++i];
+    else if (strcmp(argv[i], "--baseline") == 0 && hasValue) baselinePath = argv[++i];
+    else if (strcmp(argv[i], "--tolerance") == 0 && hasValue) tolerancePct = atof(argv[++i]);
+    else if (strcmp(argv[i], "--passes") == 0 && hasValue) passes = atoi(argv[++i]);
+    else {
+      fprintf(stderr, "usage: bench_dsp [--json FILE] [--baseline FILE] [--tolerance PCT] [--passes N]\n");
+      return (2);
+    }
+  }
+
+  // Read first, --json and --baseline may name the same file
+  std::vector<Result> baseline;
+  if (baselinePath != NULL && !readBaseline(baselinePath, baseline)) {
+    fprintf(stderr, "can't read %s\n", baselinePath);
+    return (2);
+  }
+
+  static Signal clean, noisy, adversarial;
+  clean.name = "clean";
+  noisy.name = "noisy";
+  adversarial.name = "adversarial";
+  fillPPG(clean, false);
+  fillPPG(noisy, true);
+  fillAdversarial(adversarial);
+
+  for (Signal *s : {&clean, &noisy, &adversarial}) finishSignal(*s);
+
+  std::vector<Result> results;
+  for (int pass = 0; pass < std::max(passes, 1); pass++) {
+    std::vector<Result> run;
+    for (Signal *s : {&clean, &noisy, &adversarial}) benchSignal(*s, run);
+    if (results.empty()) results = run;
+    for (size_t i = 0; i < run.size(); i++) {
+      results[i].nsPerSample = std::min(results[i].nsPerSample, run[i].nsPerSample);
+      results[i].allocsPerCall = std::max(results[i].allocsPerCall, run[i].allocsPerCall);
+    }
+  }
+
+  FILE *out = jsonPath != NULL ? fopen(jsonPath, "w") : stdout;
+  if (out == NULL) {
+    fprintf(stderr, "can't write %s\n", jsonPath);
+    return (2);
+  }
+  writeJSON(out, results);
+  if (out != stdout) fclose(out);
+
+  if (baselinePath == NULL) return (0);
+  int regressions = compare(results, baseline, tolerancePct);
+  if (regressions) fprintf(stderr, "%d regression(s) against %s\n", regressions, baselinePath);
+  return (regressions ? 1 : 0);
+}
+
+#endif
@@ -0,0 +1,231 @@
+// Heart rate engine comparison
+//
+// Runs both heart rate engines, maxim_hr_peaks() and maxim_hr_spectral(), on the same
+// synthetic windows with a known rate and reports how often each gets it right next to
+// what it costs, so a change to either can be weighed in accuracy per CPU cycle:
+//
+//   clean        1 % perfusion, little noise
+//   low-pi       0.05 to 0.15 % perfusion, the AC a few ADC counts above the noise
+//   dicrotic     a strong dicrotic notch, the second harmonic as large as the pulse
+//   irregular    every beat 15 % longer or shorter than the last at random
+//   motion       baseline wander and spikes on top of a 0.5 % pulse
+//
+// Rates are spread evenly over 45..180 bpm. A window counts as a hit when it is valid
+// and within --tolerance of the true rate; a miss that is still valid is an error the
+// caller can't see, listed separately from windows the engine turned down.
+//
+//   g++ -std=gnu++17 -O2 -Ihost -I. host/bench/bench_hr.cpp spo2_algorithm.cpp spo2_kernels.cpp -o bench_hr
+//   g++ ... -DHR_FFT_SIZE=128 ...   to see what the smaller transform gives up
+//
+//   --rate HZ        sample rate (default 25)
+//   --window N       samples per window (default BUFFER_SIZE)
+//   --windows N      windows per input kind (default 2000)
+//   --tolerance BPM  hit tolerance (default 5)
+//
+// Cost is the best of a few timed passes over all windows of a kind, in ns per window and,
+// on x86, time stamp counter ticks per window, which run at a fixed rate close to the
+// nominal clock. Neither says what a Cortex-M33 takes, only how the engines compare.
+
+#ifndef PLATFORM_ID
+
+#include <chrono>
+#include <string>
+#include <vector>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC 1
+#endif
+
+#include "spo2_algorithm.h"
+#include "spo2_kernels.h"
+
+struct Options {
+  double rate = FreqS;
+  int window = BUFFER_SIZE;
+  int windows = 2000;
+  double tolerance = 5;
+};
+
+struct Kind {
+  const char *name;
+  double piMin, piMax;   // perfusion, fraction of DC
+  double harmonic;       // second harmonic against the fundamental
+  double jitter;         // beat to beat change of the interval
+  double noise;          // white noise, ADC counts peak to peak
+  bool motion;
+};
+
+static const Kind KINDS[] = {
+  { "clean",     0.010,  0.010,  0.35, 0.00,  20, false },
+  { "low-pi",    0.0005, 0.0015, 0.35, 0.00,  60, false },
+  { "dicrotic",  0.010,  0.010,  1.00, 0.00,  20, false },
+  { "irregular", 0.010,  0.010,  0.35, 0.15,  20, false },
+  { "motion",    0.005,  0.005,  0.35, 0.00, 100, true },
+};
+
+struct Window {
+  double bpm;
+  std::vector<int32_t> x; // DC removed, inverted, 4 pt averaged IR
+};
+
+static uint32_t nextRandom(uint32_t &state) {
+  state = state * 1664525UL + 1013904223UL;
+  return (state >> 8);
+}
+
+// Uniform in 0..1
+static double uniform(uint32_t &state) {
+  return ((double)(nextRandom(state) & 0xFFFFFF) / 16777216.0);
+}
+
+static void makeWindow(const Kind &kind, const Options &opt, int index, uint32_t &seed, Window &w) {
+  const double dc = 120000.0;
+  double bpm = 45.0 + 135.0 * (index + 0.5) / opt.windows;
+  double pi = kind.piMin + (kind.piMax - kind.piMin) * uniform(seed);
+  double ph = 2.0 * M_PI * uniform(seed);
+  double beat = 60.0 / bpm, left = beat * uniform(seed), elapsed = 0;
+  double wanderPhase = 2.0 * M_PI * uniform(seed);
+  std::vector<uint32_t> ir(opt.window);
+
+  w.bpm = bpm;
+  for (int k = 0; k < opt.window; k++) {
+    double t = k / opt.rate;
+    double wave = (sin(ph) + kind.harmonic * sin(2.0 * ph + 0.6)) / (1.0 + kind.harmonic);
+    double v = dc * (1.0 - 0.5 * pi * wave) + kind.noise * (uniform(seed) - 0.5);
+    if (kind.motion) {
+      v += 3000.0 * sin(0.3 * 2.0 * M_PI * t + wanderPhase);
+      if (nextRandom(seed) % 50 == 0) v += 4000.0 * (uniform(seed) - 0.5);
+    }
+    ir[k] = v < 0 ? 0 : (uint32_t)v;
+
+    // advance the phase through beats of varying length
+    double step = 1.0 / opt.rate;
+    while (step > 0) {
+      double dt = step < left ? step : left;
+      ph += 2.0 * M_PI * dt / beat;
+      left -= dt;
+      step -= dt;
+      elapsed += dt;
+      if (left <= 0) {
+        double next = 60.0 / bpm * (1.0 + kind.jitter * (2.0 * uniform(seed) - 1.0));
+        beat = next;
+        left = next;
+      }
+    }
+  }
+  (void)elapsed;
+
+  // the same preparation maxim_heart_rate_and_oxygen_saturation() does
+  uint32_t sum = 0;
+  for (int k = 0; k < opt.window; k++) sum += ir[k];
+  uint32_t mean = sum / opt.window;
+  w.x.resize(opt.window);
+  for (int k = 0; k < opt.window; k++) w.x[k] = -1 * (int32_t)(ir[k] - mean);
+  maxim_kernel_ma4(w.x.data(), opt.window);
+}
+
+struct Score {
+  long hits = 0, wrong = 0, rejected = 0;
+  double absError = 0; // over valid windows
+  double ns = 0, ticks = 0;
+};
+
+static volatile int32_t sink;
+
+static Score run(maxim_hr_engine engine, std::vector<Window> &windows, const Options &opt) {
+  Score s;
+  int32_t period = (int32_t)(1e6 / opt.rate + 0.5);
+  long valid = 0;
+
+  for (Window &w : windows) {
+    int32_t hr;
+    int8_t ok;
+    engine(w.x.data(), (int32_t)w.x.size(), period, &hr, &ok);
+    if (!ok) {
+      s.rejected++;
+      continue;
+    }
+    valid++;
+    s.absError += fabs(hr - w.bpm);
+    if (fabs(hr - w.bpm) <= opt.tolerance) s.hits++;
+    else s.wrong++;
+  }
+  if (valid) s.absError /= valid;
+
+  s.ns = 1e300;
+  s.ticks = 1e300;
+  for (int pass = 0; pass < 5; pass++) {
+    int32_t acc = 0;
+#ifdef HAVE_TSC
+    unsigned long long c0 = __rdtsc();
+#endif
+    auto t0 = std::chrono::steady_clock::now();
+    for (Window &w : windows) {
+      int32_t hr;
+      int8_t ok;
+      engine(w.x.data(), (int32_t)w.x.size(), period, &hr, &ok);
+      acc += hr;
+    }
+    double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - t0).count();
+#ifdef HAVE_TSC
+    double ticks = (double)(__rdtsc() - c0);
+    if (ticks / windows.size() < s.ticks) s.ticks = ticks / windows.size();
+#endif
+    if (ns / windows.size() < s.ns) s.ns = ns / windows.size();
+    sink = acc;
+  }
+  return (s);
+}
+
+static void printRow(const char *engine, const char *kind, const Score &s, long n) {
+  printf("%-9s %-10s %6.1f%% %6.1f%% %6.1f%% %7.2f %9.0f", engine, kind, 100.0 * s.hits / n, 100.0 * s.wrong / n,
+         100.0 * s.rejected / n, s.absError, s.ns);
+#ifdef HAVE_TSC
+  printf(" %9.0f %9.1f", s.ticks, 1e6 * s.hits / n / s.ticks);
+#endif
+  printf("\n");
+}
+
+int main(int argc, char **argv) {
+  Options opt;
+
+  for (int i = 1; i < argc; i++) {
+    std::string a = argv[i];
+    if (a == "--rate" && i + 1 < argc) opt.rate = atof(argv[++i]);
+    else if (a == "--window" && i + 1 < argc) opt.window = atoi(argv[++i]);
+    else if (a == "--windows" && i + 1 < argc) opt.windows = atoi(argv[++i]);
+    else if (a == "--tolerance" && i + 1 < argc) opt.tolerance = atof(argv[++i]);
+    else {
+      fprintf(stderr, "usage: bench_hr [--rate HZ] [--window N] [--windows N] [--tolerance BPM]\n");
+      return (2);
+    }
+  }
+  if (opt.rate <= 0 || opt.window < 8 || opt.windows < 1) {
+    fprintf(stderr, "bench_hr: bad option value\n");
+    return (2);
+  }
+
+  printf("heart rate engines, %d samples at %.1f Hz, %d windows per kind, FFT %d points, kernels %s\n", opt.window,
+         opt.rate, opt.windows, HR_FFT_SIZE, maxim_kernels_name());
+  printf("%-9s %-10s %7s %7s %7s %7s %9s", "engine", "input", "hit", "wrong", "reject", "MAE", "ns/win");
+#ifdef HAVE_TSC
+  printf(" %9s %9s", "tsc/win", "hit/Mtsc");
+#endif
+  printf("\n");
+
+  for (const Kind &kind : KINDS) {
+    std::vector<Window> windows(opt.windows);
+    uint32_t seed = 4242;
+    for (int i = 0; i < opt.windows; i++) makeWindow(kind, opt, i, seed, windows[i]);
+
+    printRow("peaks", kind.name, run(maxim_hr_peaks, windows, opt), opt.windows);
+    printRow("spectral", kind.name, run(maxim_hr_spectral, windows, opt), opt.windows);
+  }
+  return (0);
+}
+
+#endif // PLATFORM_ID
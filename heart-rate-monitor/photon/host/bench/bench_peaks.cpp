@@ -0,0 +1,94 @@
+// Peak selection microbenchmark
+//
+// Worst case for the valley search: windows where nearly every other sample is a
+// local maximum above the threshold, so the candidate list is always full and the
+// close-peak filter has the most to do. Also times the streaming detector per sample.
+//
+//   g++ -std=gnu++17 -O2 -Ihost -I. host/bench/bench_peaks.cpp spo2_algorithm.cpp spo2_kernels.cpp -o bench_peaks
+//   g++ ... -DMAX_NUM_PEAKS=50 ...   to see how selection scales with a larger cap
+
+#ifndef PLATFORM_ID
+
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "spo2_algorithm.h"
+
+static const int WINDOWS = 20000;
+static const int VARIANTS = 32; // distinct windows, cycled
+
+typedef void (*fill_fn)(int32_t *x, int32_t n, uint32_t seed);
+
+static uint32_t nextRandom(uint32_t &state) {
+  state = state * 1664525UL + 1013904223UL;
+  return (state >> 8);
+}
+
+// Every odd sample a peak, heights random so the ranking has real work
+static void fillAlternating(int32_t *x, int32_t n, uint32_t seed) {
+  for (int32_t k = 0; k < n; k++) x[k] = (k & 1) ? 100 + (int32_t)(nextRandom(seed) % 1000) : 0;
+}
+
+// White noise, about a third of the samples are local maxima
+static void fillNoise(int32_t *x, int32_t n, uint32_t seed) {
+  for (int32_t k = 0; k < n; k++) x[k] = 40 + (int32_t)(nextRandom(seed) % 1000);
+}
+
+// Rising ramp of peaks: each one beats its left neighbour, the longest chain for the filter
+static void fillRamp(int32_t *x, int32_t n, uint32_t seed) {
+  (void)seed;
+  for (int32_t k = 0; k < n; k++) x[k] = (k & 1) ? 100 + k : 0;
+}
+
+static void benchWindow(const char *name, fill_fn fill, int32_t minDistance) {
+  static int32_t x[VARIANTS][BUFFER_SIZE];
+  for (int v = 0; v < VARIANTS; v++) fill(x[v], BUFFER_SIZE, 12345 + v);
+
+  int32_t locs[MAX_NUM_PEAKS];
+  int32_t npks = 0;
+  long found = 0;
+
+  auto t0 = std::chrono::steady_clock::now();
+  for (int w = 0; w < WINDOWS; w++) {
+    maxim_find_peaks(locs, &npks, x[w % VARIANTS], BUFFER_SIZE, 30, minDistance, MAX_NUM_PEAKS);
+    found += npks;
+  }
+  auto t1 = std::chrono::steady_clock::now();
+
+  printf("%-12s window %3d, distance %d: %7.0f ns/window, %4.1f peaks kept\n", name, BUFFER_SIZE, (int)minDistance,
+         std::chrono::duration<double, std::nano>(t1 - t0).count() / WINDOWS, (double)found / WINDOWS);
+}
+
+static void benchStream(const char *name, fill_fn fill, int32_t minDistance) {
+  static int32_t x[WINDOWS];
+  fill(x, WINDOWS, 777);
+
+  maxim_peak_stream stream;
+  maxim_peak_stream_init(&stream, 30, minDistance);
+  int32_t loc;
+  long found = 0;
+
+  const int passes = 50;
+  auto t0 = std::chrono::steady_clock::now();
+  for (int p = 0; p < passes; p++)
+    for (int k = 0; k < WINDOWS; k++) found += maxim_peak_stream_add(&stream, x[k], &loc);
+  auto t1 = std::chrono::steady_clock::now();
+
+  printf("%-12s stream, distance %d: %7.1f ns/sample, %ld peaks\n", name, (int)minDistance,
+         std::chrono::duration<double, std::nano>(t1 - t0).count() / ((double)WINDOWS * passes), found);
+}
+
+int main() {
+  printf("MAX_NUM_PEAKS %d\n", MAX_NUM_PEAKS);
+  for (int32_t d = 1; d <= 8; d *= 2) {
+    benchWindow("alternating", fillAlternating, d);
+    benchWindow("noise", fillNoise, d);
+    benchWindow("ramp", fillRamp, d);
+  }
+  benchStream("alternating", fillAlternating, 4);
+  benchStream("noise", fillNoise, 4);
+  return 0;
+}
+
+#endif
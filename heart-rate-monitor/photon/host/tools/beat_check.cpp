@@ -0,0 +1,112 @@
+// Beat interval check
+//
+// Feeds BeatRate and BeatVariability beat sequences with a known answer, the ones the
+// firmware has to get right before a record goes out: a steady rhythm, an extra beat
+// between two real ones, a missed beat, both in one run, and a rhythm with real variability.
+// An extra or missed beat must leave the rate and the HRV statistics where the real
+// beats put them. Prints one line per case and exits 1 if any case is off.
+//
+//   g++ -std=gnu++17 -O2 -Ihost -I. host/tools/beat_check.cpp heartRate.cpp spo2_kernels.cpp -o beat_check
+//   ./beat_check
+
+#ifndef PLATFORM_ID
+
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "heartRate.h"
+
+struct Expect {
+  int bpm;          // BeatRate::getBPM()
+  int sdnn;         // ms
+  int rmssd;        // ms
+  int pnn50;        // %
+  int intervals;    // BeatVariability::getIntervalCount()
+};
+
+struct Case {
+  const char *name;
+  std::vector<uint32_t> beatsUs;
+  Expect expect;
+};
+
+// count beats every periodUs from startUs
+static void steady(std::vector<uint32_t> &beats, uint32_t startUs, uint32_t periodUs, int count) {
+  for (int k = 0; k < count; k++) beats.push_back(startUs + k * periodUs);
+}
+
+static std::vector<Case> makeCases(void) {
+  std::vector<Case> cases;
+
+  // 800 ms beats, 75 bpm, no variability
+  Case clean = { "steady", {}, { 75, 0, 0, 0, 19 } };
+  steady(clean.beatsUs, 0, 800000, 20);
+  cases.push_back(clean);
+
+  // an extra beat 200 ms after the 6th: dropped, the next interval runs from the real beat
+  Case extra = { "extra beat", {}, { 75, 0, 0, 0, 19 } };
+  steady(extra.beatsUs, 0, 800000, 20);
+  extra.beatsUs.insert(extra.beatsUs.begin() + 6, 5 * 800000 + 200000);
+  cases.push_back(extra);
+
+  // the 10th beat missed at 600 ms beats: 1200 ms passes the rate limits but not the
+  // change check, so it is dropped from the ring along with both differences around it
+  Case missed = { "missed beat", {}, { 100, 0, 0, 0, 17 } };
+  steady(missed.beatsUs, 0, 600000, 20);
+  missed.beatsUs.erase(missed.beatsUs.begin() + 10);
+  cases.push_back(missed);
+
+  // both, an extra beat early on and a missed one later
+  Case both = { "extra and missed", {}, { 100, 0, 0, 0, 17 } };
+  steady(both.beatsUs, 0, 600000, 20);
+  both.beatsUs.erase(both.beatsUs.begin() + 12);
+  both.beatsUs.insert(both.beatsUs.begin() + 4, 3 * 600000 + 150000);
+  cases.push_back(both);
+
+  // alternating 750 and 850 ms: every successive difference is 100 ms. The rate is the
+  // trimmed mean of the last five, 750/850/750/850/750 trims to 783 ms, 77 bpm
+  Case alternating = { "alternating", {}, { 77, 51, 100, 100, 19 } };
+  uint32_t t = 0;
+  for (int k = 0; k < 20; k++) {
+    alternating.beatsUs.push_back(t);
+    t += (k & 1) ? 850000 : 750000;
+  }
+  cases.push_back(alternating);
+
+  return (cases);
+}
+
+int main(int argc, char **argv) {
+  (void)argv;
+  if (argc > 1) {
+    fprintf(stderr, "usage: beat_check\n");
+    return (2);
+  }
+
+  int failed = 0;
+  printf("%-18s %9s %9s %9s %9s %9s\n", "case", "bpm", "SDNN", "RMSSD", "pNN50", "RR");
+  for (const Case &c : makeCases()) {
+    BeatRate rate;
+    BeatVariability hrv;
+    for (uint32_t t : c.beatsUs) {
+      rate.addBeat(t);
+      hrv.addBeat(t);
+    }
+
+    int bpm = rate.getBPM(), sdnn = hrv.getSDNN(), rmssd = hrv.getRMSSD(), pnn50 = hrv.getPNN50();
+    int intervals = hrv.getIntervalCount();
+    // 1 ms / 1 bpm of rounding either way
+    bool ok = abs(bpm - c.expect.bpm) <= 1 && abs(sdnn - c.expect.sdnn) <= 1 && abs(rmssd - c.expect.rmssd) <= 1 &&
+              pnn50 == c.expect.pnn50 && intervals == c.expect.intervals;
+    if (!ok) failed++;
+
+    printf("%-18s %4d/%-4d %4d/%-4d %4d/%-4d %4d/%-4d %4d/%-4d %s\n", c.name, bpm, c.expect.bpm, sdnn, c.expect.sdnn,
+           rmssd, c.expect.rmssd, pnn50, c.expect.pnn50, intervals, c.expect.intervals, ok ? "ok" : "FAIL");
+  }
+
+  printf("%d of %d cases failed (got/expected)\n", failed, (int)makeCases().size());
+  return (failed ? 1 : 0);
+}
+
+#endif // PLATFORM_ID
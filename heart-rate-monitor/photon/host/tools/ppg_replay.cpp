@@ -0,0 +1,602 @@
+// PPG trace replay
+//
+// Runs recorded red/IR traces through the algorithms the firmware uses, on every
+// core, and reports what they made of them:
+//
+//   - maxim_heart_rate_and_oxygen_saturation() through maxim_spo2_stream, sliding the
+//     window exactly like the device does (same window, same hop, real sample times)
+//   - checkForBeat(), turned into a beat to beat rate by BeatRate like the firmware does
+//
+// Per window HR/SpO2 can be written out as CSV; the summary gives validity rates,
+// agreement with reference values when the trace has them, and samples/second.
+//
+//   g++ -std=gnu++17 -O2 -pthread -Ihost -I. host/tools/ppg_replay.cpp spo2_algorithm.cpp spo2_kernels.cpp heartRate.cpp -o ppg_replay
+//   g++ ... -DHR_ENGINE=HR_ENGINE_SPECTRAL ...   to replay with the FFT heart rate engine
+//
+//   ppg_replay [options] trace|directory...
+//     -j N            worker threads (default: all cores)
+//     -v              one summary line per trace
+//     --rate HZ       sample rate of traces without a time column (default 25)
+//     --window N      samples per analysis window (default BUFFER_SIZE)
+//     --hop N         new samples between results (default 20, one FIFO drain)
+//     --no-sqi-gate   analyse every window, the firmware skips those failing the quality check
+//     --hr-tol BPM    agreement tolerance for heart rate (default 5)
+//     --spo2-tol PCT  agreement tolerance for SpO2 (default 2)
+//     --windows FILE  per window results as CSV, "-" for stdout
+//     --convert DIR   write every trace to DIR in the binary format and exit
+//
+// Directories are searched recursively for *.csv and *.ppg files.
+//
+// CSV traces: one sample per line, '#' lines are comments. An optional header names
+// the columns: red, ir, time_us (or t_us), ref_hr, ref_spo2; anything else is ignored.
+// Without a header the columns are red,ir. Empty reference cells mean no reference.
+//
+// Binary traces (*.ppg), little endian:
+//
+//   char     magic[4]       "PPGT"
+//   uint8_t  version        1
+//   uint8_t  flags          bit 0: sample times, bit 1: reference values
+//   uint16_t reserved
+//   uint32_t sample period  microseconds
+//   uint32_t sample count
+//   then per sample:
+//     uint8_t red[3], ir[3]     18 bit counts as the FIFO delivers them
+//     varint  time delta        bit 0 only, microseconds since the previous sample (LEB128)
+//     uint8_t ref_hr, ref_spo2  bit 1 only, 0 = no reference
+//
+// About 6 bytes per sample against 20 or more as text, and no parsing.
+
+#ifndef PLATFORM_ID
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "heartRate.h"
+#include "spo2_algorithm.h"
+#include "spo2_kernels.h"
+
+namespace fs = std::filesystem;
+
+static const uint8_t TRACE_VERSION = 1;
+static const uint8_t TRACE_TIMES = 0x01;
+static const uint8_t TRACE_REFS = 0x02;
+static const uint32_t TRACE_MAX_COUNT = 0x3FFFF; // 18 bit ADC
+
+struct Options {
+  int threads = 0;
+  bool verbose = false;
+  double rateHz = 25.0;
+  int32_t window = BUFFER_SIZE;
+  int32_t hop = 20;
+  bool sqiGate = true;
+  int32_t hrTolerance = 5;
+  int32_t spo2Tolerance = 2;
+  const char *windowsPath = NULL;
+  const char *convertDir = NULL;
+};
+
+struct Trace {
+  uint32_t periodUs = 0;
+  bool hasTimes = false;
+  bool hasRefs = false;
+  std::vector<uint32_t> red;
+  std::vector<uint32_t> ir;
+  std::vector<uint32_t> timeUs;
+  std::vector<uint8_t> refHr;
+  std::vector<uint8_t> refSpo2;
+};
+
+struct WindowResult {
+  int32_t endSample;
+  uint32_t endUs;
+  int32_t hr;
+  int8_t hrValid;
+  int32_t spo2;
+  int8_t spo2Valid;
+  int32_t beatBpm; // 0 until BeatRate has enough intervals
+  int32_t sqi; // maxim_sqi score of the window
+  uint8_t refHr;
+  uint8_t refSpo2;
+};
+
+struct TraceResult {
+  std::string error;
+  size_t samples = 0;
+  double seconds = 0; // recording length
+  double algorithmNs = 0; // CPU time spent in the two algorithms
+  std::vector<WindowResult> windows;
+};
+
+//
+// Loading
+//
+
+static bool readFile(const std::string &path, std::vector<uint8_t> &data) {
+  FILE *f = fopen(path.c_str(), "rb");
+  if (f == NULL) return (false);
+  uint8_t chunk[65536];
+  size_t n;
+  while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0) data.insert(data.end(), chunk, chunk + n);
+  bool ok = !ferror(f);
+  fclose(f);
+  return (ok);
+}
+
+static uint32_t get32(const uint8_t *p) {
+  return ((uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24));
+}
+
+static bool parseBinary(const std::vector<uint8_t> &data, Trace &trace, std::string &error) {
+  if (data.size() < 16 || data[4] != TRACE_VERSION) {
+    error = "unsupported binary trace";
+    return (false);
+  }
+  uint8_t flags = data[5];
+  trace.periodUs = get32(&data[8]);
+  uint32_t count = get32(&data[12]);
+  trace.hasTimes = (flags & TRACE_TIMES) != 0;
+  trace.hasRefs = (flags & TRACE_REFS) != 0;
+
+  trace.red.reserve(count);
+  trace.ir.reserve(count);
+  size_t pos = 16;
+  uint32_t time = 0;
+  for (uint32_t k = 0; k < count; k++) {
+    if (pos + 6 > data.size()) break;
+    trace.red.push_back(data[pos] | (data[pos + 1] << 8) | ((uint32_t)data[pos + 2] << 16));
+    trace.ir.push_back(data[pos + 3] | (data[pos + 4] << 8) | ((uint32_t)data[pos + 5] << 16));
+    pos += 6;
+    if (trace.hasTimes) {
+      uint32_t delta = 0;
+      int shift = 0;
+      while (pos < data.size() && shift < 32) {
+        uint8_t b = data[pos++];
+        delta |= (uint32_t)(b & 0x7F) << shift;
+        shift += 7;
+        if (!(b & 0x80)) break;
+      }
+      time += delta;
+      trace.timeUs.push_back(time);
+    }
+    if (trace.hasRefs) {
+      if (pos + 2 > data.size()) break;
+      trace.refHr.push_back(data[pos]);
+      trace.refSpo2.push_back(data[pos + 1]);
+      pos += 2;
+    }
+  }
+  if (trace.red.size() != count || (trace.hasTimes && trace.timeUs.size() != count) ||
+      (trace.hasRefs && trace.refSpo2.size() != count)) {
+    error = "truncated binary trace";
+    return (false);
+  }
+  return (true);
+}
+
+enum Column { COL_RED, COL_IR, COL_TIME, COL_REF_HR, COL_REF_SPO2, COL_COUNT };
+
+// Splits one CSV line in place, empty cells come back as empty strings
+static int splitLine(char *line, char **cells, int maxCells) {
+  int n = 0;
+  char *p = line;
+  while (n < maxCells) {
+    while (*p == ' ' || *p == '\t') p++;
+    cells[n++] = p;
+    char *comma = strchr(p, ',');
+    if (comma == NULL) break;
+    *comma = 0;
+    p = comma + 1;
+  }
+  for (int k = 0; k < n; k++) {
+    char *end = cells[k] + strlen(cells[k]);
+    while (end > cells[k] && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r' || end[-1] == '\n')) *--end = 0;
+  }
+  return (n);
+}
+
+static bool parseCSV(std::vector<uint8_t> &data, const Options &opt, Trace &trace, std::string &error) {
+  int column[COL_COUNT] = {0, 1, -1, -1, -1};
+  bool sawHeader = false;
+  data.push_back(0);
+
+  char *line = (char *)data.data();
+  char *end = line + data.size() - 1;
+  int lineNo = 0;
+  while (line != NULL && line < end) {
+    char *next = strchr(line, '\n');
+    if (next != NULL) *next++ = 0;
+    lineNo++;
+
+    char *cells[16];
+    int n = splitLine(line, cells, 16);
+    if (n == 0 || cells[0][0] == '#' || (n == 1 && cells[0][0] == 0)) {
+      line = next;
+      continue;
+    }
+
+    if (!sawHeader && trace.red.empty() && !isdigit((unsigned char)cells[0][0])) {
+      static const char *names[COL_COUNT] = {"red", "ir", "time_us", "ref_hr", "ref_spo2"};
+      for (int c = 0; c < COL_COUNT; c++) column[c] = -1;
+      for (int k = 0; k < n; k++) {
+        for (int c = 0; c < COL_COUNT; c++)
+          if (strcmp(cells[k], names[c]) == 0) column[c] = k;
+        if (strcmp(cells[k], "t_us") == 0) column[COL_TIME] = k;
+      }
+      if (column[COL_RED] < 0 || column[COL_IR] < 0) {
+        error = "header has no red and ir columns";
+        return (false);
+      }
+      sawHeader = true;
+      trace.hasTimes = column[COL_TIME] >= 0;
+      trace.hasRefs = column[COL_REF_HR] >= 0 || column[COL_REF_SPO2] >= 0;
+      line = next;
+      continue;
+    }
+
+    if (n <= column[COL_RED] || n <= column[COL_IR] || !*cells[column[COL_RED]] || !*cells[column[COL_IR]]) {
+      error = "line " + std::to_string(lineNo) + ": missing red or ir";
+      return (false);
+    }
+    trace.red.push_back((uint32_t)strtoul(cells[column[COL_RED]], NULL, 10));
+    trace.ir.push_back((uint32_t)strtoul(cells[column[COL_IR]], NULL, 10));
+    if (trace.hasTimes) {
+      if (n <= column[COL_TIME] || !*cells[column[COL_TIME]]) {
+        error = "line " + std::to_string(lineNo) + ": missing time";
+        return (false);
+      }
+      trace.timeUs.push_back((uint32_t)strtoul(cells[column[COL_TIME]], NULL, 10));
+    }
+    if (trace.hasRefs) {
+      int hr = column[COL_REF_HR] >= 0 && n > column[COL_REF_HR] ? atoi(cells[column[COL_REF_HR]]) : 0;
+      int spo2 = column[COL_REF_SPO2] >= 0 && n > column[COL_REF_SPO2] ? atoi(cells[column[COL_REF_SPO2]]) : 0;
+      trace.refHr.push_back((uint8_t)std::min(std::max(hr, 0), 255));
+      trace.refSpo2.push_back((uint8_t)std::min(std::max(spo2, 0), 100));
+    }
+    line = next;
+  }
+
+  // Times are kept relative to the first sample, the period from their average spacing
+  if (trace.hasTimes && !trace.timeUs.empty()) {
+    uint32_t first = trace.timeUs[0];
+    for (uint32_t &t : trace.timeUs) t -= first;
+  }
+  if (trace.hasTimes && trace.timeUs.size() > 1)
+    trace.periodUs = (uint32_t)((trace.timeUs.back() + (trace.timeUs.size() - 1) / 2) / (trace.timeUs.size() - 1));
+  else
+    trace.periodUs = (uint32_t)(1e6 / opt.rateHz + 0.5);
+  return (true);
+}
+
+static bool loadTrace(const std::string &path, const Options &opt, Trace &trace, std::string &error) {
+  std::vector<uint8_t> data;
+  if (!readFile(path, data)) {
+    error = "can't read";
+    return (false);
+  }
+  bool ok = data.size() >= 4 && memcmp(data.data(), "PPGT", 4) == 0 ? parseBinary(data, trace, error)
+                                                                     : parseCSV(data, opt, trace, error);
+  if (ok && trace.red.empty()) {
+    error = "no samples";
+    ok = false;
+  }
+  if (ok && trace.periodUs == 0) {
+    error = "zero sample period";
+    ok = false;
+  }
+  return (ok);
+}
+
+static bool writeBinary(const std::string &path, const Trace &trace, std::string &error) {
+  std::vector<uint8_t> out;
+  out.reserve(16 + trace.red.size() * 10);
+  const uint8_t flags = (trace.hasTimes ? TRACE_TIMES : 0) | (trace.hasRefs ? TRACE_REFS : 0);
+  const uint8_t header[8] = {'P', 'P', 'G', 'T', TRACE_VERSION, flags, 0, 0};
+  out.insert(out.end(), header, header + 8);
+  uint32_t words[2] = {trace.periodUs, (uint32_t)trace.red.size()};
+  for (uint32_t w : words)
+    for (int b = 0; b < 4; b++) out.push_back((uint8_t)(w >> (8 * b)));
+
+  uint32_t previous = 0;
+  for (size_t k = 0; k < trace.red.size(); k++) {
+    if (trace.red[k] > TRACE_MAX_COUNT || trace.ir[k] > TRACE_MAX_COUNT) {
+      error = "sample " + std::to_string(k) + " is wider than 18 bits";
+      return (false);
+    }
+    for (uint32_t v : {trace.red[k], trace.ir[k]})
+      for (int b = 0; b < 3; b++) out.push_back((uint8_t)(v >> (8 * b)));
+    if (trace.hasTimes) {
+      uint32_t delta = trace.timeUs[k] - previous;
+      previous = trace.timeUs[k];
+      do {
+        uint8_t b = delta & 0x7F;
+        delta >>= 7;
+        out.push_back(delta ? (b | 0x80) : b);
+      } while (delta);
+    }
+    if (trace.hasRefs) {
+      out.push_back(trace.refHr[k]);
+      out.push_back(trace.refSpo2[k]);
+    }
+  }
+
+  FILE *f = fopen(path.c_str(), "wb");
+  bool ok = f != NULL && fwrite(out.data(), 1, out.size(), f) == out.size();
+  if (f != NULL && fclose(f) != 0) ok = false;
+  if (!ok) error = "can't write " + path;
+  return (ok);
+}
+
+//
+// Replay
+//
+
+static uint32_t sampleTime(const Trace &trace, size_t k) {
+  return (trace.hasTimes ? trace.timeUs[k] : (uint32_t)(k * trace.periodUs));
+}
+
+// CPU time of the calling thread, unlike wall time it doesn't grow when threads outnumber cores
+static double threadNs(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return (ts.tv_sec * 1e9 + ts.tv_nsec);
+}
+
+static TraceResult replay(const std::string &path, const Options &opt) {
+  TraceResult result;
+  Trace trace;
+  if (!loadTrace(path, opt, trace, result.error)) return (result);
+  const size_t n = trace.red.size();
+  result.samples = n;
+  result.seconds = (double)(sampleTime(trace, n - 1) + trace.periodUs) / 1e6;
+
+  double t0 = threadNs();
+
+  // Beat detector first, its sample indices are matched to the windows below. Beat times
+  // go back to the zero crossing between samples like the firmware's.
+  std::vector<std::pair<size_t, uint32_t>> beats;
+  BeatDetector<> detector;
+  for (size_t k = 0; k < n; k++)
+    if (detector.checkForBeat((int32_t)trace.ir[k]))
+      beats.push_back({k, sampleTime(trace, k) - ((uint32_t)detector.getBeatLag() * trace.periodUs >> 15)});
+
+  maxim_spo2_stream stream;
+  maxim_spo2_stream_init(&stream, std::min(opt.window, (int32_t)BUFFER_SIZE), opt.hop, (int32_t)trace.periodUs,
+                         trace.hasTimes ? 1 : 0);
+  maxim_spo2_stream_set_sqi_gate(&stream, opt.sqiGate ? 1 : 0);
+
+  BeatRate beatRate;
+  size_t nextBeat = 0;
+
+  for (size_t k = 0; k < n; k++) {
+    uint32_t time = sampleTime(trace, k);
+
+    if (nextBeat < beats.size() && beats[nextBeat].first == k) {
+      beatRate.addBeat(beats[nextBeat].second);
+      nextBeat++;
+    }
+
+    if (!maxim_spo2_stream_add(&stream, trace.ir[k], trace.red[k], time)) continue;
+
+    WindowResult w;
+    w.endSample = (int32_t)k;
+    w.endUs = time;
+    maxim_spo2_stream_result(&stream, &w.spo2, &w.spo2Valid, &w.hr, &w.hrValid);
+    w.sqi = stream.sqi.n_score;
+    w.beatBpm = beatRate.getBPM();
+    w.refHr = trace.hasRefs ? trace.refHr[k] : 0;
+    w.refSpo2 = trace.hasRefs ? trace.refSpo2[k] : 0;
+    result.windows.push_back(w);
+  }
+
+  result.algorithmNs = threadNs() - t0;
+  return (result);
+}
+
+//
+// Reporting
+//
+
+struct Agreement {
+  long references = 0; // windows with a reference value
+  long valid = 0; // of those, how many the algorithm gave a valid value for
+  long within = 0;
+  double absError = 0;
+  double signedError = 0;
+
+  void add(bool hasRef, bool isValid, int32_t value, int32_t ref, int32_t tolerance) {
+    if (!hasRef) return;
+    references++;
+    if (!isValid) return;
+    valid++;
+    int32_t error = value - ref;
+    absError += abs(error);
+    signedError += error;
+    if (abs(error) <= tolerance) within++;
+  }
+
+  void print(FILE *f, const char *name, const char *unit) const {
+    if (references == 0) return;
+    fprintf(f, "  %-10s %6.1f%% valid, %6.1f%% within tolerance, MAE %.2f %s, bias %+.2f %s\n", name,
+           100.0 * valid / references, 100.0 * within / references, valid ? absError / valid : 0.0, unit,
+           valid ? signedError / valid : 0.0, unit);
+  }
+};
+
+struct Totals {
+  long windows = 0;
+  long hrValid = 0;
+  long spo2Valid = 0;
+  long sqiOk = 0;
+  Agreement hr;
+  Agreement beat;
+  Agreement spo2;
+
+  void add(const TraceResult &r, const Options &opt) {
+    for (const WindowResult &w : r.windows) {
+      windows++;
+      hrValid += w.hrValid == 1;
+      spo2Valid += w.spo2Valid == 1;
+      sqiOk += w.sqi >= SQI_PASS;
+      hr.add(w.refHr != 0, w.hrValid == 1, w.hr, w.refHr, opt.hrTolerance);
+      beat.add(w.refHr != 0, w.beatBpm != 0, w.beatBpm, w.refHr, opt.hrTolerance);
+      spo2.add(w.refSpo2 != 0, w.spo2Valid == 1, w.spo2, w.refSpo2, opt.spo2Tolerance);
+    }
+  }
+};
+
+static void writeWindows(FILE *f, const std::vector<std::string> &paths, const std::vector<TraceResult> &results) {
+  fprintf(f, "trace,end_sample,end_us,hr,hr_valid,spo2,spo2_valid,beat_bpm,sqi,ref_hr,ref_spo2\n");
+  for (size_t t = 0; t < results.size(); t++)
+    for (const WindowResult &w : results[t].windows)
+      fprintf(f, "%s,%d,%u,%d,%d,%d,%d,%d,%d,%d,%d\n", paths[t].c_str(), (int)w.endSample, (unsigned)w.endUs,
+              (int)w.hr, (int)w.hrValid, (int)w.spo2, (int)w.spo2Valid, (int)w.beatBpm, (int)w.sqi, (int)w.refHr,
+              (int)w.refSpo2);
+}
+
+//
+// Command line
+//
+
+static void usage(void) {
+  fprintf(stderr,
+          "usage: ppg_replay [-j N] [-v] [--rate HZ] [--window N] [--hop N] [--no-sqi-gate]\n"
+          "                  [--hr-tol BPM] [--spo2-tol PCT] [--windows FILE] [--convert DIR] trace|directory...\n");
+  exit(2);
+}
+
+static void addPath(const std::string &arg, std::vector<std::string> &paths) {
+  std::error_code ec;
+  if (!fs::is_directory(arg, ec)) {
+    paths.push_back(arg);
+    return;
+  }
+  std::vector<std::string> found;
+  for (const fs::directory_entry &e : fs::recursive_directory_iterator(arg, ec)) {
+    std::string ext = e.path().extension().string();
+    if (e.is_regular_file() && (ext == ".csv" || ext == ".ppg")) found.push_back(e.path().string());
+  }
+  std::sort(found.begin(), found.end());
+  paths.insert(paths.end(), found.begin(), found.end());
+}
+
+static int convert(const std::vector<std::string> &paths, const Options &opt) {
+  int failed = 0;
+  for (const std::string &path : paths) {
+    Trace trace;
+    std::string error;
+    std::string out = (fs::path(opt.convertDir) / fs::path(path).filename().replace_extension(".ppg")).string();
+    if (!loadTrace(path, opt, trace, error) || !writeBinary(out, trace, error)) {
+      fprintf(stderr, "%s: %s\n", path.c_str(), error.c_str());
+      failed++;
+    }
+  }
+  return (failed ? 1 : 0);
+}
+
+int main(int argc, char **argv) {
+  Options opt;
+  std::vector<std::string> paths;
+
+  for (int i = 1; i < argc; i++) {
+    std::string a = argv[i];
+    bool hasValue = i + 1 < argc;
+    if (a == "-v") opt.verbose = true;
+    else if (a == "-j" && hasValue) opt.threads = atoi(argv[++i]);
+    else if (a.compare(0, 2, "-j") == 0 && a.size() > 2) opt.threads = atoi(a.c_str() + 2);
+    else if (a == "--rate" && hasValue) opt.rateHz = atof(argv[++i]);
+    else if (a == "--window" && hasValue) opt.window = atoi(argv[++i]);
+    else if (a == "--hop" && hasValue) opt.hop = atoi(argv[++i]);
+    else if (a == "--no-sqi-gate") opt.sqiGate = false;
+    else if (a == "--hr-tol" && hasValue) opt.hrTolerance = atoi(argv[++i]);
+    else if (a == "--spo2-tol" && hasValue) opt.spo2Tolerance = atoi(argv[++i]);
+    else if (a == "--windows" && hasValue) opt.windowsPath = argv[++i];
+    else if (a == "--convert" && hasValue) opt.convertDir = argv[++i];
+    else if (a.size() > 1 && a[0] == '-') usage();
+    else addPath(a, paths);
+  }
+  if (paths.empty() || opt.rateHz <= 0 || opt.window < 1 || opt.hop < 1) usage();
+  if (opt.window > BUFFER_SIZE) {
+    fprintf(stderr, "window capped at BUFFER_SIZE (%d)\n", BUFFER_SIZE);
+    opt.window = BUFFER_SIZE;
+  }
+
+  if (opt.convertDir != NULL) return (convert(paths, opt));
+
+  unsigned threads = opt.threads > 0 ? (unsigned)opt.threads : std::max(1u, std::thread::hardware_concurrency());
+  threads = std::min<unsigned>(threads, (unsigned)paths.size());
+
+  // Workers take the next trace until none are left, results land in input order
+  std::vector<TraceResult> results(paths.size());
+  std::atomic<size_t> nextTrace(0);
+  auto t0 = std::chrono::steady_clock::now();
+  std::vector<std::thread> pool;
+  for (unsigned t = 0; t < threads; t++)
+    pool.emplace_back([&]() {
+      for (size_t i; (i = nextTrace++) < paths.size();) results[i] = replay(paths[i], opt);
+    });
+  for (std::thread &t : pool) t.join();
+  double wallSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+
+  if (opt.windowsPath != NULL) {
+    FILE *f = strcmp(opt.windowsPath, "-") == 0 ? stdout : fopen(opt.windowsPath, "w");
+    if (f == NULL) {
+      fprintf(stderr, "can't write %s\n", opt.windowsPath);
+      return (1);
+    }
+    writeWindows(f, paths, results);
+    if (f != stdout) fclose(f);
+  }
+  // The summary goes to stderr when the windows take stdout
+  FILE *out = opt.windowsPath != NULL && strcmp(opt.windowsPath, "-") == 0 ? stderr : stdout;
+
+  Totals all;
+  size_t samples = 0, failed = 0;
+  double recorded = 0, algorithmNs = 0;
+  for (size_t t = 0; t < results.size(); t++) {
+    const TraceResult &r = results[t];
+    if (!r.error.empty()) {
+      fprintf(stderr, "%s: %s\n", paths[t].c_str(), r.error.c_str());
+      failed++;
+      continue;
+    }
+    all.add(r, opt);
+    samples += r.samples;
+    recorded += r.seconds;
+    algorithmNs += r.algorithmNs;
+    if (opt.verbose) {
+      Totals one;
+      one.add(r, opt);
+      long w = std::max(one.windows, 1L);
+      fprintf(out, "%s: %zu samples, %ld windows, HR valid %.0f%%, SpO2 valid %.0f%%\n", paths[t].c_str(), r.samples,
+              one.windows, 100.0 * one.hrValid / w, 100.0 * one.spo2Valid / w);
+    }
+  }
+
+  long w = std::max(all.windows, 1L);
+  fprintf(out, "%zu traces (%zu failed), %zu samples, %.1f h recorded, window %d, hop %d, %s kernels, %s HR engine\n",
+         results.size(), failed, samples, recorded / 3600.0, (int)opt.window, (int)opt.hop, maxim_kernels_name(),
+         maxim_hr_engine_name());
+  fprintf(out, "%ld windows: HR valid %.1f%%, SpO2 valid %.1f%%, signal quality passed %.1f%% (gate %s)\n", all.windows,
+          100.0 * all.hrValid / w, 100.0 * all.spo2Valid / w, 100.0 * all.sqiOk / w, opt.sqiGate ? "on" : "off");
+  if (all.hr.references || all.spo2.references) {
+    fprintf(out, "against reference (HR +/-%d bpm, SpO2 +/-%d%%):\n", (int)opt.hrTolerance, (int)opt.spo2Tolerance);
+    all.hr.print(out, "HR", "bpm");
+    all.beat.print(out, "beat HR", "bpm");
+    all.spo2.print(out, "SpO2", "%");
+  }
+  fprintf(out, "%u threads, %.3f s: %.3g samples/s, %.0fx real time; %.0f ns/sample on one core\n", threads, wallSeconds,
+         samples / wallSeconds, recorded / wallSeconds, samples ? algorithmNs / samples : 0.0);
+
+  return (failed ? 1 : 0);
+}
+
+#endif
@@ -59,40 +59,548 @@
 
 #include "Arduino.h"
 #include "spo2_algorithm.h"
+#include "spo2_kernels.h"
 
-#if defined(__AVR_ATmega328P__) || defined(__AVR_ATmega168__)
-//Arduino Uno doesn't have enough SRAM to store 100 samples of IR led data and red led data in 32-bit format
-//To solve this problem, 16-bit MSB of the sampled data will be truncated.  Samples become 16-bit data.
-void maxim_heart_rate_and_oxygen_saturation(uint16_t *pun_ir_buffer, int32_t n_ir_buffer_length, uint16_t *pun_red_buffer, int32_t *pn_spo2, int8_t *pch_spo2_valid, 
+constexpr maxim_spo2_cal_table maxim_spo2_default_cal(SPO2_CAL_A, SPO2_CAL_B, SPO2_CAL_C);
+
+int32_t maxim_spo2_from_ratio(const maxim_spo2_cal_table *p_cal, int32_t n_ratio_q8)
+/**
+* \brief        SpO2 for a ratio
+* \par          Details
+*               Linear interpolation between the two table entries around R, integers only.
+*
+* \param[in]    *p_cal                   - Calibration table
+* \param[in]    n_ratio_q8               - R*100 with SPO2_Q fractional bits, clamped to the table
+*
+* \retval       SpO2 in 1/256 %
+*/
+{
+  int32_t n_idx, n_frac, n_low;
+
+  if (n_ratio_q8 < 0) n_ratio_q8 = 0;
+  if (n_ratio_q8 > ((SPO2_TABLE_SIZE - 1) << SPO2_Q)) n_ratio_q8 = (SPO2_TABLE_SIZE - 1) << SPO2_Q;
+  n_idx = n_ratio_q8 >> SPO2_Q;
+  n_frac = n_ratio_q8 & ((1 << SPO2_Q) - 1);
+  n_low = p_cal->aun_spo2_q8[n_idx];
+  if (n_frac == 0) return n_low;
+  return n_low + ((p_cal->aun_spo2_q8[n_idx + 1] - n_low) * n_frac) / (1 << SPO2_Q);
+}
+
+// Circular buffer indexed in time order, k = 0 is the sample at n_head. Stands in for a plain
+// pointer in the templates below, so a wrapped buffer is read where it lies.
+template <typename T>
+struct maxim_ring_view
+{
+  const T *p_buffer;
+  int32_t n_size;
+  int32_t n_head;
+
+  T operator[](int32_t k) const
+  {
+    k += n_head;
+    if (k >= n_size) k -= n_size;
+    return p_buffer[k];
+  }
+  explicit operator bool() const { return p_buffer != NULL; }
+};
+
+template <typename T>
+static maxim_ring_view<T> maxim_ring(const T *p_buffer, int32_t n_size, int32_t n_head)
+{
+  maxim_ring_view<T> view = { p_buffer, n_size, n_head };
+  return view;
+}
+
+// Ring of packed 24 bit values in time order, read in place like maxim_ring_view
+struct maxim_pack24_view
+{
+  const uint8_t *puch_buffer;
+  int32_t n_size;
+  int32_t n_head;
+
+  uint32_t operator[](int32_t k) const
+  {
+    k += n_head;
+    if (k >= n_size) k -= n_size;
+    return maxim_pack24_get(puch_buffer, k);
+  }
+  explicit operator bool() const { return puch_buffer != NULL; }
+};
+
+static maxim_pack24_view maxim_pack24_ring(const uint8_t *puch_buffer, int32_t n_size, int32_t n_head)
+{
+  maxim_pack24_view view = { puch_buffer, n_size, n_head };
+  return view;
+}
+
+// Sample times kept as their low 24 bits, rebuilt by counting back from the full time of the
+// newest sample. Exact while the window spans less than 2^24 us.
+struct maxim_time24_view
+{
+  maxim_pack24_view times;
+  uint32_t un_newest;
+
+  uint32_t operator[](int32_t k) const
+  {
+    return un_newest - (((un_newest & MAXIM_PACK24_MAX) - times[k]) & MAXIM_PACK24_MAX);
+  }
+  explicit operator bool() const { return (bool)times; }
+};
+
+// Largest of x[n_begin .. n_end-1] if it beats *pn_max, the first of equal values, like
+// maxim_kernel_max(). Plain 32 bit buffers go through the kernel, views are scanned in place.
+template <typename S>
+static void maxim_max_scan(S x, int32_t n_begin, int32_t n_end, int32_t *pn_max, int32_t *pn_max_idx)
+{
+  // the largest value first without a branch per sample, then the first sample holding it
+  int32_t n_best = *pn_max;
+  int32_t k;
+  for (k=n_begin ; k<n_end ; k++) n_best = ((int32_t)x[k] > n_best) ? (int32_t)x[k] : n_best;
+  if (n_best == *pn_max) return;
+
+  for (k=n_begin ; (int32_t)x[k] != n_best ; k++) ;
+  *pn_max = n_best;
+  *pn_max_idx = k;
+}
+
+template <typename T>
+static void maxim_max(const T *pun_x, int32_t n_begin, int32_t n_end, int32_t *pn_max, int32_t *pn_max_idx)
+{
+  maxim_max_scan(pun_x, n_begin, n_end, pn_max, pn_max_idx);
+}
+
+static void maxim_max(const uint32_t *pun_x, int32_t n_begin, int32_t n_end, int32_t *pn_max, int32_t *pn_max_idx)
+{
+  maxim_kernel_max((const int32_t *)pun_x, n_begin, n_end, pn_max, pn_max_idx); // 18 bit samples, same signed
+}
+
+template <typename T>
+static void maxim_max(maxim_ring_view<T> x, int32_t n_begin, int32_t n_end, int32_t *pn_max, int32_t *pn_max_idx)
+{
+  maxim_max_scan(x, n_begin, n_end, pn_max, pn_max_idx);
+}
+
+static void maxim_max(maxim_pack24_view x, int32_t n_begin, int32_t n_end, int32_t *pn_max, int32_t *pn_max_idx)
+{
+  // as maxim_max_scan(), in straight runs either side of the wrap, k stays in time order
+  int32_t n_wrap = x.n_size - x.n_head;
+  int32_t n_split = (n_end < n_wrap) ? n_end : (n_begin > n_wrap ? n_begin : n_wrap);
+  int32_t n_best = *pn_max;
+  int32_t k, n_value;
+
+  for (k=n_begin ; k<n_split ; k++){
+    n_value = (int32_t)maxim_pack24_get(x.puch_buffer, x.n_head + k);
+    n_best = (n_value > n_best) ? n_value : n_best;
+  }
+  for ( ; k<n_end ; k++){
+    n_value = (int32_t)maxim_pack24_get(x.puch_buffer, k - n_wrap);
+    n_best = (n_value > n_best) ? n_value : n_best;
+  }
+  if (n_best == *pn_max) return;
+
+  for (k=n_begin ; (int32_t)x[k] != n_best ; k++) ;
+  *pn_max = n_best;
+  *pn_max_idx = k;
+}
+
+// The 32 bit buffers go through the vector kernels, others (16 bit on AVR) stay scalar
+template <typename T>
+static uint32_t maxim_sum(const T *pun_x, int32_t n_size)
+{
+  uint32_t un_sum = 0;
+  int32_t k;
+  for (k=0 ; k<n_size ; k++) un_sum += pun_x[k];
+  return un_sum;
+}
+
+static uint32_t maxim_sum(const uint32_t *pun_x, int32_t n_size)
+{
+  return maxim_kernel_sum(pun_x, n_size);
+}
+
+template <typename T>
+static uint32_t maxim_sum(maxim_ring_view<T> x, int32_t n_size)
+{
+  int32_t n_first = x.n_size - x.n_head;
+  if (n_first > n_size) n_first = n_size;
+  return maxim_sum(x.p_buffer + x.n_head, n_first) + maxim_sum(x.p_buffer, n_size - n_first);
+}
+
+template <typename T>
+static void maxim_remove_dc(int32_t *pn_dst, const T *pun_src, int32_t n_size, uint32_t un_mean)
+{
+  int32_t k;
+  for (k=0 ; k<n_size ; k++) pn_dst[k] = -1*(pun_src[k] - un_mean);
+}
+
+static void maxim_remove_dc(int32_t *pn_dst, const uint32_t *pun_src, int32_t n_size, uint32_t un_mean)
+{
+  maxim_kernel_remove_dc(pn_dst, pun_src, n_size, un_mean);
+}
+
+template <typename T>
+static void maxim_remove_dc(int32_t *pn_dst, maxim_ring_view<T> src, int32_t n_size, uint32_t un_mean)
+{
+  int32_t n_first = src.n_size - src.n_head;
+  if (n_first > n_size) n_first = n_size;
+  maxim_remove_dc(pn_dst, src.p_buffer + src.n_head, n_first, un_mean);
+  maxim_remove_dc(pn_dst + n_first, src.p_buffer, n_size - n_first, un_mean);
+}
+
+// Heart rate engines
+
+static int32_t maxim_min_distance(int32_t n_sample_period_us)
+{
+  // peaks closer than 160 ms (4 samples at 25 Hz) are the same beat
+  int32_t n_min_distance = PEAK_MIN_DISTANCE_US / n_sample_period_us;
+  if (n_min_distance < 1) n_min_distance = 1;
+  return n_min_distance;
+}
+
+static int32_t maxim_valley_threshold(int32_t *pn_x, int32_t n_size)
+{
+  int32_t n_th1;
+
+  // calculate threshold  
+  n_th1= (int32_t)maxim_kernel_sum((const uint32_t *)pn_x, n_size);
+  n_th1=  n_th1/ ( n_size);
+  if( n_th1<30) n_th1=30; // min allowed
+  if( n_th1>60) n_th1=60; // max allowed
+  return n_th1;
+}
+
+template <typename U>
+static void maxim_hr_from_valleys(const int32_t *pn_locs, int32_t n_npks, int32_t n_sample_period_us, U pun_sample_times,
                 int32_t *pn_heart_rate, int8_t *pch_hr_valid)
+{
+  int32_t k, n_peak_interval_sum;
+  uint32_t un_peak_time_sum;
+
+  n_peak_interval_sum =0;
+  if (n_npks>=2){
+    for (k=1; k<n_npks; k++) n_peak_interval_sum += (pn_locs[k] -pn_locs[k -1] ) ;
+    // time between the first and last valley, summed per beat so unsigned wrap of micros() is harmless
+    un_peak_time_sum =0;
+    if (pun_sample_times){
+      for (k=1; k<n_npks; k++){
+        int32_t n_beat_us = (int32_t)(pun_sample_times[pn_locs[k]] - pun_sample_times[pn_locs[k -1]]);
+        if (n_beat_us <= 0){ un_peak_time_sum =0; break; } // times out of order, count samples instead
+        un_peak_time_sum += n_beat_us;
+      }
+    }
+    if (un_peak_time_sum > 0)
+      *pn_heart_rate =(int32_t)( (60000000ULL*(n_npks-1))/ un_peak_time_sum ); // beats per minute from real sample times
+    else {
+      n_peak_interval_sum =n_peak_interval_sum/(n_npks-1);
+      *pn_heart_rate =(int32_t)( 60000000/ (n_peak_interval_sum*n_sample_period_us) ); // (FreqS*60)/interval at the nominal rate
+    }
+    *pch_hr_valid  = 1;
+  }
+  else  { 
+    *pn_heart_rate = -999; // unable to calculate because # of peaks are too small
+    *pch_hr_valid  = 0;
+  }
+}
+
+const char *maxim_hr_engine_name(void)
+{
+#if HR_ENGINE == HR_ENGINE_SPECTRAL
+  return "spectral";
 #else
-void maxim_heart_rate_and_oxygen_saturation(uint32_t *pun_ir_buffer, int32_t n_ir_buffer_length, uint32_t *pun_red_buffer, int32_t *pn_spo2, int8_t *pch_spo2_valid, 
-                int32_t *pn_heart_rate, int8_t *pch_hr_valid)
+  return "peaks";
 #endif
+}
+
+void maxim_hr_peaks(int32_t *pn_x, int32_t n_size, int32_t n_sample_period_us, int32_t *pn_heart_rate, int8_t *pch_hr_valid)
 /**
-* \brief        Calculate the heart rate and SpO2 level
+* \brief        Heart rate from the valley intervals
 * \par          Details
-*               By detecting  peaks of PPG cycle and corresponding AC/DC of red/infra-red signal, the an_ratio for the SPO2 is computed.
-*               Since this algorithm is aiming for Arm M0/M3. formaula for SPO2 did not achieve the accuracy due to register overflow.
-*               Thus, accurate SPO2 is precalculated and save longo uch_spo2_table[] per each an_ratio.
+*               What maxim_heart_rate_and_oxygen_saturation() reports with HR_ENGINE_PEAKS and no sample times.
 *
-* \param[in]    *pun_ir_buffer           - IR sensor data buffer
-* \param[in]    n_ir_buffer_length      - IR sensor data buffer length
-* \param[in]    *pun_red_buffer          - Red sensor data buffer
-* \param[out]    *pn_spo2                - Calculated SpO2 value
-* \param[out]    *pch_spo2_valid         - 1 if the calculated SpO2 value is valid
-* \param[out]    *pn_heart_rate          - Calculated heart rate value
-* \param[out]    *pch_hr_valid           - 1 if the calculated heart rate value is valid
+* \param[in]    *pn_x                    - DC removed, inverted, 4 pt averaged IR
+* \param[in]    n_size                   - Number of samples
+* \param[in]    n_sample_period_us       - Time between samples
+* \param[out]   *pn_heart_rate           - Beats per minute, -999 when not valid
+* \param[out]   *pch_hr_valid            - 1 if the heart rate is valid
+*
+* \retval       None
+*/
+{
+  int32_t an_locs[MAX_NUM_PEAKS];
+  int32_t n_npks;
+
+  if (n_sample_period_us <= 0) n_sample_period_us = 1000000 / FreqS;
+  maxim_find_peaks(an_locs, &n_npks, pn_x, n_size, maxim_valley_threshold(pn_x, n_size), maxim_min_distance(n_sample_period_us), MAX_NUM_PEAKS);
+  maxim_hr_from_valleys(an_locs, n_npks, n_sample_period_us, (const uint32_t *)NULL, pn_heart_rate, pch_hr_valid);
+}
+
+static_assert(HR_FFT_SIZE >= 16 && (HR_FFT_SIZE & (HR_FFT_SIZE - 1)) == 0, "HR_FFT_SIZE must be a power of 2");
+
+// sin(x) for x in -pi/2..3pi/2, evaluated by the compiler for the twiddle table
+constexpr double maxim_sin(double x)
+{
+  double d_term = 0, d_sum = 0;
+  int32_t k = 1;
+
+  if (x > 1.57079632679489662) x = 3.14159265358979324 - x;
+  d_term = x;
+  d_sum = x;
+  for (; k<12; k++){
+    d_term *= -x*x/((2*k)*(2*k + 1));
+    d_sum += d_term;
+  }
+  return d_sum;
+}
+
+constexpr int16_t maxim_q15(double x)
+{
+  return (int16_t)(x*32767 + (x < 0 ? -0.5 : 0.5));
+}
+
+// e^(-2 pi i k/HR_FFT_SIZE) = cos - i sin in Q15, for the first half turn; flash data
+struct maxim_fft_twiddles
+{
+  int16_t aw_cos[HR_FFT_SIZE/2];
+  int16_t aw_sin[HR_FFT_SIZE/2];
+
+  constexpr maxim_fft_twiddles() : aw_cos(), aw_sin()
+  {
+    for (int32_t k = 0; k < HR_FFT_SIZE/2; k++){
+      aw_sin[k] = maxim_q15(maxim_sin(6.28318530717958648*k/HR_FFT_SIZE));
+      aw_cos[k] = maxim_q15(maxim_sin(6.28318530717958648*k/HR_FFT_SIZE + 1.57079632679489662));
+    }
+  }
+};
+
+static constexpr maxim_fft_twiddles maxim_fft_twiddle;
+
+static void maxim_fft(int16_t *pw_re, int16_t *pw_im, int32_t n_size)
+/**
+* \brief        In place radix-2 complex FFT
+* \par          Details
+*               Decimation in time, every stage halves its output so nothing overflows as long as no input
+*               has a magnitude above 2^14. The result is the transform divided by n_size.
+*
+* \param[in,out] *pw_re, *pw_im          - Real and imaginary parts, n_size entries each
+* \param[in]    n_size                   - Power of 2, at most HR_FFT_SIZE
+*
+* \retval       None
+*/
+{
+  int32_t i, j, k, n_bit, n_len, n_half, n_step, n_a, n_b, n_tr, n_ti;
+  int16_t w_tmp;
+
+  for (i=1, j=0; i<n_size; i++){
+    for (n_bit = n_size >> 1; j & n_bit; n_bit >>= 1) j ^= n_bit;
+    j ^= n_bit;
+    if (i < j){
+      w_tmp = pw_re[i]; pw_re[i] = pw_re[j]; pw_re[j] = w_tmp;
+      w_tmp = pw_im[i]; pw_im[i] = pw_im[j]; pw_im[j] = w_tmp;
+    }
+  }
+  for (n_len=2; n_len<=n_size; n_len <<= 1){
+    n_half = n_len >> 1;
+    n_step = HR_FFT_SIZE / n_len;
+    for (k=0; k<n_half; k++){
+      int32_t n_wr = maxim_fft_twiddle.aw_cos[k*n_step];
+      int32_t n_wi = maxim_fft_twiddle.aw_sin[k*n_step];
+      for (n_a=k; n_a<n_size; n_a += n_len){
+        n_b = n_a + n_half;
+        n_tr = (n_wr*pw_re[n_b] + n_wi*pw_im[n_b]) >> 15;
+        n_ti = (n_wr*pw_im[n_b] - n_wi*pw_re[n_b]) >> 15;
+        pw_re[n_b] = (int16_t)((pw_re[n_a] - n_tr) >> 1);
+        pw_im[n_b] = (int16_t)((pw_im[n_a] - n_ti) >> 1);
+        pw_re[n_a] = (int16_t)((pw_re[n_a] + n_tr) >> 1);
+        pw_im[n_a] = (int16_t)((pw_im[n_a] + n_ti) >> 1);
+      }
+    }
+  }
+}
+
+static void maxim_fft_real(int16_t *pw_re, int16_t *pw_im)
+/**
+* \brief        FFT of HR_FFT_SIZE real samples through one of half the size
+* \par          Details
+*               Takes the even samples in pw_re and the odd ones in pw_im, HR_FFT_SIZE/2 of each, no magnitude
+*               above 2^13. Leaves bins 0..HR_FFT_SIZE/2-1 of the real transform divided by HR_FFT_SIZE in place,
+*               the Nyquist bin is dropped.
+*
+* \retval       None
+*/
+{
+  int32_t k, n_m, n_er, n_ei, n_or, n_oi, n_tr, n_ti;
+
+  maxim_fft(pw_re, pw_im, HR_FFT_SIZE/2);
+
+  // X[k] = (E + W^k O)/2 and X[N/2-k] = conj(E - W^k O)/2, E and O the even and odd sample spectra
+  pw_re[0] = (int16_t)((pw_re[0] + pw_im[0]) >> 1);
+  pw_im[0] = 0;
+  for (k=1; k<=HR_FFT_SIZE/4; k++){
+    n_m = HR_FFT_SIZE/2 - k;
+    n_er = (pw_re[k] + pw_re[n_m]) >> 1;
+    n_ei = (pw_im[k] - pw_im[n_m]) >> 1;
+    n_or = (pw_im[k] + pw_im[n_m]) >> 1;
+    n_oi = (pw_re[n_m] - pw_re[k]) >> 1;
+    n_tr = (maxim_fft_twiddle.aw_cos[k]*n_or + maxim_fft_twiddle.aw_sin[k]*n_oi) >> 15;
+    n_ti = (maxim_fft_twiddle.aw_cos[k]*n_oi - maxim_fft_twiddle.aw_sin[k]*n_or) >> 15;
+    pw_re[k] = (int16_t)((n_er + n_tr) >> 1);
+    pw_im[k] = (int16_t)((n_ei + n_ti) >> 1);
+    if (n_m != k){
+      pw_re[n_m] = (int16_t)((n_er - n_tr) >> 1);
+      pw_im[n_m] = (int16_t)((n_ti - n_ei) >> 1);
+    }
+  }
+}
+
+static int32_t maxim_fft_power(const int16_t *pw_re, const int16_t *pw_im, int32_t k)
+{
+  return (int32_t)pw_re[k]*pw_re[k] + (int32_t)pw_im[k]*pw_im[k];
+}
+
+void maxim_hr_spectral(int32_t *pn_x, int32_t n_size, int32_t n_sample_period_us, int32_t *pn_heart_rate, int8_t *pch_hr_valid)
+/**
+* \brief        Heart rate from the spectrum of the window
+* \par          Details
+*               The newest HR_FFT_SIZE samples at most are detrended, shaped by a Welch window, scaled to 13 bits
+*               and zero padded. Each bin in HR_MIN_BPM..HR_MAX_BPM scores its own power plus that of its
+*               second harmonic, so a pulse whose dicrotic notch makes the harmonic the stronger line is still
+*               read at its fundamental. A parabola through the best bin and its neighbours gives the fraction
+*               of a bin. Not valid when the best bin is only the slope of something below the band, or when
+*               the pulse and its harmonic hold less than HR_MIN_CONCENTRATION % of the band power.
+*               Integer only with a handful of divisions per window; the cost depends on HR_FFT_SIZE, not on
+*               the signal.
+*
+* \param[in]    *pn_x                    - DC removed, inverted, 4 pt averaged IR
+* \param[in]    n_size                   - Number of samples
+* \param[in]    n_sample_period_us       - Time between samples
+* \param[out]   *pn_heart_rate           - Beats per minute, -999 when not valid
+* \param[out]   *pch_hr_valid            - 1 if the heart rate is valid
+*
+* \retval       None
+*/
+{
+  int16_t aw_re[HR_FFT_SIZE/2], aw_im[HR_FFT_SIZE/2];
+  int32_t k, j, n_max, n_shift, n_min_bin, n_max_bin, n_top_bin, n_best, n_width;
+  int64_t n_mean, n_sum_jx, n_slope_q16, n_welch_q16, n_x, n_score, n_best_score, n_band, n_pulse, n_p0, n_pm, n_pp, n_delta_q8;
+
+  *pn_heart_rate = -999;
+  *pch_hr_valid = 0;
+  if (n_sample_period_us <= 0) n_sample_period_us = 1000000 / FreqS;
+  if (n_size > HR_FFT_SIZE){
+    pn_x += n_size - HR_FFT_SIZE;
+    n_size = HR_FFT_SIZE;
+  }
+  if (n_size < 8) return;
+
+  // least squares line through the window, on j = 2k-(n-1) so the sums stay symmetric
+  n_mean = 0;
+  n_sum_jx = 0;
+  for (k=0; k<n_size; k++){
+    n_mean += pn_x[k];
+    n_sum_jx += (int64_t)(2*k - (n_size - 1))*pn_x[k];
+  }
+  n_mean /= n_size;
+  n_slope_q16 = n_sum_jx*65536/((int64_t)n_size*((int64_t)n_size*n_size - 1)/3);
+  n_max = 0;
+  for (k=0; k<n_size; k++){
+    n_x = pn_x[k] - n_mean - (((2*k - (n_size - 1))*n_slope_q16) >> 16);
+    if (n_x < 0) n_x = -n_x;
+    if (n_x > n_max) n_max = (int32_t)n_x;
+  }
+  if (n_max == 0) return;
+
+  // the largest sample to 2^12..2^13, left shift for weak signals, right for strong ones
+  n_shift = 0;
+  while ((n_max >> n_shift) >= (1 << 13)) n_shift++;
+  while (n_shift > -12 && ((int64_t)n_max << -(n_shift - 1)) < (1 << 13)) n_shift--;
+  // Welch window 1-j^2/(n-1)^2 in Q15
+  n_welch_q16 = ((int64_t)32768 << 16)/((int64_t)(n_size - 1)*(n_size - 1));
+  for (k=0; k<HR_FFT_SIZE; k++){
+    n_x = 0;
+    if (k < n_size){
+      j = 2*k - (n_size - 1);
+      n_x = (pn_x[k] - n_mean - ((j*n_slope_q16) >> 16))*(32768 - (((int64_t)j*j*n_welch_q16) >> 16));
+      n_x = n_shift >= 0 ? n_x >> (15 + n_shift) : n_x*(1 << -n_shift) >> 15;
+    }
+    // even samples to the real parts, odd to the imaginary
+    if (k & 1) aw_im[k >> 1] = (int16_t)n_x;
+    else aw_re[k >> 1] = (int16_t)n_x;
+  }
+
+  maxim_fft_real(aw_re, aw_im);
+
+  // pulse band in bins, k bins is k*60e6/(HR_FFT_SIZE*n_sample_period_us) bpm
+  n_min_bin = (int32_t)(((int64_t)HR_MIN_BPM*HR_FFT_SIZE*n_sample_period_us + 59999999)/60000000);
+  n_max_bin = (int32_t)((int64_t)HR_MAX_BPM*HR_FFT_SIZE*n_sample_period_us/60000000);
+  n_top_bin = HR_FFT_SIZE/2 - 1;
+  if (n_min_bin < 2) n_min_bin = 2;
+  if (n_max_bin > n_top_bin - 1) n_max_bin = n_top_bin - 1;
+  if (n_min_bin > n_max_bin) return;
+
+  n_best = n_min_bin;
+  n_best_score = -1;
+  for (k=n_min_bin; k<=n_max_bin; k++){
+    n_score = maxim_fft_power(aw_re, aw_im, k);
+    if (2*k <= n_top_bin) n_score += maxim_fft_power(aw_re, aw_im, 2*k);
+    if (n_score > n_best_score){
+      n_best_score = n_score;
+      n_best = k;
+    }
+  }
+  // the harmonic can pull the score a bin off the fundamental's own peak
+  if (n_best > n_min_bin && maxim_fft_power(aw_re, aw_im, n_best - 1) > maxim_fft_power(aw_re, aw_im, n_best)) n_best--;
+  else if (n_best < n_max_bin && maxim_fft_power(aw_re, aw_im, n_best + 1) > maxim_fft_power(aw_re, aw_im, n_best)) n_best++;
+
+  n_p0 = maxim_fft_power(aw_re, aw_im, n_best);
+  n_pm = maxim_fft_power(aw_re, aw_im, n_best - 1);
+  n_pp = maxim_fft_power(aw_re, aw_im, n_best + 1);
+  if (n_pm >= n_p0) return; // still rising below the band: wander or motion, no pulse peak
+
+  // a line spreads over about HR_FFT_SIZE/n_size bins either side, that much counts as the pulse
+  n_width = (HR_FFT_SIZE + n_size - 1)/n_size;
+  n_band = 0;
+  n_pulse = 0;
+  for (k=n_min_bin; k<=n_top_bin && k<=2*n_max_bin + n_width; k++){
+    n_x = maxim_fft_power(aw_re, aw_im, k);
+    n_band += n_x;
+    if ((k >= n_best - n_width && k <= n_best + n_width) || (k >= 2*n_best - n_width && k <= 2*n_best + n_width)) n_pulse += n_x;
+  }
+  if (n_band == 0 || n_pulse*100 < n_band*HR_MIN_CONCENTRATION) return;
+
+  n_delta_q8 = 0;
+  if (2*n_p0 - n_pm - n_pp > 0) n_delta_q8 = ((n_pp - n_pm) << 7)/(2*n_p0 - n_pm - n_pp);
+  if (n_delta_q8 > 128) n_delta_q8 = 128;
+  if (n_delta_q8 < -128) n_delta_q8 = -128;
+
+  *pn_heart_rate = (int32_t)((((int64_t)n_best << 8) + n_delta_q8)*60000000/((int64_t)HR_FFT_SIZE*n_sample_period_us << 7) + 1)/2;
+  *pch_hr_valid = 1;
+}
+
+template <typename S, typename U>
+static void maxim_analyse_window(int32_t *pn_x, S pun_ir_buffer, S pun_red_buffer, int32_t n_ir_buffer_length,
+                int32_t *pn_spo2, int8_t *pch_spo2_valid, int32_t *pn_heart_rate, int8_t *pch_hr_valid,
+                int32_t n_sample_period_us, U pun_sample_times, const maxim_spo2_cal_table *p_cal, int32_t *pn_spo2_q8)
+/**
+* \brief        Valley search, heart rate and SpO2 on a prepared window
+* \par          Details
+*               Second half of maxim_heart_rate_and_oxygen_saturation(), shared with the streaming estimator.
+*               pn_x holds the DC removed, inverted, 4 pt averaged IR signal. The SpO2 ratio reads the raw
+*               windows in place, there is no second copy of them.
+*
+* \param[in]    *pn_x                    - Prepared IR signal, n_ir_buffer_length entries
+* \param[in]    *pun_ir_buffer           - Raw IR window, oldest first, a pointer, maxim_ring_view or maxim_pack24_view
+* \param[in]    *pun_red_buffer          - Raw red window, oldest first
+* \param[in]    *pun_sample_times        - Sample times in the same order, may be NULL
+* \param[in]    *p_cal                   - Calibration table for the SpO2 lookup
+* \param[out]   *pn_spo2_q8              - SpO2 in 1/256 %, -999 when not valid, may be NULL
 *
 * \retval       None
 */
 {
-  uint32_t un_ir_mean;
   int32_t k, n_i_ratio_count;
-  int32_t i, n_exact_ir_valley_locs_count, n_middle_idx;
+  int32_t n_exact_ir_valley_locs_count, n_middle_idx;
   int32_t n_th1, n_npks;   
-  int32_t an_ir_valley_locs[15] ;
-  int32_t n_peak_interval_sum;
+  int32_t an_ir_valley_locs[MAX_NUM_PEAKS] ;
   
   int32_t n_y_ac, n_x_ac;
   int32_t n_spo2_calc; 
@@ -101,49 +609,22 @@ void maxim_heart_rate_and_oxygen_saturation(uint32_t *pun_ir_buffer, int32_t n_i
   int32_t n_x_dc_max_idx = 0; 
   int32_t an_ratio[5], n_ratio_average; 
   int32_t n_nume, n_denom ;
+  int32_t n_min_distance;
 
-  // calculates DC mean and subtract DC from ir
-  un_ir_mean =0; 
-  for (k=0 ; k<n_ir_buffer_length ; k++ ) un_ir_mean += pun_ir_buffer[k] ;
-  un_ir_mean =un_ir_mean/n_ir_buffer_length ;
-    
-  // remove DC and invert signal so that we can use peak detector as valley detector
-  for (k=0 ; k<n_ir_buffer_length ; k++ )  
-    an_x[k] = -1*(pun_ir_buffer[k] - un_ir_mean) ; 
-    
-  // 4 pt Moving Average
-  for(k=0; k< BUFFER_SIZE-MA4_SIZE; k++){
-    an_x[k]=( an_x[k]+an_x[k+1]+ an_x[k+2]+ an_x[k+3])/(int)4;        
-  }
-  // calculate threshold  
-  n_th1=0; 
-  for ( k=0 ; k<BUFFER_SIZE ;k++){
-    n_th1 +=  an_x[k];
-  }
-  n_th1=  n_th1/ ( BUFFER_SIZE);
-  if( n_th1<30) n_th1=30; // min allowed
-  if( n_th1>60) n_th1=60; // max allowed
+  n_min_distance = maxim_min_distance(n_sample_period_us);
+  n_th1 = maxim_valley_threshold(pn_x, n_ir_buffer_length);
 
-  for ( k=0 ; k<15;k++) an_ir_valley_locs[k]=0;
+  for ( k=0 ; k<MAX_NUM_PEAKS;k++) an_ir_valley_locs[k]=0;
   // since we flipped signal, we use peak detector as valley detector
-  maxim_find_peaks( an_ir_valley_locs, &n_npks, an_x, BUFFER_SIZE, n_th1, 4, 15 );//peak_height, peak_distance, max_num_peaks 
-  n_peak_interval_sum =0;
-  if (n_npks>=2){
-    for (k=1; k<n_npks; k++) n_peak_interval_sum += (an_ir_valley_locs[k] -an_ir_valley_locs[k -1] ) ;
-    n_peak_interval_sum =n_peak_interval_sum/(n_npks-1);
-    *pn_heart_rate =(int32_t)( (FreqS*60)/ n_peak_interval_sum );
-    *pch_hr_valid  = 1;
-  }
-  else  { 
-    *pn_heart_rate = -999; // unable to calculate because # of peaks are too small
-    *pch_hr_valid  = 0;
-  }
+  maxim_find_peaks( an_ir_valley_locs, &n_npks, pn_x, n_ir_buffer_length, n_th1, n_min_distance, MAX_NUM_PEAKS );//peak_height, peak_distance, max_num_peaks 
+#if HR_ENGINE == HR_ENGINE_SPECTRAL
+  maxim_hr_spectral(pn_x, n_ir_buffer_length, n_sample_period_us, pn_heart_rate, pch_hr_valid);
+  (void)pun_sample_times;
+#else
+  maxim_hr_from_valleys(an_ir_valley_locs, n_npks, n_sample_period_us, pun_sample_times, pn_heart_rate, pch_hr_valid);
+#endif
 
-  //  load raw value again for SPO2 calculation : RED(=y) and IR(=X)
-  for (k=0 ; k<n_ir_buffer_length ; k++ )  {
-      an_x[k] =  pun_ir_buffer[k] ; 
-      an_y[k] =  pun_red_buffer[k] ; 
-  }
+  //  raw values for SPO2 calculation, read in place : RED(=y) and IR(=X)
 
   // find precise min near an_ir_valley_locs
   n_exact_ir_valley_locs_count =n_npks; 
@@ -155,7 +636,8 @@ void maxim_heart_rate_and_oxygen_saturation(uint32_t *pun_ir_buffer, int32_t n_i
   n_i_ratio_count = 0; 
   for(k=0; k< 5; k++) an_ratio[k]=0;
   for (k=0; k< n_exact_ir_valley_locs_count; k++){
-    if (an_ir_valley_locs[k] > BUFFER_SIZE ){
+    if (an_ir_valley_locs[k] > n_ir_buffer_length ){
+      if (pn_spo2_q8 != NULL) *pn_spo2_q8 = -999;
       *pn_spo2 =  -999 ; // do not use SPO2 since valley loc is out of range
       *pch_spo2_valid  = 0; 
       return;
@@ -167,21 +649,19 @@ void maxim_heart_rate_and_oxygen_saturation(uint32_t *pun_ir_buffer, int32_t n_i
     n_y_dc_max= -16777216 ; 
     n_x_dc_max= -16777216; 
     if (an_ir_valley_locs[k+1]-an_ir_valley_locs[k] >3){
-        for (i=an_ir_valley_locs[k]; i< an_ir_valley_locs[k+1]; i++){
-          if (an_x[i]> n_x_dc_max) {n_x_dc_max =an_x[i]; n_x_dc_max_idx=i;}
-          if (an_y[i]> n_y_dc_max) {n_y_dc_max =an_y[i]; n_y_dc_max_idx=i;}
-      }
-      n_y_ac= (an_y[an_ir_valley_locs[k+1]] - an_y[an_ir_valley_locs[k] ] )*(n_y_dc_max_idx -an_ir_valley_locs[k]); //red
-      n_y_ac=  an_y[an_ir_valley_locs[k]] + n_y_ac/ (an_ir_valley_locs[k+1] - an_ir_valley_locs[k])  ; 
-      n_y_ac=  an_y[n_y_dc_max_idx] - n_y_ac;    // subracting linear DC compoenents from raw 
-      n_x_ac= (an_x[an_ir_valley_locs[k+1]] - an_x[an_ir_valley_locs[k] ] )*(n_x_dc_max_idx -an_ir_valley_locs[k]); // ir
-      n_x_ac=  an_x[an_ir_valley_locs[k]] + n_x_ac/ (an_ir_valley_locs[k+1] - an_ir_valley_locs[k]); 
-      n_x_ac=  an_x[n_y_dc_max_idx] - n_x_ac;      // subracting linear DC compoenents from raw 
+      maxim_max(pun_ir_buffer, an_ir_valley_locs[k], an_ir_valley_locs[k+1], &n_x_dc_max, &n_x_dc_max_idx);
+      maxim_max(pun_red_buffer, an_ir_valley_locs[k], an_ir_valley_locs[k+1], &n_y_dc_max, &n_y_dc_max_idx);
+      n_y_ac= ((int32_t)pun_red_buffer[an_ir_valley_locs[k+1]] - (int32_t)pun_red_buffer[an_ir_valley_locs[k] ] )*(n_y_dc_max_idx -an_ir_valley_locs[k]); //red
+      n_y_ac=  (int32_t)pun_red_buffer[an_ir_valley_locs[k]] + n_y_ac/ (an_ir_valley_locs[k+1] - an_ir_valley_locs[k])  ; 
+      n_y_ac=  (int32_t)pun_red_buffer[n_y_dc_max_idx] - n_y_ac;    // subracting linear DC compoenents from raw 
+      n_x_ac= ((int32_t)pun_ir_buffer[an_ir_valley_locs[k+1]] - (int32_t)pun_ir_buffer[an_ir_valley_locs[k] ] )*(n_x_dc_max_idx -an_ir_valley_locs[k]); // ir
+      n_x_ac=  (int32_t)pun_ir_buffer[an_ir_valley_locs[k]] + n_x_ac/ (an_ir_valley_locs[k+1] - an_ir_valley_locs[k]); 
+      n_x_ac=  (int32_t)pun_ir_buffer[n_y_dc_max_idx] - n_x_ac;      // subracting linear DC compoenents from raw 
       n_nume=( n_y_ac *n_x_dc_max)>>7 ; //prepare X100 to preserve floating value
       n_denom= ( n_x_ac *n_y_dc_max)>>7;
       if (n_denom>0  && n_i_ratio_count <5 &&  n_nume != 0)
       {   
-        an_ratio[n_i_ratio_count]= (n_nume*100)/n_denom ; //formular is ( n_y_ac *n_x_dc_max) / ( n_x_ac *n_y_dc_max) ;
+        an_ratio[n_i_ratio_count]= (int32_t)(((int64_t)n_nume*(100 << SPO2_Q))/n_denom) ; //formular is ( n_y_ac *n_x_dc_max) / ( n_x_ac *n_y_dc_max), x100 in Q8
         n_i_ratio_count++;
       }
     }
@@ -195,37 +675,417 @@ void maxim_heart_rate_and_oxygen_saturation(uint32_t *pun_ir_buffer, int32_t n_i
   else
     n_ratio_average = an_ratio[n_middle_idx ];
 
-  if( n_ratio_average>2 && n_ratio_average <184){
-    n_spo2_calc= uch_spo2_table[n_ratio_average] ;
-    *pn_spo2 = n_spo2_calc ;
-    *pch_spo2_valid  = 1;//  float_SPO2 =  -45.060*n_ratio_average* n_ratio_average/10000 + 30.354 *n_ratio_average/100 + 94.845 ;  // for comparison with table
+  if( n_ratio_average >= (3 << SPO2_Q) && n_ratio_average < (184 << SPO2_Q)){
+    n_spo2_calc= maxim_spo2_from_ratio(p_cal, n_ratio_average) ;
+    if (pn_spo2_q8 != NULL) *pn_spo2_q8 = n_spo2_calc;
+    *pn_spo2 = (n_spo2_calc + (1 << (SPO2_Q - 1))) >> SPO2_Q ;
+    *pch_spo2_valid  = 1;
   }
   else{
+    if (pn_spo2_q8 != NULL) *pn_spo2_q8 = -999;
     *pn_spo2 =  -999 ; // do not use SPO2 since signal an_ratio is out of range
     *pch_spo2_valid  = 0; 
   }
 }
 
+static maxim_spo2_workspace<BUFFER_SIZE> default_context; // for the overloads without a context
+
+void maxim_spo2_context_init(maxim_spo2_context *p_ctx, int32_t *pn_x, int32_t n_size)
+/**
+* \brief        Hand a context its scratch memory
+*
+* \param[out]   *p_ctx                   - Context to set up
+* \param[in]    *pn_x                    - IR scratch, n_size entries
+* \param[in]    n_size                   - Longest window the context will analyse
+*
+* \retval       None
+*/
+{
+  p_ctx->pn_x = pn_x;
+  p_ctx->n_size = n_size;
+  p_ctx->p_cal = &maxim_spo2_default_cal;
+  p_ctx->n_spo2_q8 = -999;
+}
+
+void maxim_spo2_context_set_calibration(maxim_spo2_context *p_ctx, const maxim_spo2_cal_table *p_cal)
+/**
+* \brief        SpO2 curve for this context, e.g. a table built from per-device coefficients
+* \par          Details
+*               The table is used in place, it has to outlive the context.
+*
+* \retval       None
+*/
+{
+  p_ctx->p_cal = p_cal;
+}
+
+template <typename S, typename U>
+static void maxim_analyse_buffer(maxim_spo2_context *p_ctx, S pun_ir_buffer, int32_t n_ir_buffer_length, S pun_red_buffer,
+                int32_t *pn_spo2, int8_t *pch_spo2_valid, int32_t *pn_heart_rate, int8_t *pch_hr_valid,
+                int32_t n_sample_period_us, U pun_sample_times)
+/**
+* \brief        Calculate the heart rate and SpO2 level
+* \par          Details
+*               By detecting  peaks of PPG cycle and corresponding AC/DC of red/infra-red signal, the an_ratio for the SPO2 is computed.
+*               Since this algorithm is aiming for Arm M0/M3. formaula for SPO2 did not achieve the accuracy due to register overflow.
+*               Thus, accurate SPO2 is precalculated and save longo p_ctx->p_cal per each an_ratio.
+*               Works only on p_ctx's scratch, so calls with different contexts can run concurrently.
+*
+* \param[in]    *p_ctx                   - Scratch memory for this call
+* \param[in]    *pun_ir_buffer           - IR sensor data buffer, a pointer or a maxim_ring_view
+* \param[in]    n_ir_buffer_length      - IR sensor data buffer length, at most p_ctx->n_size
+* \param[in]    *pun_red_buffer          - Red sensor data buffer
+* \param[out]    *pn_spo2                - Calculated SpO2 value
+* \param[out]    *pch_spo2_valid         - 1 if the calculated SpO2 value is valid
+* \param[out]    *pn_heart_rate          - Calculated heart rate value
+* \param[out]    *pch_hr_valid           - 1 if the calculated heart rate value is valid
+* \param[in]    n_sample_period_us      - Time between samples, i.e. the sensor's effective output data rate
+* \param[in]    *pun_sample_times        - Optional time of each sample in microseconds. Beat intervals are then
+*                                        measured on these instead of counted in samples, NULL to use n_sample_period_us
+*
+* \retval       None
+*/
+{
+  int32_t *pn_x = p_ctx->pn_x;
+  uint32_t un_ir_mean;
+
+  if (n_ir_buffer_length > p_ctx->n_size) n_ir_buffer_length = p_ctx->n_size; // scratch capacity
+  if (n_sample_period_us <= 0) n_sample_period_us = 1000000 / FreqS;
+
+  // calculates DC mean and subtract DC from ir
+  un_ir_mean = maxim_sum(pun_ir_buffer, n_ir_buffer_length);
+  un_ir_mean =un_ir_mean/n_ir_buffer_length ;
+    
+  // remove DC and invert signal so that we can use peak detector as valley detector
+  maxim_remove_dc(pn_x, pun_ir_buffer, n_ir_buffer_length, un_ir_mean);
+    
+  // 4 pt Moving Average
+  maxim_kernel_ma4(pn_x, n_ir_buffer_length);
+
+  maxim_analyse_window(pn_x, pun_ir_buffer, pun_red_buffer, n_ir_buffer_length,
+                pn_spo2, pch_spo2_valid, pn_heart_rate, pch_hr_valid, n_sample_period_us, pun_sample_times,
+                p_ctx->p_cal, &p_ctx->n_spo2_q8);
+}
+
+#if defined(__AVR_ATmega328P__) || defined(__AVR_ATmega168__)
+//Arduino Uno doesn't have enough SRAM to store 100 samples of IR led data and red led data in 32-bit format
+//To solve this problem, 16-bit MSB of the sampled data will be truncated.  Samples become 16-bit data.
+void maxim_heart_rate_and_oxygen_saturation(maxim_spo2_context *p_ctx, uint16_t *pun_ir_buffer, int32_t n_ir_buffer_length, uint16_t *pun_red_buffer, int32_t *pn_spo2, int8_t *pch_spo2_valid, 
+                int32_t *pn_heart_rate, int8_t *pch_hr_valid, int32_t n_sample_period_us, const uint32_t *pun_sample_times)
+{
+  maxim_analyse_buffer(p_ctx, pun_ir_buffer, n_ir_buffer_length, pun_red_buffer,
+                pn_spo2, pch_spo2_valid, pn_heart_rate, pch_hr_valid, n_sample_period_us, pun_sample_times);
+}
+
+void maxim_heart_rate_and_oxygen_saturation(uint16_t *pun_ir_buffer, int32_t n_ir_buffer_length, uint16_t *pun_red_buffer, int32_t *pn_spo2, int8_t *pch_spo2_valid, 
+                int32_t *pn_heart_rate, int8_t *pch_hr_valid, int32_t n_sample_period_us, const uint32_t *pun_sample_times)
+{
+  maxim_analyse_buffer(&default_context, pun_ir_buffer, n_ir_buffer_length, pun_red_buffer,
+                pn_spo2, pch_spo2_valid, pn_heart_rate, pch_hr_valid, n_sample_period_us, pun_sample_times);
+}
+#else
+void maxim_heart_rate_and_oxygen_saturation(maxim_spo2_context *p_ctx, uint32_t *pun_ir_buffer, int32_t n_ir_buffer_length, uint32_t *pun_red_buffer, int32_t *pn_spo2, int8_t *pch_spo2_valid, 
+                int32_t *pn_heart_rate, int8_t *pch_hr_valid, int32_t n_sample_period_us, const uint32_t *pun_sample_times)
+{
+  maxim_analyse_buffer(p_ctx, pun_ir_buffer, n_ir_buffer_length, pun_red_buffer,
+                pn_spo2, pch_spo2_valid, pn_heart_rate, pch_hr_valid, n_sample_period_us, pun_sample_times);
+}
+
+void maxim_heart_rate_and_oxygen_saturation(uint32_t *pun_ir_buffer, int32_t n_ir_buffer_length, uint32_t *pun_red_buffer, int32_t *pn_spo2, int8_t *pch_spo2_valid, 
+                int32_t *pn_heart_rate, int8_t *pch_hr_valid, int32_t n_sample_period_us, const uint32_t *pun_sample_times)
+{
+  maxim_analyse_buffer(&default_context, pun_ir_buffer, n_ir_buffer_length, pun_red_buffer,
+                pn_spo2, pch_spo2_valid, pn_heart_rate, pch_hr_valid, n_sample_period_us, pun_sample_times);
+}
+#endif
+
+void maxim_heart_rate_and_oxygen_saturation(maxim_spo2_context *p_ctx, const maxim_spo2_ring *p_ring, int32_t *pn_spo2, int8_t *pch_spo2_valid, 
+                int32_t *pn_heart_rate, int8_t *pch_hr_valid, int32_t n_sample_period_us)
+/**
+* \brief        Calculate the heart rate and SpO2 level of a circular buffer
+* \par          Details
+*               Reads the buffer in place in time order, starting at p_ring->n_head, nothing is copied to unwrap it.
+*               A ring longer than p_ctx->n_size is cut to its newest p_ctx->n_size samples.
+*
+* \retval       None
+*/
+{
+  int32_t n_size = p_ring->n_size;
+  int32_t n_head = p_ring->n_head;
+
+  if (n_size > p_ctx->n_size){
+    n_head += n_size - p_ctx->n_size;
+    if (n_head >= n_size) n_head -= n_size;
+    n_size = p_ctx->n_size;
+  }
+  // the views still wrap at the ring's length, only the newest n_size samples are read
+  maxim_analyse_buffer(p_ctx, maxim_ring(p_ring->pun_ir, p_ring->n_size, n_head), n_size, maxim_ring(p_ring->pun_red, p_ring->n_size, n_head),
+                pn_spo2, pch_spo2_valid, pn_heart_rate, pch_hr_valid, n_sample_period_us, maxim_ring(p_ring->pun_time, p_ring->n_size, n_head));
+}
+
+void maxim_heart_rate_and_oxygen_saturation(const maxim_spo2_ring *p_ring, int32_t *pn_spo2, int8_t *pch_spo2_valid, 
+                int32_t *pn_heart_rate, int8_t *pch_hr_valid, int32_t n_sample_period_us)
+{
+  maxim_heart_rate_and_oxygen_saturation(&default_context, p_ring, pn_spo2, pch_spo2_valid, pn_heart_rate, pch_hr_valid, n_sample_period_us);
+}
+
+
+static int32_t maxim_sqi_score(int64_t n_score)
+{
+  return n_score < 0 ? 0 : n_score > 100 ? 100 : (int32_t)n_score;
+}
+
+void maxim_signal_quality(maxim_sqi *p_sqi, const int32_t *pn_x, int32_t n_size, int32_t n_dc, int32_t n_clipped, int32_t n_sample_period_us)
+/**
+* \brief        Signal quality of one window
+* \par          Details
+*               Two passes over the window, no sorting and no division per sample. Periodicity comes from
+*               the rising zero crossings of pn_x with a hysteresis of 1/8 of the peak to peak, so noise on
+*               top of a clean pulse does not count as extra cycles. A cycle faster than SQI_MAX_BPM is not a
+*               pulse and makes the periodicity 0.
+*
+* \param[out]   *p_sqi                   - Metrics and score
+* \param[in]    *pn_x                    - Inverted, DC removed, 4 pt averaged IR, as the valley search gets it
+* \param[in]    n_size                   - Number of samples
+* \param[in]    n_dc                     - IR mean of the window
+* \param[in]    n_clipped                - Samples in the window with red or IR at SQI_CLIP_LEVEL or above
+* \param[in]    n_sample_period_us       - Time between samples
+*
+* \retval       None
+*/
+{
+  int32_t k, n_min, n_max, n_hyst, n_last, n_shortest, n_longest, n_interval, n_min_cycle;
+  int8_t ch_armed, ch_above;
+
+  if (n_sample_period_us <= 0) n_sample_period_us = 1000000 / FreqS;
+  n_min_cycle = 60000000 / (SQI_MAX_BPM * n_sample_period_us);
+
+  maxim_kernel_range(pn_x, n_size, &n_min, &n_max);
+  p_sqi->n_ac = n_max - n_min;
+  p_sqi->n_pi = n_dc > 0 ? (int32_t)((int64_t)p_sqi->n_ac*10000/n_dc) : 0;
+  p_sqi->n_clip_pct = n_size > 0 ? n_clipped*100/n_size : 0;
+
+  n_hyst = p_sqi->n_ac/8 + 1;
+  n_last = -1;
+  n_shortest = n_size;
+  n_longest = 0;
+  ch_armed = 0;
+  // armed below -n_hyst, a crossing once above n_hyst; only the few crossings branch
+  for (k=0; k<n_size; k++){
+    ch_above = pn_x[k] > n_hyst;
+    if (ch_armed & ch_above){
+      if (n_last >= 0){
+        n_interval = k - n_last;
+        if (n_interval < n_shortest) n_shortest = n_interval;
+        if (n_interval > n_longest) n_longest = n_interval;
+        if (n_interval < n_min_cycle) break; // not a pulse, the periodicity is 0 whatever follows
+      }
+      n_last = k;
+    }
+    ch_armed = (ch_armed | (pn_x[k] < -n_hyst)) & !ch_above;
+  }
+  p_sqi->n_periodicity = (n_longest > 0 && n_shortest >= n_min_cycle) ? n_shortest*100/n_longest : 0;
+
+  // each metric scores SQI_PASS right on its threshold
+  p_sqi->n_score = maxim_sqi_score((int64_t)SQI_PASS*p_sqi->n_ac/SQI_MIN_AC);
+  p_sqi->n_score = min(p_sqi->n_score, maxim_sqi_score((int64_t)SQI_PASS*p_sqi->n_pi/SQI_MIN_PI));
+  p_sqi->n_score = min(p_sqi->n_score, maxim_sqi_score(100 - (int64_t)(100 - SQI_PASS)*p_sqi->n_clip_pct/SQI_MAX_CLIP_PCT));
+  p_sqi->n_score = min(p_sqi->n_score, maxim_sqi_score((int64_t)SQI_PASS*p_sqi->n_periodicity/SQI_MIN_PERIODICITY));
+  p_sqi->ch_ok = p_sqi->n_score >= SQI_PASS ? 1 : 0;
+}
+
+void maxim_spo2_stream_init(maxim_spo2_stream *p_stream, int32_t n_window, int32_t n_hop, int32_t n_sample_period_us, int8_t ch_use_times)
+/**
+* \brief        Set up a streaming estimator
+* \par          Details
+*               Windows longer than BUFFER_SIZE are cut to BUFFER_SIZE, a hop below 1 becomes 1.
+*
+* \param[out]   *p_stream                - Estimator state
+* \param[in]    n_window                 - Samples per analysis window
+* \param[in]    n_hop                    - New samples between results
+* \param[in]    n_sample_period_us       - Time between samples
+* \param[in]    ch_use_times             - 1 to measure beat intervals on the times given to maxim_spo2_stream_add()
+*
+* \retval       None
+*/
+{
+  if (n_window > BUFFER_SIZE) n_window = BUFFER_SIZE;
+  if (n_window < MA4_SIZE + 1) n_window = MA4_SIZE + 1;
+  if (n_hop < 1) n_hop = 1;
+  if (n_sample_period_us <= 0) n_sample_period_us = 1000000 / FreqS;
+
+  p_stream->n_window = n_window;
+  p_stream->n_hop = n_hop;
+  p_stream->n_sample_period_us = n_sample_period_us;
+  p_stream->ch_use_times = ch_use_times;
+  p_stream->p_cal = &maxim_spo2_default_cal;
+  p_stream->n_spo2_q8 = -999;
+  p_stream->ch_sqi_gate = 0;
+  maxim_spo2_stream_reset(p_stream);
+}
+
+void maxim_spo2_stream_reset(maxim_spo2_stream *p_stream)
+/**
+* \brief        Drop every sample, keep the configuration
+*
+* \retval       None
+*/
+{
+  p_stream->n_count = 0;
+  p_stream->n_next = 0;
+  p_stream->n_since_result = 0;
+  p_stream->un_ir_sum = 0;
+  p_stream->n_clipped = 0;
+  p_stream->un_time = 0;
+  memset(&p_stream->sqi, 0, sizeof(p_stream->sqi));
+}
+
+int8_t maxim_spo2_stream_add(maxim_spo2_stream *p_stream, uint32_t un_ir, uint32_t un_red, uint32_t un_time)
+/**
+* \brief        Push one sample
+* \par          Details
+*               Constant time: stores the sample and updates the window sum.
+*               Red and IR above MAXIM_PACK24_MAX are held at it, the ADC gives 18 bits.
+*
+* \retval       1 when a result is due, call maxim_spo2_stream_result()
+*/
+{
+  int32_t n_window = p_stream->n_window;
+  int32_t n_slot = p_stream->n_next;
+  uint32_t un_old_ir, un_old_red;
+
+  if (n_window <= 0) return 0; // not initialised
+  if (un_ir > MAXIM_PACK24_MAX) un_ir = MAXIM_PACK24_MAX;
+  if (un_red > MAXIM_PACK24_MAX) un_red = MAXIM_PACK24_MAX;
+
+  // the slot being reused holds the sample leaving the window
+  if (p_stream->n_count == n_window){
+    un_old_ir = maxim_pack24_get(p_stream->auch_ir, n_slot);
+    un_old_red = maxim_pack24_get(p_stream->auch_red, n_slot);
+    p_stream->un_ir_sum -= un_old_ir;
+    if (un_old_ir >= SQI_CLIP_LEVEL || un_old_red >= SQI_CLIP_LEVEL) p_stream->n_clipped--;
+  }
+  else p_stream->n_count++;
+  p_stream->un_ir_sum += un_ir;
+  if (un_ir >= SQI_CLIP_LEVEL || un_red >= SQI_CLIP_LEVEL) p_stream->n_clipped++;
+
+  maxim_pack24_set(p_stream->auch_ir, n_slot, un_ir);
+  maxim_pack24_set(p_stream->auch_red, n_slot, un_red);
+  maxim_pack24_set(p_stream->auch_time, n_slot, un_time);
+  p_stream->un_time = un_time;
+
+  p_stream->n_next = (n_slot + 1 == n_window) ? 0 : n_slot + 1;
+
+  if (p_stream->n_count < n_window) return 0;
+  // first result as soon as the window is full, then one per hop
+  if (p_stream->n_since_result == 0 || ++p_stream->n_since_result > p_stream->n_hop){
+    p_stream->n_since_result = 1;
+    return 1;
+  }
+  return 0;
+}
+
+void maxim_spo2_stream_set_calibration(maxim_spo2_stream *p_stream, const maxim_spo2_cal_table *p_cal)
+/**
+* \brief        SpO2 curve for this stream, call after maxim_spo2_stream_init()
+*
+* \retval       None
+*/
+{
+  p_stream->p_cal = p_cal;
+}
+
+void maxim_spo2_stream_set_sqi_gate(maxim_spo2_stream *p_stream, int8_t ch_enable)
+/**
+* \brief        With ch_enable 1, windows that fail maxim_signal_quality() are reported invalid without
+*               running the valley search and the ratio. p_stream->sqi is kept up to date either way.
+*
+* \retval       None
+*/
+{
+  p_stream->ch_sqi_gate = ch_enable;
+}
+
+int8_t maxim_spo2_stream_full(const maxim_spo2_stream *p_stream)
+/**
+* \brief        1 once the window holds n_window samples
+*/
+{
+  return (p_stream->n_window > 0 && p_stream->n_count == p_stream->n_window) ? 1 : 0;
+}
+
+void maxim_spo2_stream_result(maxim_spo2_stream *p_stream, int32_t *pn_spo2, int8_t *pch_spo2_valid, int32_t *pn_heart_rate, int8_t *pch_hr_valid)
+/**
+* \brief        Heart rate and SpO2 of the current window
+* \par          Details
+*               Rebuilds the averaged IR signal from the kept window sum, with the same integer rounding
+*               as the batch function, then runs the shared valley search on the packed window in place.
+*               p_stream->sqi is updated for every full window, gate or not.
+*
+* \retval       None
+*/
+{
+  int32_t n_window = p_stream->n_window;
+  int32_t n_oldest = p_stream->n_next; // with a full window the next slot is the oldest sample
+  int32_t n_mean, n_first, k;
+
+  if (!maxim_spo2_stream_full(p_stream)){
+    p_stream->n_spo2_q8 = -999;
+    *pn_spo2 = -999;
+    *pch_spo2_valid = 0;
+    *pn_heart_rate = -999;
+    *pch_hr_valid = 0;
+    return;
+  }
+
+  maxim_pack24_view ir_view = maxim_pack24_ring(p_stream->auch_ir, n_window, n_oldest);
+  maxim_time24_view time_view = { maxim_pack24_ring(p_stream->ch_use_times ? p_stream->auch_time : NULL, n_window, n_oldest),
+                                  p_stream->un_time };
+
+  n_mean = (int32_t)(p_stream->un_ir_sum / n_window);
+  // unpacked once, oldest first in two straight runs, then averaged like the batch function
+  n_first = n_window - n_oldest;
+  for (k=0; k< n_first; k++)
+    p_stream->an_x[k] = n_mean - (int32_t)maxim_pack24_get(p_stream->auch_ir, n_oldest + k);
+  for ( ; k< n_window; k++)
+    p_stream->an_x[k] = n_mean - (int32_t)maxim_pack24_get(p_stream->auch_ir, k - n_first);
+  maxim_kernel_ma4(p_stream->an_x, n_window);
+
+  maxim_signal_quality(&p_stream->sqi, p_stream->an_x, n_window, n_mean, p_stream->n_clipped, p_stream->n_sample_period_us);
+  if (p_stream->ch_sqi_gate && !p_stream->sqi.ch_ok){
+    p_stream->n_spo2_q8 = -999;
+    *pn_spo2 = -999;
+    *pch_spo2_valid = 0;
+    *pn_heart_rate = -999;
+    *pch_hr_valid = 0;
+    return;
+  }
+
+  maxim_analyse_window(p_stream->an_x, ir_view, maxim_pack24_ring(p_stream->auch_red, n_window, n_oldest), n_window,
+                pn_spo2, pch_spo2_valid, pn_heart_rate, pch_hr_valid, p_stream->n_sample_period_us,
+                time_view, p_stream->p_cal, &p_stream->n_spo2_q8);
+}
 
 void maxim_find_peaks( int32_t *pn_locs, int32_t *n_npks,  int32_t  *pn_x, int32_t n_size, int32_t n_min_height, int32_t n_min_distance, int32_t n_max_num )
 /**
 * \brief        Find peaks
 * \par          Details
-*               Find at most MAX_NUM peaks above MIN_HEIGHT separated by at least MIN_DISTANCE
+*               Find at most MAX_NUM peaks above MIN_HEIGHT separated by at least MIN_DISTANCE.
+*               n_max_num is capped at MAX_NUM_PEAKS, the size of the selection scratch.
 *
 * \retval       None
 */
 {
-  maxim_peaks_above_min_height( pn_locs, n_npks, pn_x, n_size, n_min_height );
+  if (n_max_num > MAX_NUM_PEAKS) n_max_num = MAX_NUM_PEAKS;
+  maxim_peaks_above_min_height( pn_locs, n_npks, pn_x, n_size, n_min_height, n_max_num );
   maxim_remove_close_peaks( pn_locs, n_npks, pn_x, n_min_distance );
-  *n_npks = min( *n_npks, n_max_num );
 }
 
-void maxim_peaks_above_min_height( int32_t *pn_locs, int32_t *n_npks,  int32_t  *pn_x, int32_t n_size, int32_t n_min_height )
+void maxim_peaks_above_min_height( int32_t *pn_locs, int32_t *n_npks,  int32_t  *pn_x, int32_t n_size, int32_t n_min_height, int32_t n_max_num )
 /**
 * \brief        Find peaks above n_min_height
 * \par          Details
-*               Find all peaks above MIN_HEIGHT
+*               Find the first n_max_num peaks above MIN_HEIGHT, in ascending order
 *
 * \retval       None
 */
@@ -233,12 +1093,12 @@ void maxim_peaks_above_min_height( int32_t *pn_locs, int32_t *n_npks,  int32_t
   int32_t i = 1, n_width;
   *n_npks = 0;
   
-  while (i < n_size-1){
+  while (i < n_size-1 && (*n_npks) < n_max_num){
     if (pn_x[i] > n_min_height && pn_x[i] > pn_x[i-1]){      // find left edge of potential peaks
       n_width = 1;
       while (i+n_width < n_size && pn_x[i] == pn_x[i+n_width])  // find flat peaks
         n_width++;
-      if (pn_x[i] > pn_x[i+n_width] && (*n_npks) < 15 ){      // find right edge of peaks
+      if (i+n_width < n_size && pn_x[i] > pn_x[i+n_width]){      // find right edge of peaks, a plateau running off the end has none
         pn_locs[(*n_npks)++] = i;    
         // for flat peaks, peak location is left edge
         i += n_width+1;
@@ -251,33 +1111,79 @@ void maxim_peaks_above_min_height( int32_t *pn_locs, int32_t *n_npks,  int32_t
   }
 }
 
+static int8_t maxim_peak_before(int32_t *pn_x, int32_t *pn_locs, int32_t n_a, int32_t n_b)
+/**
+* \brief        1 if candidate n_a is picked before n_b: higher, or as high and earlier
+*/
+{
+  int32_t n_ha = pn_x[pn_locs[n_a]], n_hb = pn_x[pn_locs[n_b]];
+  return (n_ha > n_hb || (n_ha == n_hb && pn_locs[n_a] < pn_locs[n_b])) ? 1 : 0;
+}
+
 void maxim_remove_close_peaks(int32_t *pn_locs, int32_t *pn_npks, int32_t *pn_x, int32_t n_min_distance)
 /**
 * \brief        Remove peaks
 * \par          Details
-*               Remove peaks separated by less than MIN_DISTANCE
+*               Remove peaks separated by less than MIN_DISTANCE, and those within MIN_DISTANCE of the start.
+*               Largest first: a peak stays unless a larger one that stayed is too close. Ties go to the earlier peak.
+*               The candidates are ranked with a heap, O(n log n), and each one is checked only against its
+*               neighbours in index order, which are at least 2 samples apart, so O(n*MIN_DISTANCE) for the sweep.
+*               Survivors come out in ascending order. At most MAX_NUM_PEAKS candidates are looked at.
 *
 * \retval       None
 */
 {
-    
-  int32_t i, j, n_old_npks, n_dist;
-    
-  /* Order peaks from large to small */
-  maxim_sort_indices_descend( pn_x, pn_locs, *pn_npks );
-
-  for ( i = -1; i < *pn_npks; i++ ){
-    n_old_npks = *pn_npks;
-    *pn_npks = i+1;
-    for ( j = i+1; j < n_old_npks; j++ ){
-      n_dist =  pn_locs[j] - ( i == -1 ? -1 : pn_locs[i] ); // lag-zero peak of autocorr is at index -1
-      if ( n_dist > n_min_distance || n_dist < -n_min_distance )
-        pn_locs[(*pn_npks)++] = pn_locs[j];
+  int32_t an_order[MAX_NUM_PEAKS];
+  uint8_t auch_kept[MAX_NUM_PEAKS];
+  int32_t i, j, n_npks, n_parent, n_child, n_temp, n_loc;
+  int8_t ch_keep;
+
+  n_npks = *pn_npks;
+  if (n_npks > MAX_NUM_PEAKS) n_npks = MAX_NUM_PEAKS;
+
+  // the sweep below walks neighbours in index order
+  for (i = 1; i < n_npks && pn_locs[i-1] <= pn_locs[i]; i++);
+  if (i < n_npks) maxim_sort_ascend( pn_locs, n_npks );
+
+  // heap with the last pick on top, sorted in place so an_order runs from first pick to last
+  for (i = 0; i < n_npks; i++) an_order[i] = i;
+  for (i = n_npks - 1; i >= 0; i--){
+    for (j = i; ; ){
+      n_parent = j; n_child = 2*j + 1;
+      if (n_child >= n_npks) break;
+      if (n_child + 1 < n_npks && maxim_peak_before(pn_x, pn_locs, an_order[n_child + 1], an_order[n_child]) == 0) n_child++;
+      if (maxim_peak_before(pn_x, pn_locs, an_order[n_parent], an_order[n_child]) == 0) break;
+      n_temp = an_order[n_parent]; an_order[n_parent] = an_order[n_child]; an_order[n_child] = n_temp;
+      j = n_child;
+    }
+  }
+  for (i = n_npks - 1; i > 0; i--){
+    n_temp = an_order[0]; an_order[0] = an_order[i]; an_order[i] = n_temp;
+    for (j = 0; ; ){
+      n_parent = j; n_child = 2*j + 1;
+      if (n_child >= i) break;
+      if (n_child + 1 < i && maxim_peak_before(pn_x, pn_locs, an_order[n_child + 1], an_order[n_child]) == 0) n_child++;
+      if (maxim_peak_before(pn_x, pn_locs, an_order[n_parent], an_order[n_child]) == 0) break;
+      n_temp = an_order[n_parent]; an_order[n_parent] = an_order[n_child]; an_order[n_child] = n_temp;
+      j = n_child;
     }
   }
 
-  // Resort indices int32_to ascending order
-  maxim_sort_ascend( pn_locs, *pn_npks );
+  for (i = 0; i < n_npks; i++) auch_kept[i] = 0;
+  for (i = 0; i < n_npks; i++){
+    n_temp = an_order[i];
+    n_loc = pn_locs[n_temp];
+    ch_keep = (n_loc + 1 > n_min_distance) ? 1 : 0; // lag-zero peak of autocorr is at index -1
+    for (j = n_temp - 1; ch_keep && j >= 0 && n_loc - pn_locs[j] <= n_min_distance; j--)
+      if (auch_kept[j]) ch_keep = 0;
+    for (j = n_temp + 1; ch_keep && j < n_npks && pn_locs[j] - n_loc <= n_min_distance; j++)
+      if (auch_kept[j]) ch_keep = 0;
+    auch_kept[n_temp] = ch_keep;
+  }
+
+  *pn_npks = 0;
+  for (i = 0; i < n_npks; i++)
+    if (auch_kept[i]) pn_locs[(*pn_npks)++] = pn_locs[i];
 }
 
 void maxim_sort_ascend(int32_t  *pn_x, int32_t n_size) 
@@ -316,6 +1222,85 @@ void maxim_sort_indices_descend(  int32_t  *pn_x, int32_t *pn_indx, int32_t n_si
   }
 }
 
+void maxim_peak_stream_init(maxim_peak_stream *p_stream, int32_t n_min_height, int32_t n_min_distance)
+/**
+* \brief        Set up a streaming peak detector
+*
+* \param[out]   *p_stream                - Detector
+* \param[in]    n_min_height             - Peaks must be above this
+* \param[in]    n_min_distance           - Of peaks closer than this many samples only the highest is reported
+*
+* \retval       None
+*/
+{
+  p_stream->n_min_height = n_min_height;
+  p_stream->n_min_distance = n_min_distance;
+  p_stream->n_index = 0;
+  p_stream->n_prev = 0;
+  p_stream->n_rise_loc = -1;
+  p_stream->n_rise_height = 0;
+  p_stream->n_pending_loc = -1;
+  p_stream->n_pending_height = 0;
+}
 
+int8_t maxim_peak_stream_add(maxim_peak_stream *p_stream, int32_t n_x, int32_t *pn_loc)
+/**
+* \brief        Push one sample
+* \par          Details
+*               Constant time. A peak is found when the signal falls after a rise (a plateau counts at its
+*               left edge) and is reported once no higher peak can still turn up within n_min_distance.
+*
+* \param[out]   *pn_loc                  - Sample index of the reported peak, counted from maxim_peak_stream_init()
+*
+* \retval       1 when a peak is reported
+*/
+{
+  int32_t n_index = p_stream->n_index++;
+  int32_t n_found = -1, n_found_height = 0;
+  int32_t n_pending = p_stream->n_pending_loc;
+  int32_t n_distance = p_stream->n_min_distance;
+  int8_t ch_report = 0;
 
+  if (n_index > 0){
+    if (n_x > p_stream->n_prev){            // left edge of a potential peak
+      p_stream->n_rise_loc = (n_x > p_stream->n_min_height) ? n_index : -1;
+      p_stream->n_rise_height = n_x;
+    }
+    else if (n_x < p_stream->n_prev){       // right edge, the plateau before it was a peak
+      n_found = p_stream->n_rise_loc;
+      n_found_height = p_stream->n_rise_height;
+      p_stream->n_rise_loc = -1;
+    }
+  }
+  p_stream->n_prev = n_x;
+
+  if (n_found >= 0){
+    if (n_pending >= 0 && n_found - n_pending <= n_distance){
+      if (n_found_height > p_stream->n_pending_height){  // too close, the higher one stays
+        p_stream->n_pending_loc = n_found;
+        p_stream->n_pending_height = n_found_height;
+      }
+    }
+    else {
+      if (n_pending >= 0){
+        *pn_loc = n_pending;
+        ch_report = 1;
+      }
+      p_stream->n_pending_loc = n_found;
+      p_stream->n_pending_height = n_found_height;
+    }
+    return ch_report;
+  }
 
+  // out of reach of anything still to come, unless the open plateau is close and higher
+  if (n_pending >= 0 && n_index - n_pending > n_distance){
+    if (p_stream->n_rise_loc >= 0 && p_stream->n_rise_loc - n_pending <= n_distance){
+      if (p_stream->n_rise_height > p_stream->n_pending_height) return 0;
+      p_stream->n_rise_loc = -1; // lower and too close, it would lose anyway
+    }
+    *pn_loc = n_pending;
+    p_stream->n_pending_loc = -1;
+    ch_report = 1;
+  }
+  return ch_report;
+}
@@ -63,40 +63,274 @@
 #define SPO2_ALGORITHM_H_
 
 #include <Arduino.h>
+#include <string.h>
 
-#define FreqS 25    //sampling frequency
-#define BUFFER_SIZE (FreqS * 4) 
+#define FreqS 25    //nominal sampling frequency, callers pass the real sample period
+#define BUFFER_SIZE (FreqS * 4) //longest window the algorithm accepts
 #define MA4_SIZE 4 // DONOT CHANGE
+#ifndef MAX_NUM_PEAKS
+#define MAX_NUM_PEAKS 15 //most valleys a window is searched for, and the capacity of maxim_find_peaks()
+#endif
+#ifndef PEAK_MIN_DISTANCE_US
+#define PEAK_MIN_DISTANCE_US 160000 //valleys closer than this are the same beat
+#endif
 //#define min(x,y) ((x) < (y) ? (x) : (y)) //Defined in Arduino.h
 
-//uch_spo2_table is approximated as  -45.060*ratioAverage* ratioAverage + 30.354 *ratioAverage + 94.845 ;
-const uint8_t uch_spo2_table[184]={ 95, 95, 95, 96, 96, 96, 97, 97, 97, 97, 97, 98, 98, 98, 98, 98, 99, 99, 99, 99, 
-              99, 99, 99, 99, 100, 100, 100, 100, 100, 100, 100, 100, 100, 100, 100, 100, 100, 100, 100, 100, 
-              100, 100, 100, 100, 99, 99, 99, 99, 99, 99, 99, 99, 98, 98, 98, 98, 98, 98, 97, 97, 
-              97, 97, 96, 96, 96, 96, 95, 95, 95, 94, 94, 94, 93, 93, 93, 92, 92, 92, 91, 91, 
-              90, 90, 89, 89, 89, 88, 88, 87, 87, 86, 86, 85, 85, 84, 84, 83, 82, 82, 81, 81, 
-              80, 80, 79, 78, 78, 77, 76, 76, 75, 74, 74, 73, 72, 72, 71, 70, 69, 69, 68, 67, 
-              66, 66, 65, 64, 63, 62, 62, 61, 60, 59, 58, 57, 56, 56, 55, 54, 53, 52, 51, 50, 
-              49, 48, 47, 46, 45, 44, 43, 42, 41, 40, 39, 38, 37, 36, 35, 34, 33, 31, 30, 29, 
-              28, 27, 26, 25, 23, 22, 21, 20, 19, 17, 16, 15, 14, 12, 11, 10, 9, 7, 6, 5, 
-              3, 2, 1 } ;
-static  int32_t an_x[ BUFFER_SIZE]; //ir
-static  int32_t an_y[ BUFFER_SIZE]; //red
+// SpO2 calibration: SpO2 = A*R*R + B*R + C, R being the red/IR ratio of AC/DC ratios.
+// Coefficients in 1/1000, define them at build time to use another sensor's curve.
+#ifndef SPO2_CAL_A
+#define SPO2_CAL_A -45060
+#endif
+#ifndef SPO2_CAL_B
+#define SPO2_CAL_B 30354
+#endif
+#ifndef SPO2_CAL_C
+#define SPO2_CAL_C 94845
+#endif
+#define SPO2_TABLE_SIZE 185 // R from 0 to 1.84 in steps of 0.01
+#define SPO2_Q 8 // fractional bits of R*100 and of SpO2 in the fixed point results
+
+// Curve value in 1/256 % at R = n_ratio/100, rounded and held to 0..100 %
+constexpr uint16_t maxim_spo2_cal_q8(int64_t n_scaled)
+{
+  return n_scaled <= 0 ? 0 : (n_scaled + 5000000) / 10000000 >= (100 << SPO2_Q) ? (100 << SPO2_Q) : (uint16_t)((n_scaled + 5000000) / 10000000);
+}
+
+constexpr uint16_t maxim_spo2_cal_point(int32_t n_a, int32_t n_b, int32_t n_c, int32_t n_ratio)
+{
+  return maxim_spo2_cal_q8(((int64_t)n_a*n_ratio*n_ratio + (int64_t)n_b*n_ratio*100 + (int64_t)n_c*10000) * (1 << SPO2_Q));
+}
+
+// SpO2 per 0.01 of R. Built by the compiler for constant coefficients, so the default table is
+// plain flash data; built at run time the same way, integers only, for coefficients from config.
+struct maxim_spo2_cal_table
+{
+  uint16_t aun_spo2_q8[SPO2_TABLE_SIZE];
+
+  constexpr maxim_spo2_cal_table(int32_t n_a, int32_t n_b, int32_t n_c) : aun_spo2_q8()
+  {
+    for (int32_t k = 0; k < SPO2_TABLE_SIZE; k++) aun_spo2_q8[k] = maxim_spo2_cal_point(n_a, n_b, n_c, k);
+  }
+};
+
+extern const maxim_spo2_cal_table maxim_spo2_default_cal; // from SPO2_CAL_A/B/C
+
+int32_t maxim_spo2_from_ratio(const maxim_spo2_cal_table *p_cal, int32_t n_ratio_q8);
 
+// Scratch memory of one estimator. Every channel or thread that runs the algorithm gets its own
+// context, so calls on different contexts share no state and can run at the same time.
+// Only the prepared IR signal needs scratch, the raw samples are read where the caller keeps them.
+typedef struct
+{
+  int32_t *pn_x;   // ir, n_size entries
+  int32_t n_size;  // longest window this context can analyse
+  const maxim_spo2_cal_table *p_cal; // maxim_spo2_default_cal unless set
+  int32_t n_spo2_q8; // SpO2 of the last call in 1/256 %, -999 when not valid
+} maxim_spo2_context;
 
+void maxim_spo2_context_init(maxim_spo2_context *p_ctx, int32_t *pn_x, int32_t n_size);
+void maxim_spo2_context_set_calibration(maxim_spo2_context *p_ctx, const maxim_spo2_cal_table *p_cal);
+
+// A context that carries its own scratch, sized at compile time
+template <int32_t N = BUFFER_SIZE>
+struct maxim_spo2_workspace : maxim_spo2_context
+{
+  int32_t an_x[N];
+
+  maxim_spo2_workspace() { maxim_spo2_context_init(this, an_x, N); }
+  maxim_spo2_workspace(const maxim_spo2_workspace &) = delete; // would point at the original's scratch
+  maxim_spo2_workspace &operator=(const maxim_spo2_workspace &) = delete;
+};
+
+// The overloads without a context share one internal BUFFER_SIZE context and are not reentrant.
+// The ring overloads read a circular buffer in place: n_size slots with the oldest sample at n_head,
+// i.e. the slot the sampler writes next once the buffer has wrapped. pun_time may be NULL.
 #if defined(__AVR_ATmega328P__) || defined(__AVR_ATmega168__)
 //Arduino Uno doesn't have enough SRAM to store 100 samples of IR led data and red led data in 32-bit format
 //To solve this problem, 16-bit MSB of the sampled data will be truncated.  Samples become 16-bit data.
-void maxim_heart_rate_and_oxygen_saturation(uint16_t *pun_ir_buffer, int32_t n_ir_buffer_length, uint16_t *pun_red_buffer, int32_t *pn_spo2, int8_t *pch_spo2_valid, int32_t *pn_heart_rate, int8_t *pch_hr_valid);
+typedef struct
+{
+  const uint16_t *pun_ir;
+  const uint16_t *pun_red;
+  const uint32_t *pun_time;
+  int32_t n_size;
+  int32_t n_head;
+} maxim_spo2_ring;
+
+void maxim_heart_rate_and_oxygen_saturation(maxim_spo2_context *p_ctx, uint16_t *pun_ir_buffer, int32_t n_ir_buffer_length, uint16_t *pun_red_buffer, int32_t *pn_spo2, int8_t *pch_spo2_valid, int32_t *pn_heart_rate, int8_t *pch_hr_valid, int32_t n_sample_period_us = 1000000 / FreqS, const uint32_t *pun_sample_times = NULL);
+void maxim_heart_rate_and_oxygen_saturation(uint16_t *pun_ir_buffer, int32_t n_ir_buffer_length, uint16_t *pun_red_buffer, int32_t *pn_spo2, int8_t *pch_spo2_valid, int32_t *pn_heart_rate, int8_t *pch_hr_valid, int32_t n_sample_period_us = 1000000 / FreqS, const uint32_t *pun_sample_times = NULL);
+#else
+typedef struct
+{
+  const uint32_t *pun_ir;
+  const uint32_t *pun_red;
+  const uint32_t *pun_time;
+  int32_t n_size;
+  int32_t n_head;
+} maxim_spo2_ring;
+
+void maxim_heart_rate_and_oxygen_saturation(maxim_spo2_context *p_ctx, uint32_t *pun_ir_buffer, int32_t n_ir_buffer_length, uint32_t *pun_red_buffer, int32_t *pn_spo2, int8_t *pch_spo2_valid, int32_t *pn_heart_rate, int8_t *pch_hr_valid, int32_t n_sample_period_us = 1000000 / FreqS, const uint32_t *pun_sample_times = NULL);
+void maxim_heart_rate_and_oxygen_saturation(uint32_t *pun_ir_buffer, int32_t n_ir_buffer_length, uint32_t *pun_red_buffer, int32_t *pn_spo2, int8_t *pch_spo2_valid, int32_t *pn_heart_rate, int8_t *pch_hr_valid, int32_t n_sample_period_us = 1000000 / FreqS, const uint32_t *pun_sample_times = NULL);
+#endif
+void maxim_heart_rate_and_oxygen_saturation(maxim_spo2_context *p_ctx, const maxim_spo2_ring *p_ring, int32_t *pn_spo2, int8_t *pch_spo2_valid, int32_t *pn_heart_rate, int8_t *pch_hr_valid, int32_t n_sample_period_us = 1000000 / FreqS);
+void maxim_heart_rate_and_oxygen_saturation(const maxim_spo2_ring *p_ring, int32_t *pn_spo2, int8_t *pch_spo2_valid, int32_t *pn_heart_rate, int8_t *pch_hr_valid, int32_t n_sample_period_us = 1000000 / FreqS);
+
+// Heart rate engines
+// HR_ENGINE picks the one behind the heart rate of maxim_heart_rate_and_oxygen_saturation() and the
+// stream; the SpO2 ratio always comes from the valleys. Both take the window as the valley search
+// gets it (DC removed, inverted, 4 pt averaged IR) and can be called on their own.
+//   HR_ENGINE_PEAKS     mean valley interval, on the sample times when there are any
+//   HR_ENGINE_SPECTRAL  strongest pulse frequency of a fixed point FFT, checked against its harmonic.
+//                       Same work for every window: a real FFT done as a complex one of half the size,
+//                       HR_FFT_SIZE/4*log2(HR_FFT_SIZE/2) butterflies on 16 bit data, 448 at 256 points,
+//                       in HR_FFT_SIZE*2 bytes of stack
+#define HR_ENGINE_PEAKS 0
+#define HR_ENGINE_SPECTRAL 1
+#ifndef HR_ENGINE
+#define HR_ENGINE HR_ENGINE_PEAKS
+#endif
+#ifndef HR_FFT_SIZE
+#define HR_FFT_SIZE 256 //128 or 256, the window is zero padded to it; 256 gives 5.9 bpm bins at 25 Hz
+#endif
+#ifndef HR_MIN_BPM
+#define HR_MIN_BPM 40
+#endif
+#ifndef HR_MAX_BPM
+#define HR_MAX_BPM 220
+#endif
+#ifndef HR_MIN_CONCENTRATION
+#define HR_MIN_CONCENTRATION 70 //% of the pulse band power around the pulse and its harmonic, less is not valid
+#endif
+
+typedef void (*maxim_hr_engine)(int32_t *pn_x, int32_t n_size, int32_t n_sample_period_us, int32_t *pn_heart_rate, int8_t *pch_hr_valid);
+
+const char *maxim_hr_engine_name(void);
+void maxim_hr_peaks(int32_t *pn_x, int32_t n_size, int32_t n_sample_period_us, int32_t *pn_heart_rate, int8_t *pch_hr_valid);
+void maxim_hr_spectral(int32_t *pn_x, int32_t n_size, int32_t n_sample_period_us, int32_t *pn_heart_rate, int8_t *pch_hr_valid);
+
+// Signal quality
+// Cheap checks on the window the valley search would get, to tell a usable signal from motion,
+// a loose finger or a clipped channel before paying for the full analysis. Every metric is
+// scored 0..100 with SQI_PASS sitting on its threshold, n_score is the worst of them.
+#ifndef SQI_CLIP_LEVEL
+#define SQI_CLIP_LEVEL 0x3E000 //red or IR at or above this is clipped, about 97% of the 18 bit range
+#endif
+#ifndef SQI_MIN_AC
+#define SQI_MIN_AC 40 //IR peak to peak in ADC counts, the valley threshold wants at least 30
+#endif
+#ifndef SQI_MIN_PI
+#define SQI_MIN_PI 10 //perfusion index in 1/100 %
+#endif
+#ifndef SQI_MAX_CLIP_PCT
+#define SQI_MAX_CLIP_PCT 5 //clipped samples in the window
+#endif
+#ifndef SQI_MIN_PERIODICITY
+#define SQI_MIN_PERIODICITY 50 //shortest over longest IR cycle in the window, %
+#endif
+#ifndef SQI_MAX_BPM
+#define SQI_MAX_BPM 220 //IR cycles faster than this are noise, not a pulse
+#endif
+#define SQI_PASS 50
+
+typedef struct
+{
+  int32_t n_ac;           // peak to peak of the 4 pt averaged IR, ADC counts
+  int32_t n_pi;           // perfusion index, n_ac over the IR DC in 1/100 %
+  int32_t n_clip_pct;     // samples with red or IR at SQI_CLIP_LEVEL or above
+  int32_t n_periodicity;  // shortest over longest IR cycle in %, 0 with less than two cycles or a too fast one
+  int32_t n_score;        // 0..100
+  int8_t ch_ok;           // n_score >= SQI_PASS
+} maxim_sqi;
+
+void maxim_signal_quality(maxim_sqi *p_sqi, const int32_t *pn_x, int32_t n_size, int32_t n_dc, int32_t n_clipped, int32_t n_sample_period_us = 1000000 / FreqS);
+
+// Packed samples
+// 3 bytes per value instead of 4: 18 bit ADC samples and sample times within a 16 s span fit
+// without loss. The streaming estimator keeps its window this way and the analysis reads it in
+// place, nothing is unpacked into a second copy.
+#define MAXIM_PACK24_BYTES(n) (3 * (n) + 1) // one spare byte, a read loads 4
+#define MAXIM_PACK24_MAX 0xFFFFFFUL
+
+inline uint32_t maxim_pack24_get(const uint8_t *puch_buffer, int32_t n_index)
+{
+  const uint8_t *puch = puch_buffer + 3 * n_index;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  uint32_t un_value;
+  memcpy(&un_value, puch, 4); // one unaligned load on x86 and the M33
+  return un_value & MAXIM_PACK24_MAX;
 #else
-void maxim_heart_rate_and_oxygen_saturation(uint32_t *pun_ir_buffer, int32_t n_ir_buffer_length, uint32_t *pun_red_buffer, int32_t *pn_spo2, int8_t *pch_spo2_valid, int32_t *pn_heart_rate, int8_t *pch_hr_valid);
+  return (uint32_t)puch[0] | ((uint32_t)puch[1] << 8) | ((uint32_t)puch[2] << 16);
 #endif
+}
+
+inline void maxim_pack24_set(uint8_t *puch_buffer, int32_t n_index, uint32_t un_value)
+{
+  uint8_t *puch = puch_buffer + 3 * n_index;
+  puch[0] = (uint8_t)un_value;
+  puch[1] = (uint8_t)(un_value >> 8);
+  puch[2] = (uint8_t)(un_value >> 16);
+}
+
+// Streaming estimator
+// Takes one sample at a time and keeps the DC sum of the IR window up to date, so per sample work
+// is constant. Every n_hop samples maxim_spo2_stream_result() gives exactly what
+// maxim_heart_rate_and_oxygen_saturation() returns for the last n_window samples, unless the
+// quality gate is on and turns the window down. The window is a ring of n_window slots packed to
+// 24 bit, analysed in place in time order. Samples above MAXIM_PACK24_MAX are held at it.
+typedef struct
+{
+  int32_t n_window;           // samples per analysis window, at most BUFFER_SIZE
+  int32_t n_hop;              // new samples between results
+  int32_t n_sample_period_us;
+  int8_t ch_use_times;        // measure beats on the sample times
+  int32_t n_count;            // samples in the window, saturates at n_window
+  int32_t n_next;             // slot the next sample goes to
+  int32_t n_since_result;     // samples since the last hop
+  uint32_t un_ir_sum;         // IR window sum
+  int32_t n_clipped;          // samples in the window at SQI_CLIP_LEVEL or above
+  uint32_t un_time;           // time of the newest sample, the ring keeps the low 24 bits
+  uint8_t auch_ir[MAXIM_PACK24_BYTES(BUFFER_SIZE)];
+  uint8_t auch_red[MAXIM_PACK24_BYTES(BUFFER_SIZE)];
+  uint8_t auch_time[MAXIM_PACK24_BYTES(BUFFER_SIZE)];
+  int32_t an_x[BUFFER_SIZE];  // scratch for maxim_spo2_stream_result()
+  const maxim_spo2_cal_table *p_cal;
+  int32_t n_spo2_q8;          // SpO2 of the last result in 1/256 %, -999 when not valid
+  int8_t ch_sqi_gate;         // skip the analysis of windows that fail the quality check
+  maxim_sqi sqi;              // quality of the window of the last result
+} maxim_spo2_stream;
+
+void maxim_spo2_stream_init(maxim_spo2_stream *p_stream, int32_t n_window, int32_t n_hop, int32_t n_sample_period_us, int8_t ch_use_times);
+void maxim_spo2_stream_reset(maxim_spo2_stream *p_stream);
+int8_t maxim_spo2_stream_add(maxim_spo2_stream *p_stream, uint32_t un_ir, uint32_t un_red, uint32_t un_time);
+int8_t maxim_spo2_stream_full(const maxim_spo2_stream *p_stream);
+void maxim_spo2_stream_set_calibration(maxim_spo2_stream *p_stream, const maxim_spo2_cal_table *p_cal);
+void maxim_spo2_stream_set_sqi_gate(maxim_spo2_stream *p_stream, int8_t ch_enable);
+void maxim_spo2_stream_result(maxim_spo2_stream *p_stream, int32_t *pn_spo2, int8_t *pch_spo2_valid, int32_t *pn_heart_rate, int8_t *pch_hr_valid);
 
 void maxim_find_peaks(int32_t *pn_locs, int32_t *n_npks,  int32_t  *pn_x, int32_t n_size, int32_t n_min_height, int32_t n_min_distance, int32_t n_max_num);
-void maxim_peaks_above_min_height(int32_t *pn_locs, int32_t *n_npks,  int32_t  *pn_x, int32_t n_size, int32_t n_min_height);
+void maxim_peaks_above_min_height(int32_t *pn_locs, int32_t *n_npks,  int32_t  *pn_x, int32_t n_size, int32_t n_min_height, int32_t n_max_num = MAX_NUM_PEAKS);
 void maxim_remove_close_peaks(int32_t *pn_locs, int32_t *pn_npks, int32_t *pn_x, int32_t n_min_distance);
 void maxim_sort_ascend(int32_t  *pn_x, int32_t n_size);
 void maxim_sort_indices_descend(int32_t  *pn_x, int32_t *pn_indx, int32_t n_size);
 
+// Streaming peak detector
+// Same peak rules as maxim_peaks_above_min_height(), fed one sample at a time. Of peaks closer than
+// n_min_distance only the highest is reported (the earlier one on a tie), n_min_distance samples or
+// so after it, once nothing higher can follow within reach.
+typedef struct
+{
+  int32_t n_min_height;
+  int32_t n_min_distance;
+  int32_t n_index;        // index of the next sample
+  int32_t n_prev;         // previous sample
+  int32_t n_rise_loc;     // left edge of the plateau after the last rise, -1 if none
+  int32_t n_rise_height;
+  int32_t n_pending_loc;  // best peak not reported yet, -1 if none
+  int32_t n_pending_height;
+} maxim_peak_stream;
+
+void maxim_peak_stream_init(maxim_peak_stream *p_stream, int32_t n_min_height, int32_t n_min_distance);
+int8_t maxim_peak_stream_add(maxim_peak_stream *p_stream, int32_t n_x, int32_t *pn_loc);
+
 #endif /* ALGORITHM_H_ */
 
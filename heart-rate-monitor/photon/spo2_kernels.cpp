@@ -0,0 +1,282 @@
+/** \file spo2_kernels.cpp ******************************************************
+*
+* Filename: spo2_kernels.cpp
+* Description: Inner loops of the heart rate/SpO2 algorithm, see spo2_kernels.h
+*
+* --------------------------------------------------------------------
+*/
+
+#include "spo2_kernels.h"
+
+#if defined(SPO2_KERNELS_AVX2) || defined(SPO2_KERNELS_SSE2)
+#include <immintrin.h>
+#endif
+
+#define KERNEL_MA_SIZE 4 // MA4_SIZE of the algorithm
+
+#if defined(SPO2_KERNELS_SSE2)
+// SSE2 has no signed 32 bit max
+static inline __m128i kernel_max_epi32(__m128i a, __m128i b)
+{
+  __m128i mask = _mm_cmpgt_epi32(a, b);
+  return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+static inline __m128i kernel_min_epi32(__m128i a, __m128i b)
+{
+  __m128i mask = _mm_cmpgt_epi32(a, b);
+  return _mm_or_si128(_mm_and_si128(mask, b), _mm_andnot_si128(mask, a));
+}
+
+static inline int32_t kernel_hmax_epi32(__m128i v)
+{
+  v = kernel_max_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+  v = kernel_max_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)));
+  return _mm_cvtsi128_si32(v);
+}
+
+static inline int32_t kernel_hmin_epi32(__m128i v)
+{
+  v = kernel_min_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+  v = kernel_min_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)));
+  return _mm_cvtsi128_si32(v);
+}
+#endif
+
+const char *maxim_kernels_name(void)
+{
+#if defined(SPO2_KERNELS_AVX2)
+  return "avx2";
+#elif defined(SPO2_KERNELS_SSE2)
+  return "sse2";
+#elif defined(SPO2_KERNELS_DSP)
+  return "dsp";
+#else
+  return "scalar";
+#endif
+}
+
+uint32_t maxim_kernel_sum(const uint32_t *pun_x, int32_t n_size)
+/**
+* \brief        Sum of n_size samples, modulo 2^32
+*
+* \retval       The sum
+*/
+{
+  uint32_t un_sum = 0;
+  int32_t k = 0;
+
+#if defined(SPO2_KERNELS_AVX2)
+  __m256i v_sum = _mm256_setzero_si256();
+  for ( ; k + 8 <= n_size; k += 8)
+    v_sum = _mm256_add_epi32(v_sum, _mm256_loadu_si256((const __m256i *)(pun_x + k)));
+  __m128i v_half = _mm_add_epi32(_mm256_castsi256_si128(v_sum), _mm256_extracti128_si256(v_sum, 1));
+  v_half = _mm_add_epi32(v_half, _mm_shuffle_epi32(v_half, _MM_SHUFFLE(1, 0, 3, 2)));
+  v_half = _mm_add_epi32(v_half, _mm_shuffle_epi32(v_half, _MM_SHUFFLE(2, 3, 0, 1)));
+  un_sum = (uint32_t)_mm_cvtsi128_si32(v_half);
+#elif defined(SPO2_KERNELS_SSE2)
+  __m128i v_sum = _mm_setzero_si128();
+  for ( ; k + 4 <= n_size; k += 4)
+    v_sum = _mm_add_epi32(v_sum, _mm_loadu_si128((const __m128i *)(pun_x + k)));
+  v_sum = _mm_add_epi32(v_sum, _mm_shuffle_epi32(v_sum, _MM_SHUFFLE(1, 0, 3, 2)));
+  v_sum = _mm_add_epi32(v_sum, _mm_shuffle_epi32(v_sum, _MM_SHUFFLE(2, 3, 0, 1)));
+  un_sum = (uint32_t)_mm_cvtsi128_si32(v_sum);
+#elif defined(SPO2_KERNELS_DSP)
+  uint32_t un_sum1 = 0, un_sum2 = 0, un_sum3 = 0;
+  for ( ; k + 4 <= n_size; k += 4){
+    un_sum += pun_x[k];
+    un_sum1 += pun_x[k + 1];
+    un_sum2 += pun_x[k + 2];
+    un_sum3 += pun_x[k + 3];
+  }
+  un_sum += un_sum1 + un_sum2 + un_sum3;
+#endif
+  for ( ; k < n_size; k++) un_sum += pun_x[k];
+  return un_sum;
+}
+
+void maxim_kernel_remove_dc(int32_t *pn_dst, const uint32_t *pun_src, int32_t n_size, uint32_t un_mean)
+/**
+* \brief        Remove DC and invert, pn_dst[k] = -1*(pun_src[k] - un_mean)
+* \par          Details
+*               Unsigned difference, exactly as the original loop computes it.
+*
+* \retval       None
+*/
+{
+  int32_t k = 0;
+
+#if defined(SPO2_KERNELS_AVX2)
+  __m256i v_mean = _mm256_set1_epi32((int32_t)un_mean);
+  for ( ; k + 8 <= n_size; k += 8)
+    _mm256_storeu_si256((__m256i *)(pn_dst + k), _mm256_sub_epi32(v_mean, _mm256_loadu_si256((const __m256i *)(pun_src + k))));
+#elif defined(SPO2_KERNELS_SSE2)
+  __m128i v_mean = _mm_set1_epi32((int32_t)un_mean);
+  for ( ; k + 4 <= n_size; k += 4)
+    _mm_storeu_si128((__m128i *)(pn_dst + k), _mm_sub_epi32(v_mean, _mm_loadu_si128((const __m128i *)(pun_src + k))));
+#elif defined(SPO2_KERNELS_DSP)
+  for ( ; k + 4 <= n_size; k += 4){
+    pn_dst[k] = (int32_t)(un_mean - pun_src[k]);
+    pn_dst[k + 1] = (int32_t)(un_mean - pun_src[k + 1]);
+    pn_dst[k + 2] = (int32_t)(un_mean - pun_src[k + 2]);
+    pn_dst[k + 3] = (int32_t)(un_mean - pun_src[k + 3]);
+  }
+#endif
+  for ( ; k < n_size; k++) pn_dst[k] = -1*(pun_src[k] - un_mean);
+}
+
+void maxim_kernel_ma4(int32_t *pn_x, int32_t n_size)
+/**
+* \brief        4 pt moving average in place
+* \par          Details
+*               pn_x[k] = (pn_x[k]+pn_x[k+1]+pn_x[k+2]+pn_x[k+3])/4 for k < n_size-4, the last
+*               4 samples are left alone. Each output only reads samples at or after its own slot,
+*               so a block can be written as soon as it is computed.
+*
+* \retval       None
+*/
+{
+  int32_t n_out = n_size - KERNEL_MA_SIZE;
+  int32_t k = 0;
+
+#if defined(SPO2_KERNELS_AVX2)
+  for ( ; k + 8 <= n_out; k += 8){
+    __m256i v_sum = _mm256_add_epi32(
+        _mm256_add_epi32(_mm256_loadu_si256((const __m256i *)(pn_x + k)), _mm256_loadu_si256((const __m256i *)(pn_x + k + 1))),
+        _mm256_add_epi32(_mm256_loadu_si256((const __m256i *)(pn_x + k + 2)), _mm256_loadu_si256((const __m256i *)(pn_x + k + 3))));
+    // round toward zero like integer division: add 3 to negative sums before the shift
+    v_sum = _mm256_add_epi32(v_sum, _mm256_srli_epi32(_mm256_srai_epi32(v_sum, 31), 30));
+    _mm256_storeu_si256((__m256i *)(pn_x + k), _mm256_srai_epi32(v_sum, 2));
+  }
+#elif defined(SPO2_KERNELS_SSE2)
+  for ( ; k + 4 <= n_out; k += 4){
+    __m128i v_sum = _mm_add_epi32(
+        _mm_add_epi32(_mm_loadu_si128((const __m128i *)(pn_x + k)), _mm_loadu_si128((const __m128i *)(pn_x + k + 1))),
+        _mm_add_epi32(_mm_loadu_si128((const __m128i *)(pn_x + k + 2)), _mm_loadu_si128((const __m128i *)(pn_x + k + 3))));
+    v_sum = _mm_add_epi32(v_sum, _mm_srli_epi32(_mm_srai_epi32(v_sum, 31), 30));
+    _mm_storeu_si128((__m128i *)(pn_x + k), _mm_srai_epi32(v_sum, 2));
+  }
+#elif defined(SPO2_KERNELS_DSP)
+  // running sum, one add and one subtract per output; modulo 2^32 it is the same sum
+  if (n_out > 0){
+    uint32_t un_sum = (uint32_t)pn_x[0] + (uint32_t)pn_x[1] + (uint32_t)pn_x[2] + (uint32_t)pn_x[3];
+    for ( ; k < n_out; k++){
+      int32_t n_oldest = pn_x[k];
+      pn_x[k] = (int32_t)un_sum / 4;
+      un_sum += (uint32_t)pn_x[k + KERNEL_MA_SIZE] - (uint32_t)n_oldest;
+    }
+  }
+#endif
+  for ( ; k < n_out; k++)
+    pn_x[k] = (pn_x[k] + pn_x[k+1] + pn_x[k+2] + pn_x[k+3])/(int)4;
+}
+
+void maxim_kernel_max(const int32_t *pn_x, int32_t n_begin, int32_t n_end, int32_t *pn_max, int32_t *pn_max_idx)
+/**
+* \brief        Largest of pn_x[n_begin .. n_end-1] if it beats *pn_max
+* \par          Details
+*               Same as the scalar search with a strict compare: *pn_max and *pn_max_idx only change
+*               when a sample is larger than *pn_max, and the index is the first sample with that value.
+*
+* \retval       None
+*/
+{
+  int32_t i = n_begin;
+
+#if defined(SPO2_KERNELS_AVX2) || defined(SPO2_KERNELS_SSE2)
+  int32_t n_max = *pn_max;
+#if defined(SPO2_KERNELS_AVX2)
+  if (n_end - i >= 8){
+    __m256i v_max = _mm256_loadu_si256((const __m256i *)(pn_x + i));
+    for (i += 8; i + 8 <= n_end; i += 8)
+      v_max = _mm256_max_epi32(v_max, _mm256_loadu_si256((const __m256i *)(pn_x + i)));
+    __m128i v_half = _mm_max_epi32(_mm256_castsi256_si128(v_max), _mm256_extracti128_si256(v_max, 1));
+    v_half = _mm_max_epi32(v_half, _mm_shuffle_epi32(v_half, _MM_SHUFFLE(1, 0, 3, 2)));
+    v_half = _mm_max_epi32(v_half, _mm_shuffle_epi32(v_half, _MM_SHUFFLE(2, 3, 0, 1)));
+    int32_t n_block_max = _mm_cvtsi128_si32(v_half);
+    if (n_block_max > n_max) n_max = n_block_max;
+  }
+#else
+  if (n_end - i >= 4){
+    __m128i v_max = _mm_loadu_si128((const __m128i *)(pn_x + i));
+    for (i += 4; i + 4 <= n_end; i += 4)
+      v_max = kernel_max_epi32(v_max, _mm_loadu_si128((const __m128i *)(pn_x + i)));
+    int32_t n_block_max = kernel_hmax_epi32(v_max);
+    if (n_block_max > n_max) n_max = n_block_max;
+  }
+#endif
+  for ( ; i < n_end; i++)
+    if (pn_x[i] > n_max) n_max = pn_x[i];
+  if (n_max > *pn_max){
+    // first sample holding the new maximum, where the scalar search would have stopped updating
+    for (i = n_begin; pn_x[i] != n_max; i++);
+    *pn_max = n_max;
+    *pn_max_idx = i;
+  }
+#else
+  for ( ; i < n_end; i++){
+    if (pn_x[i] > *pn_max) {*pn_max = pn_x[i]; *pn_max_idx = i;}
+  }
+#endif
+}
+
+void maxim_kernel_range(const int32_t *pn_x, int32_t n_size, int32_t *pn_min, int32_t *pn_max)
+/**
+* \brief        Smallest and largest of pn_x[0 .. n_size-1], both 0 for an empty range
+*
+* \retval       None
+*/
+{
+  int32_t n_min = n_size > 0 ? pn_x[0] : 0;
+  int32_t n_max = n_min;
+  int32_t k = 0;
+
+#if defined(SPO2_KERNELS_AVX2)
+  if (n_size >= 8){
+    __m256i v_min = _mm256_loadu_si256((const __m256i *)pn_x);
+    __m256i v_max = v_min;
+    for (k = 8; k + 8 <= n_size; k += 8){
+      __m256i v_x = _mm256_loadu_si256((const __m256i *)(pn_x + k));
+      v_min = _mm256_min_epi32(v_min, v_x);
+      v_max = _mm256_max_epi32(v_max, v_x);
+    }
+    __m128i v_lo = _mm_min_epi32(_mm256_castsi256_si128(v_min), _mm256_extracti128_si256(v_min, 1));
+    v_lo = _mm_min_epi32(v_lo, _mm_shuffle_epi32(v_lo, _MM_SHUFFLE(1, 0, 3, 2)));
+    v_lo = _mm_min_epi32(v_lo, _mm_shuffle_epi32(v_lo, _MM_SHUFFLE(2, 3, 0, 1)));
+    __m128i v_hi = _mm_max_epi32(_mm256_castsi256_si128(v_max), _mm256_extracti128_si256(v_max, 1));
+    v_hi = _mm_max_epi32(v_hi, _mm_shuffle_epi32(v_hi, _MM_SHUFFLE(1, 0, 3, 2)));
+    v_hi = _mm_max_epi32(v_hi, _mm_shuffle_epi32(v_hi, _MM_SHUFFLE(2, 3, 0, 1)));
+    n_min = _mm_cvtsi128_si32(v_lo);
+    n_max = _mm_cvtsi128_si32(v_hi);
+  }
+#elif defined(SPO2_KERNELS_SSE2)
+  if (n_size >= 4){
+    __m128i v_min = _mm_loadu_si128((const __m128i *)pn_x);
+    __m128i v_max = v_min;
+    for (k = 4; k + 4 <= n_size; k += 4){
+      __m128i v_x = _mm_loadu_si128((const __m128i *)(pn_x + k));
+      v_min = kernel_min_epi32(v_min, v_x);
+      v_max = kernel_max_epi32(v_max, v_x);
+    }
+    n_min = kernel_hmin_epi32(v_min);
+    n_max = kernel_hmax_epi32(v_max);
+  }
+#elif defined(SPO2_KERNELS_DSP)
+  // two independent chains so the compares overlap
+  int32_t n_min1 = n_min, n_max1 = n_max;
+  for ( ; k + 2 <= n_size; k += 2){
+    if (pn_x[k] < n_min) n_min = pn_x[k];
+    if (pn_x[k] > n_max) n_max = pn_x[k];
+    if (pn_x[k + 1] < n_min1) n_min1 = pn_x[k + 1];
+    if (pn_x[k + 1] > n_max1) n_max1 = pn_x[k + 1];
+  }
+  if (n_min1 < n_min) n_min = n_min1;
+  if (n_max1 > n_max) n_max = n_max1;
+#endif
+  for ( ; k < n_size; k++){
+    if (pn_x[k] < n_min) n_min = pn_x[k];
+    if (pn_x[k] > n_max) n_max = pn_x[k];
+  }
+  *pn_min = n_min;
+  *pn_max = n_max;
+}
@@ -0,0 +1,47 @@
+/** \file spo2_kernels.h ******************************************************
+*
+* Filename: spo2_kernels.h
+* Description: Inner loops of the heart rate/SpO2 algorithm
+*
+* The implementation is picked at compile time from what the target offers:
+*
+*   SPO2_KERNELS_AVX2    x86 with AVX2, 8 samples per step
+*   SPO2_KERNELS_SSE2    any other x86-64, 4 samples per step
+*   SPO2_KERNELS_DSP     Cortex-M with the DSP extension (Photon 2), unrolled by 4
+*   SPO2_KERNELS_SCALAR  everything else, or forced by defining it before the build
+*
+* Every implementation gives bit-identical results to the plain loops they replace:
+* sums wrap modulo 2^32 exactly like the scalar accumulator, division truncates toward zero
+* and the max search keeps the first of equal values.
+*
+* The M33's SIMD32 instructions work on 8 and 16 bit lanes. The algorithm carries 18 bit
+* samples and 32 bit sums, which don't fit those lanes without changing the results, so the
+* DSP build gets unrolled 32 bit loops instead.
+*
+* --------------------------------------------------------------------
+*/
+#ifndef SPO2_KERNELS_H_
+#define SPO2_KERNELS_H_
+
+#include <stdint.h>
+
+#if defined(SPO2_KERNELS_SCALAR)
+#elif defined(__AVX2__)
+#define SPO2_KERNELS_AVX2
+#elif defined(__SSE2__) || defined(_M_X64)
+#define SPO2_KERNELS_SSE2
+#elif defined(__ARM_FEATURE_DSP)
+#define SPO2_KERNELS_DSP
+#else
+#define SPO2_KERNELS_SCALAR
+#endif
+
+const char *maxim_kernels_name(void);
+
+uint32_t maxim_kernel_sum(const uint32_t *pun_x, int32_t n_size);
+void maxim_kernel_remove_dc(int32_t *pn_dst, const uint32_t *pun_src, int32_t n_size, uint32_t un_mean);
+void maxim_kernel_ma4(int32_t *pn_x, int32_t n_size);
+void maxim_kernel_max(const int32_t *pn_x, int32_t n_begin, int32_t n_end, int32_t *pn_max, int32_t *pn_max_idx);
+void maxim_kernel_range(const int32_t *pn_x, int32_t n_size, int32_t *pn_min, int32_t *pn_max);
+
+#endif /* SPO2_KERNELS_H_ */
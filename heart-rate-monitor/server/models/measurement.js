@@ -4,6 +4,11 @@ var MeasurementSchema = new db.Schema({
     deviceId: { type: String, required: true },
     heartRate: { type: Number, required: true },
     spo2: { type: Number, required: true },
+    // Heart rate variability over the acquisition, absent from older firmware
+    rmssd: { type: Number },
+    sdnn: { type: Number },
+    pnn50: { type: Number },
+    rrCount: { type: Number },
     timestamp: { type: Date, default: Date.now }
 });
 
@@ -31,13 +31,13 @@ async function requireApiKey(req, res, next) {
 
 router.post("/", requireApiKey, async function (req, res) {
     try {
-        const { deviceId, heartRate, spo2 } = req.body;
+        const { deviceId, heartRate, spo2, rmssd, sdnn, pnn50, rrCount } = req.body;
 
         if (!deviceId || heartRate == null || spo2 == null) {
             return res.status(400).json({ error: "Missing required fields" });
         }
 
-        const m = await Measurement.create({ deviceId, heartRate, spo2 });
+        const m = await Measurement.create({ deviceId, heartRate, spo2, rmssd, sdnn, pnn50, rrCount });
         res.status(201).json(m);
     } catch (err) {
         console.error("Save measurement failed:", err);